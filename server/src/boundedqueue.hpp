@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+namespace metalware {
+// A FIFO shared between one or more producer threads and a consumer. Producers block while the
+// queue is full, which pushes back on whoever feeds them (e.g. the editor pipe), and the consumer
+// sleeps on a condition variable until an item arrives or the queue is closed.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+  BoundedQueue(BoundedQueue const&) = delete;
+  BoundedQueue& operator=(BoundedQueue const&) = delete;
+
+  // Returns false if the queue was closed before the item could be added.
+  bool push(T item) {
+    std::unique_lock lock(mutex_);
+    not_full_.wait(lock, [this] {
+      return closed_ || items_.size() < capacity_;
+    });
+    if (closed_) {
+      return false;
+    }
+
+    items_.push_back(std::move(item));
+    high_watermark_ = std::max(high_watermark_, items_.size());
+    lock.unlock();
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Blocks until an item is available. Returns std::nullopt once the queue is closed and drained.
+  std::optional<T> pop() {
+    std::unique_lock lock(mutex_);
+    not_empty_.wait(lock, [this] {
+      return closed_ || !items_.empty();
+    });
+    if (items_.empty()) {
+      return std::nullopt;
+    }
+
+    T item = std::move(items_.front());
+    items_.pop_front();
+    lock.unlock();
+    not_full_.notify_one();
+    return item;
+  }
+
+  // Waits until `deadline` for an item, then pops the head only if it satisfies `pred`. Lets the
+  // consumer look ahead without blocking on (or consuming) an item it does not want.
+  template <typename Pred>
+  std::optional<T> pop_if(Pred pred, std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock lock(mutex_);
+    not_empty_.wait_until(lock, deadline, [this] {
+      return closed_ || !items_.empty();
+    });
+    if (items_.empty() || !pred(items_.front())) {
+      return std::nullopt;
+    }
+
+    T item = std::move(items_.front());
+    items_.pop_front();
+    lock.unlock();
+    not_full_.notify_one();
+    return item;
+  }
+
+  // Wakes up every waiter. Items already queued can still be popped.
+  void close() {
+    {
+      std::lock_guard lock(mutex_);
+      closed_ = true;
+    }
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  [[nodiscard]] size_t size() const {
+    std::lock_guard lock(mutex_);
+    return items_.size();
+  }
+
+  [[nodiscard]] size_t high_watermark() const {
+    std::lock_guard lock(mutex_);
+    return high_watermark_;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<T> items_;
+  const size_t capacity_;
+  size_t high_watermark_ = 0;
+  bool closed_ = false;
+};
+}  // namespace metalware
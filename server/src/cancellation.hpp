@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "nlohmann/json.hpp"
+
+namespace metalware {
+// A cooperative cancellation flag shared between whoever may cancel a piece of work (the reader
+// thread, on $/cancelRequest or a new edit) and the work itself, which polls is_cancelled() between
+// phases and gives up early. A default-constructed token can never be cancelled.
+class CancellationToken {
+ public:
+  CancellationToken() = default;
+
+  static CancellationToken create() {
+    CancellationToken token;
+    token.flag_ = std::make_shared<std::atomic<bool>>(false);
+    return token;
+  }
+
+  void cancel() const {
+    if (flag_) {
+      flag_->store(true, std::memory_order_relaxed);
+    }
+  }
+
+  [[nodiscard]] bool is_cancelled() const {
+    return flag_ && flag_->load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::shared_ptr<std::atomic<bool>> flag_;
+};
+
+// Tokens of the requests that are queued or being handled, keyed by JSON-RPC request id.
+class CancellationRegistry {
+ public:
+  CancellationToken add(const nlohmann::json &id) {
+    auto token = CancellationToken::create();
+    std::lock_guard lock(mutex_);
+    requests_[id.dump()] = token;
+    return token;
+  }
+
+  void remove(const nlohmann::json &id) {
+    std::lock_guard lock(mutex_);
+    requests_.erase(id.dump());
+  }
+
+  // Returns false if the request already finished (or never existed).
+  bool cancel(const nlohmann::json &id) {
+    std::lock_guard lock(mutex_);
+    const auto itr = requests_.find(id.dump());
+    if (itr == requests_.end()) {
+      return false;
+    }
+    itr->second.cancel();
+    return true;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<std::string, CancellationToken> requests_;
+};
+}  // namespace metalware
@@ -0,0 +1,320 @@
+#include "dependencyclosure.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <fstream>
+#include <iterator>
+
+#include "utils.hpp"
+
+namespace metalware {
+
+namespace {
+constexpr std::array<std::string_view, 8> UNIT_KEYWORDS = {"module",
+    "macromodule",
+    "interface",
+    "program",
+    "package",
+    "primitive",
+    "checker",
+    "config"};
+
+// Words that may come between a unit keyword and its name, as in `interface class` or
+// `module automatic`.
+constexpr std::array<std::string_view, 3> QUALIFIERS = {"automatic", "static", "class"};
+
+bool is_identifier_start(char c) {
+  return std::isalpha(static_cast<unsigned char>(c)) || c == '_';
+}
+
+bool is_identifier_char(char c) {
+  return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+}
+
+// Removes the leading whitespace and the word after it (a backtick included) from `text`.
+std::string_view next_word(std::string_view &text) {
+  const size_t begin = text.find_first_not_of(" \t\r");
+  if (begin == std::string_view::npos) {
+    text = {};
+    return {};
+  }
+  text.remove_prefix(begin);
+
+  size_t end = text.front() == '`' ? 1 : 0;
+  while (end < text.size() && is_identifier_char(text[end]))
+    end++;
+  const auto word = text.substr(0, end);
+  text.remove_prefix(end);
+  return word;
+}
+
+std::optional<std::string> read_file(const fs::path &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return std::nullopt;
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+template <size_t N>
+bool is_one_of(std::string_view word, const std::array<std::string_view, N> &words) {
+  return std::find(words.begin(), words.end(), word) != words.end();
+}
+}  // namespace
+
+void find_declared_names(std::string_view line, std::vector<std::string> &names) {
+  std::string_view word = next_word(line);
+  if (word == "`define") {
+    const auto name = next_word(line);
+    if (!name.empty() && is_identifier_start(name.front()))
+      names.push_back("`" + std::string(name));
+    return;
+  }
+
+  if (!is_one_of(word, UNIT_KEYWORDS))
+    return;
+  do {
+    word = next_word(line);
+  } while (is_one_of(word, QUALIFIERS));
+  if (!word.empty() && is_identifier_start(word.front()))
+    names.emplace_back(word);
+}
+
+std::vector<std::string> find_declarations(std::string_view text) {
+  std::vector<std::string> names;
+  std::string_view line;
+  while (utils::next_line(text, line))
+    find_declared_names(line, names);
+  return names;
+}
+
+std::vector<std::string> find_include_names(std::string_view text) {
+  std::vector<std::string> names;
+  std::string_view line;
+  while (utils::next_line(text, line)) {
+    if (next_word(line) != "`include")
+      continue;
+    const size_t begin = line.find_first_not_of(" \t");
+    if (begin == std::string_view::npos || (line[begin] != '"' && line[begin] != '<'))
+      continue;
+    const size_t end = line.find(line[begin] == '"' ? '"' : '>', begin + 1);
+    if (end != std::string_view::npos)
+      names.emplace_back(line.substr(begin + 1, end - begin - 1));
+  }
+  return names;
+}
+
+std::vector<std::string> find_bind_targets(std::string_view text) {
+  std::vector<std::string> targets;
+  std::string_view line;
+  while (utils::next_line(text, line)) {
+    if (next_word(line) != "bind")
+      continue;
+    const auto target = next_word(line);
+    if (!target.empty() && is_identifier_start(target.front()))
+      targets.emplace_back(target);
+  }
+  return targets;
+}
+
+std::unordered_set<std::string> find_referenced_names(std::string_view text) {
+  std::unordered_set<std::string> names;
+  size_t i = 0;
+  while (i < text.size()) {
+    const char c = text[i];
+    if (c == '/' && i + 1 < text.size() && text[i + 1] == '/') {
+      i = text.find('\n', i);
+    } else if (c == '/' && i + 1 < text.size() && text[i + 1] == '*') {
+      i = text.find("*/", i + 2);
+      i = i == std::string_view::npos ? i : i + 2;
+    } else if (c == '"') {
+      for (i++; i < text.size() && text[i] != '"' && text[i] != '\n'; i++) {
+        if (text[i] == '\\')
+          i++;
+      }
+      i++;
+    } else if (is_identifier_start(c) || (c == '`' && i + 1 < text.size() &&
+                                             is_identifier_start(text[i + 1]))) {
+      const size_t begin = i++;
+      while (i < text.size() && is_identifier_char(text[i]))
+        i++;
+      names.emplace(text.substr(begin, i - begin));
+    } else if (is_identifier_char(c)) {
+      // Numbers and system names, which never name a unit.
+      while (i < text.size() && is_identifier_char(text[i]))
+        i++;
+    } else {
+      i++;
+    }
+  }
+  return names;
+}
+
+FileNames scan_names(std::string_view text) {
+  return {find_declarations(text), find_include_names(text), find_referenced_names(text)};
+}
+
+size_t DependencyClosure::add(const fs::path &path,
+    std::string_view text,
+    const NameToPaths &declared_name_to_paths,
+    const NameToPaths &include_name_to_paths,
+    const ReadText &read) {
+  const auto scan = [&read](const fs::path &file) -> std::shared_ptr<const FileNames> {
+    const auto file_text = read(file);
+    if (!file_text.has_value())
+      return nullptr;
+    return std::make_shared<const FileNames>(scan_names(file_text.value()));
+  };
+  std::lock_guard lock(mutex_);
+  return add_names(path, scan_names(text), declared_name_to_paths, include_name_to_paths, scan);
+}
+
+size_t DependencyClosure::update(const std::vector<std::pair<fs::path, std::string>> &buffers,
+    const std::shared_ptr<const NameToPaths> &declared_name_to_paths,
+    const std::shared_ptr<const NameToPaths> &include_name_to_paths) {
+  std::unordered_map<std::string, std::string_view> texts;
+  for (const auto &[path, text] : buffers)
+    texts.emplace(path.string(), text);
+
+  std::lock_guard lock(mutex_);
+  const auto scan = [&](const fs::path &file) -> std::shared_ptr<const FileNames> {
+    if (const auto itr = texts.find(file.string()); itr != texts.end())
+      return std::make_shared<const FileNames>(scan_names(itr->second));
+
+    const auto stat = stat_file(file);
+    auto &scanned = scanned_[file.string()];
+    if (stat.has_value() && scanned.names && scanned.stat == stat.value())
+      return scanned.names;
+    const auto file_text = read_file(file);
+    if (!file_text.has_value()) {
+      scanned_.erase(file.string());
+      return nullptr;
+    }
+    scanned.stat = stat.value_or(FileStat{-1, 0});  // never matches, so it is read next time
+    scanned.names = std::make_shared<const FileNames>(scan_names(file_text.value()));
+    return scanned.names;
+  };
+
+  const bool maps_changed = declared_name_to_paths != declared_name_to_paths_ ||
+                            include_name_to_paths != include_name_to_paths_;
+  declared_name_to_paths_ = declared_name_to_paths;
+  include_name_to_paths_ = include_name_to_paths;
+
+  size_t added = 0;
+  for (const auto &[path, text] : buffers) {
+    const auto [itr, first] = buffer_texts_.try_emplace(path.string(), text);
+    if (!first && !maps_changed && itr->second == text)
+      continue;
+    itr->second = text;
+    added += add_names(
+        path, scan_names(text), *declared_name_to_paths, *include_name_to_paths, scan);
+  }
+  return added;
+}
+
+size_t DependencyClosure::add_names(const fs::path &path,
+    const FileNames &names,
+    const NameToPaths &declared_name_to_paths,
+    const NameToPaths &include_name_to_paths,
+    const ScanFile &scan) {
+  const size_t before = files_.size();
+  files_.insert(path.string());
+
+  std::vector<fs::path> queue;
+  const auto add_declaring_files = [&](const std::string &name) {
+    const auto itr = declared_name_to_paths.find(name);
+    if (itr == declared_name_to_paths.end())
+      return;
+    for (const auto &file : itr->second) {
+      if (files_.insert(file.string()).second)
+        queue.push_back(file);
+    }
+  };
+
+  // The names in the files a text includes count as its own, as they are compiled with it.
+  std::unordered_set<std::string> included;
+  const auto add_referenced_names = [&](const FileNames &file_names) {
+    std::vector<std::string> includes = file_names.includes;
+    for (const auto &name : file_names.referenced)
+      add_declaring_files(name);
+    while (!includes.empty()) {
+      const auto itr = include_name_to_paths.find(includes.back());
+      includes.pop_back();
+      if (itr == include_name_to_paths.end())
+        continue;
+      for (const auto &file : itr->second) {
+        if (!included.insert(file.string()).second)
+          continue;
+        if (const auto include_names = scan(file)) {
+          for (const auto &name : include_names->referenced)
+            add_declaring_files(name);
+          includes.insert(
+              includes.end(), include_names->includes.begin(), include_names->includes.end());
+        }
+      }
+    }
+  };
+
+  // An open document that is included by another file is compiled through the file including it,
+  // which is listed as declaring the same units.
+  for (const auto &name : names.declared)
+    add_declaring_files(name);
+
+  add_referenced_names(names);
+
+  while (!queue.empty()) {
+    const fs::path file = std::move(queue.back());
+    queue.pop_back();
+    if (const auto file_names = scan(file))
+      add_referenced_names(*file_names);
+  }
+  return files_.size() - before;
+}
+
+void ReferenceIndex::add(
+    const fs::path &path, std::string_view text, const std::vector<std::string_view> &included) {
+  const auto [itr, added] = declared_.try_emplace(path.string(), find_declarations(text));
+  if (!added)
+    return;
+
+  auto targets = find_bind_targets(text);
+  auto names = find_referenced_names(text);
+  for (const auto included_text : included) {
+    for (auto &name : find_declarations(included_text))
+      itr->second.push_back(std::move(name));
+    for (auto &target : find_bind_targets(included_text))
+      targets.push_back(std::move(target));
+    names.merge(find_referenced_names(included_text));
+  }
+  if (!targets.empty())
+    bind_targets_.emplace(path.string(), std::move(targets));
+
+  const auto file = static_cast<uint32_t>(files_.size());
+  files_.push_back(path);
+  for (const auto &name : names)
+    referrers_[name].push_back(file);
+}
+
+const std::vector<std::string> &ReferenceIndex::declared_names(const fs::path &path) const {
+  static const std::vector<std::string> none;
+  const auto itr = declared_.find(path.string());
+  return itr == declared_.end() ? none : itr->second;
+}
+
+const std::vector<std::string> &ReferenceIndex::bind_targets(const fs::path &path) const {
+  static const std::vector<std::string> none;
+  const auto itr = bind_targets_.find(path.string());
+  return itr == bind_targets_.end() ? none : itr->second;
+}
+
+std::set<fs::path> ReferenceIndex::referrers(const std::unordered_set<std::string> &names) const {
+  std::set<fs::path> files;
+  for (const auto &name : names) {
+    if (const auto itr = referrers_.find(name); itr != referrers_.end()) {
+      for (const auto file : itr->second)
+        files.insert(files_[file]);
+    }
+  }
+  return files;
+}
+}  // namespace metalware
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "scancache.hpp"
+
+namespace fs = std::filesystem;
+
+namespace metalware {
+// Adds the names of the design units (modules, interfaces, programs, packages, primitives,
+// checkers, configs) and macros declared on `line` to `names`. Macro names keep their backtick.
+// This is a lexical approximation: declarations split across lines are missed.
+void find_declared_names(std::string_view line, std::vector<std::string> &names);
+// The names declared on every line of `text`.
+[[nodiscard]] std::vector<std::string> find_declarations(std::string_view text);
+
+// The names of the files `text` `includes, as written between the quotes (or angle brackets).
+[[nodiscard]] std::vector<std::string> find_include_names(std::string_view text);
+
+// The modules and interfaces `text` binds into, as `leaf` in `bind leaf checker u_checker();`.
+[[nodiscard]] std::vector<std::string> find_bind_targets(std::string_view text);
+
+// The identifiers and macro usages in `text`, outside comments and strings. A superset of the
+// names the text refers to, as keywords and local names come along.
+[[nodiscard]] std::unordered_set<std::string> find_referenced_names(std::string_view text);
+
+// What the closure below needs of the text of a file.
+struct FileNames {
+  std::vector<std::string> declared;           // see find_declarations
+  std::vector<std::string> includes;           // see find_include_names
+  std::unordered_set<std::string> referenced;  // see find_referenced_names
+};
+[[nodiscard]] FileNames scan_names(std::string_view text);
+
+// The target files that a compilation of the open documents needs: the files declaring the units
+// and macros they name, or that the files they `include name, and so on transitively. It only
+// grows, so that opening another document or closing one never drops trees that are already
+// parsed; reset() starts over.
+class DependencyClosure {
+ public:
+  using ReadText = std::function<std::optional<std::string>(const fs::path &)>;
+  using NameToPaths = std::map<std::string, std::set<fs::path>>;
+
+  // Adds `path`, whose current text is `text`, and everything it depends on. Other files, included
+  // ones too, are read through `read`. Returns the number of files added.
+  size_t add(const fs::path &path,
+      std::string_view text,
+      const NameToPaths &declared_name_to_paths,
+      const NameToPaths &include_name_to_paths,
+      const ReadText &read);
+
+  // Adds the open documents `buffers` like add, reading other files from disk. Only the documents
+  // whose text changed since the last update are followed, or all of them once the maps change,
+  // and a file on disk is only scanned again once its modification time or size changes.
+  size_t update(const std::vector<std::pair<fs::path, std::string>> &buffers,
+      const std::shared_ptr<const NameToPaths> &declared_name_to_paths,
+      const std::shared_ptr<const NameToPaths> &include_name_to_paths);
+
+  [[nodiscard]] bool contains(const fs::path &path) const {
+    std::lock_guard lock(mutex_);
+    return files_.contains(path.string());
+  }
+
+  [[nodiscard]] size_t size() const {
+    std::lock_guard lock(mutex_);
+    return files_.size();
+  }
+
+  void reset() {
+    std::lock_guard lock(mutex_);
+    files_.clear();
+    buffer_texts_.clear();
+  }
+
+ private:
+  using ScanFile = std::function<std::shared_ptr<const FileNames>(const fs::path &)>;
+
+  struct ScannedFile {
+    FileStat stat;
+    std::shared_ptr<const FileNames> names;
+  };
+
+  size_t add_names(const fs::path &path,
+      const FileNames &names,
+      const NameToPaths &declared_name_to_paths,
+      const NameToPaths &include_name_to_paths,
+      const ScanFile &scan);
+
+  // The project grows the closure without holding its own lock, since that reads files.
+  mutable std::mutex mutex_;
+  std::unordered_set<std::string> files_;
+  // As of the last update.
+  std::unordered_map<std::string, std::string> buffer_texts_;  // by path
+  std::shared_ptr<const NameToPaths> declared_name_to_paths_;
+  std::shared_ptr<const NameToPaths> include_name_to_paths_;
+  std::unordered_map<std::string, ScannedFile> scanned_;  // files on disk, by path
+};
+
+// The names each file of a compilation declares, refers to and binds into, so that the files an
+// edit may affect can be found without compiling. Lexical, like the closure above: references
+// through instance names, such as an upward hierarchical reference, are missed.
+class ReferenceIndex {
+ public:
+  // `included` are the texts of the files `path` includes, which count as part of it.
+  void add(const fs::path &path,
+      std::string_view text,
+      const std::vector<std::string_view> &included = {});
+
+  [[nodiscard]] bool contains(const fs::path &path) const {
+    return declared_.contains(path.string());
+  }
+
+  // Empty if `path` was not added.
+  [[nodiscard]] const std::vector<std::string> &declared_names(const fs::path &path) const;
+  [[nodiscard]] const std::vector<std::string> &bind_targets(const fs::path &path) const;
+  // The files that refer to one of `names`.
+  [[nodiscard]] std::set<fs::path> referrers(const std::unordered_set<std::string> &names) const;
+
+ private:
+  std::vector<fs::path> files_;
+  std::unordered_map<std::string, std::vector<std::string>> declared_;      // by path
+  std::unordered_map<std::string, std::vector<std::string>> bind_targets_;  // by path, if any
+  std::unordered_map<std::string, std::vector<uint32_t>> referrers_;  // into files_, by name
+};
+}  // namespace metalware
@@ -0,0 +1,166 @@
+#include "framereader.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "socket.hpp"
+#include "spdlog/spdlog.h"
+
+namespace metalware {
+
+namespace {
+constexpr std::string_view CONTENT_LENGTH_FIELD = "Content-Length:";
+
+// Returns the offset just past the blank line that terminates the header block. Headers are
+// normally terminated by "\r\n\r\n", but text-mode streams on Windows deliver "\n\n".
+std::optional<size_t> find_header_end(std::string_view data) {
+  for (size_t i = data.find('\n'); i != std::string_view::npos; i = data.find('\n', i + 1)) {
+    if (i + 1 < data.size() && data[i + 1] == '\n') {
+      return i + 2;
+    }
+    if (i + 2 < data.size() && data[i + 1] == '\r' && data[i + 2] == '\n') {
+      return i + 3;
+    }
+  }
+  return std::nullopt;
+}
+
+std::optional<size_t> extract_content_length(std::string_view header) {
+  const size_t pos = header.find(CONTENT_LENGTH_FIELD);
+  if (pos == std::string_view::npos) {
+    return std::nullopt;
+  }
+
+  const char *first = header.data() + pos + CONTENT_LENGTH_FIELD.size();
+  const char *last = header.data() + header.size();
+  while (first != last && *first == ' ') {
+    first++;
+  }
+
+  size_t length = 0;
+  if (const auto [ptr, ec] = std::from_chars(first, last, length); ec != std::errc()) {
+    return std::nullopt;
+  }
+  return length;
+}
+
+long read_fd(int fd, char *dst, size_t size) {
+#if defined(_WIN32)
+  return _read(fd, dst, static_cast<unsigned int>(size));
+#else
+  return ::read(fd, dst, size);
+#endif
+}
+}  // namespace
+
+FrameReader::FrameReader(int fd, size_t initial_capacity, size_t max_frame_size)
+    : fd_(fd), max_frame_size_(max_frame_size), buffer_(initial_capacity) {}
+
+size_t FrameReader::read_calls() const {
+  return read_calls_;
+}
+
+size_t FrameReader::capacity() const {
+  return buffer_.size();
+}
+
+std::optional<std::string_view> FrameReader::next_frame() {
+  size_t wanted = 0;  // bytes of unconsumed input needed before the next frame can complete
+  while (true) {
+    if (skip_ > 0) {
+      const size_t skipped = std::min(skip_, end_ - begin_);
+      begin_ += skipped;
+      skip_ -= skipped;
+      if (skip_ > 0) {
+        if (!fill(0)) {
+          return std::nullopt;
+        }
+        continue;
+      }
+    }
+    const std::string_view pending(buffer_.data() + begin_, end_ - begin_);
+
+    if (const auto header_end = find_header_end(pending); header_end.has_value()) {
+      const auto content_length = extract_content_length(pending.substr(0, header_end.value()));
+      if (!content_length.has_value()) {
+        spdlog::error("Skipping frame without a valid content length: {}",
+            pending.substr(0, header_end.value()));
+        begin_ += header_end.value();
+        continue;
+      }
+      if (content_length.value() > max_frame_size_) {
+        spdlog::error("Skipping frame of {} bytes, more than the maximum of {}",
+            content_length.value(),
+            max_frame_size_);
+        begin_ += header_end.value();
+        skip_ = content_length.value();
+        continue;
+      }
+
+      const size_t frame_size = header_end.value() + content_length.value();
+      if (pending.size() >= frame_size) {
+        begin_ += frame_size;
+        return pending.substr(header_end.value(), content_length.value());
+      }
+      wanted = frame_size;
+    }
+
+    if (!fill(wanted)) {
+      if (begin_ != end_) {
+        spdlog::error("Incomplete frame at end of input stream: {} bytes dropped", end_ - begin_);
+      }
+      return std::nullopt;
+    }
+  }
+}
+
+// Reads as many bytes as are available into the free tail of the buffer, first making room for
+// at least `min_capacity` unconsumed bytes. Consumed bytes are reclaimed by sliding the partial
+// frame to the front, so every frame stays contiguous and can be handed out as a single view.
+bool FrameReader::fill(size_t min_capacity) {
+  if (begin_ == end_) {
+    begin_ = end_ = 0;
+  }
+
+  if (end_ == buffer_.size() || buffer_.size() - begin_ < min_capacity) {
+    if (begin_ > 0) {
+      std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+      end_ -= begin_;
+      begin_ = 0;
+    }
+    if (end_ == buffer_.size() || buffer_.size() < min_capacity) {
+      buffer_.resize(std::max(buffer_.size() * 2, min_capacity));
+    }
+  }
+
+  while (true) {
+    read_calls_++;
+    const long n = read_fd(fd_, buffer_.data() + end_, buffer_.size() - end_);
+    if (n > 0) {
+      end_ += static_cast<size_t>(n);
+      return true;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+        wait_for_fd(fd_, /* for_write */ false)) {
+      continue;  // non-blocking socket in listen mode
+    }
+    if (n < 0) {
+      spdlog::error("Failed to read from input stream: {}", std::strerror(errno));
+    } else {
+      spdlog::info("End of input stream");
+    }
+    return false;
+  }
+}
+}  // namespace metalware
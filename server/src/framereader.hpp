@@ -0,0 +1,39 @@
+#pragma once
+
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace metalware {
+// Reads LSP frames ("Content-Length: N\r\n\r\n<body>") from a file descriptor. Input is pulled
+// with large read(2) calls into a buffer that is reused across frames, so the cost of reading a
+// message scales with the number of syscalls rather than with its size. Frames longer than
+// `max_frame_size` are skipped without buffering them, so a bad header cannot exhaust memory.
+class FrameReader {
+ public:
+  explicit FrameReader(int fd,
+      size_t initial_capacity = DEFAULT_CAPACITY,
+      size_t max_frame_size = DEFAULT_MAX_FRAME_SIZE);
+
+  // Returns a view over the body of the next complete frame, or std::nullopt once the stream is
+  // closed. The view is only valid until the next call.
+  [[nodiscard]] std::optional<std::string_view> next_frame();
+
+  [[nodiscard]] size_t read_calls() const;
+  [[nodiscard]] size_t capacity() const;
+
+  static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+  static constexpr size_t DEFAULT_MAX_FRAME_SIZE = 256 * 1024 * 1024;
+
+ private:
+  [[nodiscard]] bool fill(size_t min_capacity);
+
+  int fd_;
+  size_t max_frame_size_;
+  std::vector<char> buffer_;
+  size_t begin_ = 0;  // start of unconsumed bytes
+  size_t end_ = 0;    // end of bytes read so far
+  size_t skip_ = 0;   // bytes of a skipped frame still to come
+  size_t read_calls_ = 0;
+};
+}  // namespace metalware
@@ -0,0 +1,199 @@
+#include "jsonwriter.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace metalware {
+
+namespace {
+#if defined(_WIN32)
+constexpr std::string_view HEADER_END = "\n\n";
+#else
+constexpr std::string_view HEADER_END = "\r\n\r\n";
+#endif
+
+constexpr std::string_view CONTENT_LENGTH = "Content-Length: ";
+constexpr std::string_view REPLACEMENT_CHARACTER = "\xEF\xBF\xBD";
+constexpr char HEX_DIGITS[] = "0123456789abcdef";
+
+// Bytes that can be copied to the output as they are.
+bool is_plain(unsigned char c) {
+  return c >= 0x20 && c < 0x80 && c != '"' && c != '\\';
+}
+
+// Length of the well-formed UTF-8 sequence starting at str[i], or 0 if it is not well-formed
+// (overlong encodings, surrogates and code points past U+10FFFF included).
+size_t utf8_sequence_length(std::string_view str, size_t i) {
+  const auto byte = [&](size_t k) {
+    return static_cast<unsigned char>(str[i + k]);
+  };
+  const auto in = [](unsigned char c, unsigned char lo, unsigned char hi) {
+    return c >= lo && c <= hi;
+  };
+
+  const unsigned char lead = byte(0);
+  const size_t remaining = str.size() - i;
+  if (in(lead, 0xC2, 0xDF)) {
+    return remaining >= 2 && in(byte(1), 0x80, 0xBF) ? 2 : 0;
+  }
+  if (in(lead, 0xE0, 0xEF)) {
+    const unsigned char lo = lead == 0xE0 ? 0xA0 : 0x80;
+    const unsigned char hi = lead == 0xED ? 0x9F : 0xBF;
+    return remaining >= 3 && in(byte(1), lo, hi) && in(byte(2), 0x80, 0xBF) ? 3 : 0;
+  }
+  if (in(lead, 0xF0, 0xF4)) {
+    const unsigned char lo = lead == 0xF0 ? 0x90 : 0x80;
+    const unsigned char hi = lead == 0xF4 ? 0x8F : 0xBF;
+    return remaining >= 4 && in(byte(1), lo, hi) && in(byte(2), 0x80, 0xBF) &&
+                   in(byte(3), 0x80, 0xBF)
+               ? 4
+               : 0;
+  }
+  return 0;
+}
+}  // namespace
+
+JsonWriter::JsonWriter(std::string buffer) : buffer_(std::move(buffer)) {
+  buffer_.assign(RESERVED_HEADER_SIZE, ' ');
+}
+
+JsonWriter &JsonWriter::begin_object() {
+  separate();
+  buffer_ += '{';
+  needs_comma_ = false;
+  return *this;
+}
+
+JsonWriter &JsonWriter::end_object() {
+  buffer_ += '}';
+  needs_comma_ = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::begin_array() {
+  separate();
+  buffer_ += '[';
+  needs_comma_ = false;
+  return *this;
+}
+
+JsonWriter &JsonWriter::end_array() {
+  buffer_ += ']';
+  needs_comma_ = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::key(std::string_view name) {
+  separate();
+  append_escaped(name);
+  buffer_ += ':';
+  needs_comma_ = false;
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(std::string_view str) {
+  separate();
+  append_escaped(str);
+  needs_comma_ = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(bool b) {
+  separate();
+  buffer_ += b ? "true" : "false";
+  needs_comma_ = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::json(const nlohmann::json &value) {
+  separate();
+  buffer_ += value.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+  needs_comma_ = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::null() {
+  separate();
+  buffer_ += "null";
+  needs_comma_ = true;
+  return *this;
+}
+
+size_t JsonWriter::finish() {
+  char header[RESERVED_HEADER_SIZE];
+  char *end = std::copy(CONTENT_LENGTH.begin(), CONTENT_LENGTH.end(), header);
+  end = std::to_chars(end, header + sizeof(header), buffer_.size() - RESERVED_HEADER_SIZE).ptr;
+  end = std::copy(HEADER_END.begin(), HEADER_END.end(), end);
+
+  // Right-align the header against the body.
+  const auto header_size = static_cast<size_t>(end - header);
+  const size_t offset = RESERVED_HEADER_SIZE - header_size;
+  std::memcpy(buffer_.data() + offset, header, header_size);
+  return offset;
+}
+
+void JsonWriter::separate() {
+  if (needs_comma_) {
+    buffer_ += ',';
+  }
+}
+
+void JsonWriter::append_escaped(std::string_view str) {
+  buffer_ += '"';
+  size_t i = 0;
+  while (i < str.size()) {
+    // Copy runs of plain ASCII in one go.
+    size_t run = i;
+    while (run < str.size() && is_plain(static_cast<unsigned char>(str[run]))) {
+      run++;
+    }
+    buffer_.append(str.data() + i, run - i);
+    i = run;
+    if (i == str.size()) {
+      break;
+    }
+
+    const auto c = static_cast<unsigned char>(str[i]);
+    if (c >= 0x80) {
+      if (const size_t len = utf8_sequence_length(str, i); len > 0) {
+        buffer_.append(str.data() + i, len);
+        i += len;
+      } else {
+        buffer_ += REPLACEMENT_CHARACTER;
+        i++;
+      }
+      continue;
+    }
+
+    switch (c) {
+      case '"':
+        buffer_ += "\\\"";
+        break;
+      case '\\':
+        buffer_ += "\\\\";
+        break;
+      case '\b':
+        buffer_ += "\\b";
+        break;
+      case '\f':
+        buffer_ += "\\f";
+        break;
+      case '\n':
+        buffer_ += "\\n";
+        break;
+      case '\r':
+        buffer_ += "\\r";
+        break;
+      case '\t':
+        buffer_ += "\\t";
+        break;
+      default: {
+        const char escape[] = {'\\', 'u', '0', '0', HEX_DIGITS[c >> 4], HEX_DIGITS[c & 0xF]};
+        buffer_.append(escape, sizeof(escape));
+      }
+    }
+    i++;
+  }
+  buffer_ += '"';
+}
+}  // namespace metalware
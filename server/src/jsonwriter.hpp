@@ -0,0 +1,68 @@
+#pragma once
+
+#include <charconv>
+#include <concepts>
+#include <string>
+#include <string_view>
+
+#include "nlohmann/json.hpp"
+
+namespace metalware {
+// Serializes a JSON-RPC message straight into an LSP frame, without building a json tree. Space
+// for the Content-Length header is reserved at the front of the buffer and filled in by finish(),
+// so the frame never has to be copied. Calls must form a well-formed document, e.g.
+//
+//   JsonWriter w(client->acquire_buffer());
+//   w.begin_object().key("jsonrpc").value("2.0").key("id").value(id).end_object();
+//   client->send_packet(std::move(w));
+//
+// Strings are escaped as they are written; invalid UTF-8 is replaced with U+FFFD rather than
+// failing the whole message.
+class JsonWriter {
+ public:
+  // Reuses the capacity of `buffer`; its contents are discarded.
+  explicit JsonWriter(std::string buffer = {});
+
+  JsonWriter &begin_object();
+  JsonWriter &end_object();
+  JsonWriter &begin_array();
+  JsonWriter &end_array();
+  JsonWriter &key(std::string_view name);
+
+  JsonWriter &value(std::string_view str);
+  JsonWriter &value(const char *str) {
+    return value(std::string_view(str));
+  }
+  JsonWriter &value(bool b);
+  JsonWriter &json(const nlohmann::json &value);  // e.g. request ids, small prebuilt fragments
+  JsonWriter &null();
+
+  template <std::integral T>
+  JsonWriter &value(T number) {
+    separate();
+    char digits[24];
+    const auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), number);
+    buffer_.append(digits, end);
+    needs_comma_ = true;
+    return *this;
+  }
+
+  // Writes the header in front of the body. Returns the offset of the first byte of the frame in
+  // buffer(); the bytes before it are unused.
+  [[nodiscard]] size_t finish();
+
+  [[nodiscard]] std::string &buffer() {
+    return buffer_;
+  }
+
+  // "Content-Length: " + the digits of any size_t + the blank line.
+  static constexpr size_t RESERVED_HEADER_SIZE = 16 + 20 + 4;
+
+ private:
+  void separate();
+  void append_escaped(std::string_view str);
+
+  std::string buffer_;
+  bool needs_comma_ = false;
+};
+}  // namespace metalware
@@ -1,87 +1,165 @@
 #include "languageclient.hpp"
 
 #include <chrono>
-#include <iostream>
-#include <regex>
 #include <thread>
 
+#include "metrics.hpp"
 #include "packethandler.hpp"
 #include "spdlog/spdlog.h"
 
 using namespace metalware;
 
 void LanguageClient::setup() {
-  packet_handler_ = std::make_shared<PacketHandler>(weak_from_this());
+  packet_handler_ = std::make_shared<PacketHandler>(weak_from_this(), options_);
 }
 
-LanguageClient::LanguageClient() : client_connected_(true) {}
+LanguageClient::LanguageClient(int in_fd, int out_fd, const ServerOptions& options)
+    : options_(options),
+      reader_(in_fd, FrameReader::DEFAULT_CAPACITY, options.max_frame_size),
+      incoming_(INCOMING_QUEUE_CAPACITY), writer_(out_fd) {}
 
 LanguageClient::~LanguageClient() = default;
 
+// Reading and JSON parsing run on a dedicated thread so that incoming traffic never waits behind
+// a slow handler. This thread only dispatches, waking up whenever a message is queued.
 void LanguageClient::handle_communication() {
-  while (client_connected_) {
+  std::thread reader([this] {
     receive_data();
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  });
+
+  while (auto message = incoming_.pop()) {
+    metrics::gauge("incoming_queue_depth").set(static_cast<int64_t>(incoming_.size()));
+    metrics::counter("incoming_queue_wait_us")
+        .add(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - message->received)
+                .count());
+    if (message->method == "textDocument/didChange") {
+      coalesce_changes(message.value());
+    }
+    process_message(std::move(message.value()));
   }
-}
 
-bool LanguageClient::send_packet(const std::string& packet) {
-  std::cout << packet << std::flush;
-  return true;
+  reader.join();
+  packet_handler_->stop();
+  writer_.close();
+  spdlog::info("Server metrics: {}", metrics::to_json().dump());
 }
 
-void LanguageClient::receive_data() {
-  while (true) {
-    // Read Header
-    std::string header, tmp;
-    std::getline(std::cin, header);  // Read until \r
-    std::getline(std::cin, tmp);
-
-    if (header.empty() || std::cin.eof()) {
-      spdlog::info("End of input stream or empty header");
-      break;
-    }
+// Frames are written out by the writer thread, so this only blocks if the editor stops reading
+// and the output backlog grows past its limit.
+bool LanguageClient::send_packet(std::string packet) {
+  return writer_.write(std::move(packet));
+}
 
-    int content_length = extract_content_length(header);
+bool LanguageClient::send_packet(JsonWriter&& writer) {
+  const size_t offset = writer.finish();
+  return writer_.write(std::move(writer.buffer()), offset);
+}
 
-    // Read Content
-    std::string content;
-    content.reserve(content_length);
-    char ch;
-    while (content.length() < content_length && std::cin.get(ch)) {
-      content += ch;
-    }
+std::string LanguageClient::acquire_buffer() {
+  return writer_.acquire_buffer();
+}
 
-    if (content.length() != content_length) {
-      spdlog::error("Incomplete content received. Expected: {}, Received: {}",
-          content_length,
-          content.length());
-      continue;
-    }
+CancellationToken LanguageClient::begin_diagnostics_pass(bool cancellable) {
+  std::lock_guard lock(diagnostics_mutex_);
+  diagnostics_pass_ = cancellable ? CancellationToken::create() : CancellationToken();
+  return diagnostics_pass_;
+}
 
-    buffer_ = content;  // Assuming buffer_ is a std::string
+void LanguageClient::cancel_diagnostics_pass() {
+  std::lock_guard lock(diagnostics_mutex_);
+  diagnostics_pass_.cancel();
+}
 
-    process_data();
+void LanguageClient::receive_data() {
+  while (const auto frame = reader_.next_frame()) {
+    process_data(frame.value());
   }
+
+  spdlog::info("Input stream closed after {} reads", reader_.read_calls());
+  incoming_.close();
 }
 
-void LanguageClient::process_data() {
+void LanguageClient::process_data(std::string_view frame) {
+  IncomingMessage message;
   try {
-    auto json_content = nlohmann::json::parse(buffer_);
-    if (!packet_handler_->handle_json_message(json_content)) {
-      spdlog::error("Error handling packet: {}", json_content.dump().substr(0, 75));
-    }
+    message = parse_incoming_message(frame);
   } catch (const nlohmann::json::parse_error& e) {
     spdlog::error("Error parsing JSON: {}", e.what());
+    return;
+  }
+  message.received = std::chrono::steady_clock::now();
+  metrics::counter("messages_received").add();
+
+  // Cancellation is handled here rather than in the dispatcher, which may be busy with the very
+  // request being cancelled.
+  if (message.method == "$/cancelRequest") {
+    if (message.json.contains("params") && message.json["params"].contains("id") &&
+        requests_.cancel(message.json["params"]["id"])) {
+      spdlog::info("Cancelling request {}", message.json["params"]["id"].dump());
+    }
+    return;
+  }
+
+  // A new edit makes the diagnostics being computed for the previous one stale. A change without
+  // text is rejected by the handler and schedules no new pass, so it must not cancel this one.
+  if (message.method == "textDocument/didChange" && message.text.has_value() &&
+      !message.uri.empty()) {
+    cancel_diagnostics_pass();
+  }
+
+  if (!message.id.is_null() && !message.method.empty()) {
+    message.cancellation = requests_.add(message.id);
+  }
+
+  if (!incoming_.push(std::move(message))) {
+    spdlog::warn("Dropping message received after shutdown");
+    return;
   }
-  buffer_.clear();  // Clear buffer after processing
+  metrics::gauge("incoming_queue_depth").set(static_cast<int64_t>(incoming_.size()));
+  metrics::gauge("incoming_queue_high_watermark")
+      .set(static_cast<int64_t>(incoming_.high_watermark()));
 }
 
-int LanguageClient::extract_content_length(const std::string& header) {
-  std::regex content_length_regex(R"(Content-Length: (\d+))");
-  std::smatch match;
-  if (std::regex_search(header, match, content_length_regex) && match.size() > 1) {
-    return std::stoi(match[1].str());
+// Documents are synced in full, so of a run of didChange notifications for the same document only
+// the last matters. Fold the ones queued right behind `change` into it, waiting up to the debounce
+// window after each for the next keystroke. Anything else at the head of the queue (e.g. a
+// completion request that must see the latest text) ends the run.
+void LanguageClient::coalesce_changes(IncomingMessage& change) {
+  const auto same_document_change = [&change](const IncomingMessage& next) {
+    return next.method == "textDocument/didChange" && next.uri == change.uri &&
+           next.text.has_value();
+  };
+
+  int64_t folded = 0;
+  while (auto next = incoming_.pop_if(
+             same_document_change, std::chrono::steady_clock::now() + options_.change_debounce)) {
+    change = std::move(next.value());
+    folded++;
+  }
+
+  if (folded > 0) {
+    spdlog::info("Folded {} queued changes to {}", folded, change.uri);
+    metrics::counter("did_change_coalesced").add(folded);
+  }
+}
+
+void LanguageClient::process_message(IncomingMessage message) {
+  const std::string method = message.method;
+  const nlohmann::json id = message.id;
+  const auto received = message.received;
+  if (!packet_handler_->handle_message(std::move(message))) {
+    spdlog::error("Error handling packet: {}", method);
+  }
+
+  if (is_interactive_method(method)) {
+    metrics::counter("interactive_requests").add();
+    metrics::counter("interactive_latency_us")
+        .add(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - received)
+                .count());
+  }
+  if (!id.is_null()) {
+    requests_.remove(id);
   }
-  return -1;  // Or throw an exception if appropriate
 }
@@ -1,29 +1,60 @@
 #pragma once
 
+#include <chrono>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+
+#include "boundedqueue.hpp"
+#include "cancellation.hpp"
+#include "framereader.hpp"
+#include "jsonwriter.hpp"
+#include "lspmessage.hpp"
+#include "outputwriter.hpp"
 
 namespace metalware {
 class PacketHandler;
+
+struct ServerOptions {
+  std::optional<std::string> listen_endpoint;  // serve over a socket instead of stdio
+  bool keep_project_between_sessions = false;  // keep the parsed project when a client leaves
+  std::chrono::milliseconds change_debounce{0};  // wait this long for more edits to fold in
+  size_t max_frame_size = FrameReader::DEFAULT_MAX_FRAME_SIZE;  // longer messages are dropped
+};
+
 class LanguageClient : public std::enable_shared_from_this<LanguageClient> {
   public:
-    LanguageClient();
+    LanguageClient(int in_fd, int out_fd, const ServerOptions& options);
     ~LanguageClient();
 
     void handle_communication();
-    [[nodiscard]] static bool send_packet(const std::string& packet);
+    [[nodiscard]] bool send_packet(std::string packet);
+    [[nodiscard]] bool send_packet(JsonWriter&& writer);
+    [[nodiscard]] std::string acquire_buffer();
+
+    // Returns the token for a new diagnostics pass, which is cancelled when the next didChange
+    // arrives (unless it is not `cancellable`) or by cancel_diagnostics_pass().
+    [[nodiscard]] CancellationToken begin_diagnostics_pass(bool cancellable = true);
+    void cancel_diagnostics_pass();
     void setup();
-  private:
-    bool client_connected_;
 
-    void receive_data();
-    void process_data();
+    static constexpr size_t INCOMING_QUEUE_CAPACITY = 256;
+  private:
+    void receive_data();  // runs on the reader thread
+    void process_data(std::string_view frame);
+    void process_message(IncomingMessage message);
+    void coalesce_changes(IncomingMessage& change);
     void close_connection();
 
-    int extract_header(std::string& header); // returns length of header
-    static int extract_content_length(const std::string& header);
-
-    std::string buffer_;
+    ServerOptions options_;
+    FrameReader reader_;
+    BoundedQueue<IncomingMessage> incoming_;
+    OutputWriter writer_;
+    CancellationRegistry requests_;
+    std::mutex diagnostics_mutex_;
+    CancellationToken diagnostics_pass_;
     std::shared_ptr<PacketHandler> packet_handler_;
 };
 }
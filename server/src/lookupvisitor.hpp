@@ -5,6 +5,7 @@
 #include "slang/parsing/Preprocessor.h"
 
 #include "spdlog/spdlog.h"
+#include "syntaxtreecache.hpp"
 
 namespace metalware {
 class LookupCacheVisitor : public slang::syntax::SyntaxVisitor<LookupCacheVisitor> {
@@ -39,7 +40,8 @@ class LookupCacheVisitor : public slang::syntax::SyntaxVisitor<LookupCacheVisito
           const size_t end_column_idx =
               source_manager->getColumnNumber(syntax->sourceRange().end()) - 1;
 
-          const fs::path path = source_manager->getFullPath(syntax->sourceRange().start().buffer());
+          const fs::path path = SyntaxTreeCache::source_path(
+              *source_manager, syntax->sourceRange().start().buffer());
 
           spdlog::debug("Found include directive at path: {} {}:{}-{}:{}",
               path.string(),
@@ -67,7 +69,7 @@ class LookupCacheVisitor : public slang::syntax::SyntaxVisitor<LookupCacheVisito
 
   // Finds constructs by name and type.
   std::vector<std::tuple<ConstructType, Location>> lookup(
-      std::string_view name, std::initializer_list<ConstructType> types) {
+      std::string_view name, std::initializer_list<ConstructType> types) const {
     std::vector<std::tuple<ConstructType, Location>> res;
 
     // O(T*M*P), T=number of types, N=max number of constructs in a file, P=number of paths
@@ -93,7 +95,7 @@ class LookupCacheVisitor : public slang::syntax::SyntaxVisitor<LookupCacheVisito
   std::optional<std::tuple<ConstructType, /*name*/ std::string>> lookup(const fs::path &p,
       size_t row_idx,
       size_t col_idx,
-      std::initializer_list<ConstructType> types) {
+      std::initializer_list<ConstructType> types) const {
     // O(T*M), T=number of types, M=max number of constructs in a file
     for (const auto &t : types) {
       if (constructs.find(t) == constructs.end()) {  // O(1)
@@ -135,7 +137,8 @@ class LookupCacheVisitor : public slang::syntax::SyntaxVisitor<LookupCacheVisito
     const size_t end_line_idx = source_manager->getLineNumber(syntax.sourceRange().end()) - 1;
     const size_t end_column_idx = source_manager->getColumnNumber(syntax.sourceRange().end()) - 1;
 
-    const fs::path path = source_manager->getFullPath(syntax.sourceRange().start().buffer());
+    const fs::path path =
+        SyntaxTreeCache::source_path(*source_manager, syntax.sourceRange().start().buffer());
 
     constructs[ConstructType::MODULE_DECLARATION][path].emplace_back(std::string(syntax.header->name.valueText()),
             Location{
@@ -159,7 +162,8 @@ class LookupCacheVisitor : public slang::syntax::SyntaxVisitor<LookupCacheVisito
     const size_t end_line_idx = start_line_idx;
     const size_t end_column_idx = start_column_idx + syntax.type.valueText().size();
 
-    const fs::path path = source_manager->getFullPath(syntax.sourceRange().start().buffer());
+    const fs::path path =
+        SyntaxTreeCache::source_path(*source_manager, syntax.sourceRange().start().buffer());
 
     constructs[ConstructType::HIERARCHY_INSTANTIATION][path].emplace_back(std::string(syntax.type.valueText()),
             Location{
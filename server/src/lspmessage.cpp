@@ -0,0 +1,180 @@
+#include "lspmessage.hpp"
+
+#include <algorithm>
+#include <array>
+#include <initializer_list>
+#include <vector>
+
+namespace metalware {
+
+namespace {
+constexpr std::array<std::string_view, 4> STREAMED_METHODS = {"textDocument/didOpen",
+    "textDocument/didChange",
+    "textDocument/completion",
+    "textDocument/definition"};
+
+constexpr std::array<std::string_view, 3> INTERACTIVE_METHODS = {"textDocument/completion",
+    "textDocument/definition",
+    "getDiagnosticStringsForLine"};
+
+constexpr std::string_view ARRAY_ELEMENT = "[]";
+
+// SAX consumer that records the fields of IncomingMessage as their values stream past. The
+// current location in the document is kept as a path of object keys, with ARRAY_ELEMENT standing
+// in for array indices, e.g. {"params": {"contentChanges": [{"text": ...}]}} puts the text at
+// params/contentChanges/[]/text.
+//
+// Until the method turns out to be streamed, the events also build the DOM, so that every message
+// is parsed once. Clients send the method before the params, so the DOM of a hot method holds
+// little more than its id when it is dropped.
+class MessageSax {
+ public:
+  using json = nlohmann::json;
+
+  explicit MessageSax(IncomingMessage &message) : message_(message), dom_(dom_json_) {}
+
+  // The DOM of the message, or null if its method is streamed.
+  [[nodiscard]] json take_dom() {
+    return building_dom_ ? std::move(dom_json_) : json();
+  }
+
+  bool null() {
+    if (building_dom_)
+      dom_.null();
+    return true;
+  }
+
+  bool boolean(bool val) {
+    if (building_dom_)
+      dom_.boolean(val);
+    return true;
+  }
+
+  bool number_integer(json::number_integer_t val) {
+    if (building_dom_)
+      dom_.number_integer(val);
+    if (at({"id"})) {
+      message_.id = val;
+    }
+    return true;
+  }
+
+  bool number_unsigned(json::number_unsigned_t val) {
+    if (building_dom_)
+      dom_.number_unsigned(val);
+    if (at({"id"})) {
+      message_.id = val;
+    } else if (at({"params", "position", "line"})) {
+      message_.line = val;
+    } else if (at({"params", "position", "character"})) {
+      message_.character = val;
+    }
+    return true;
+  }
+
+  bool number_float(json::number_float_t val, const json::string_t &text) {
+    if (building_dom_)
+      dom_.number_float(val, text);
+    return true;
+  }
+
+  bool string(json::string_t &val) {
+    if (building_dom_)
+      dom_.string(val);  // copies
+    if (at({"method"})) {
+      message_.method = std::move(val);
+      building_dom_ = !is_streamed_method(message_.method);
+    } else if (at({"id"})) {
+      message_.id = std::move(val);
+    } else if (at({"params", "textDocument", "uri"})) {
+      message_.uri = std::move(val);
+    } else if (at({"params", "textDocument", "text"}) ||
+               at({"params", "contentChanges", ARRAY_ELEMENT, "text"})) {
+      // Steal the lexer's buffer: the document text is never copied.
+      message_.text = std::move(val);
+    }
+    return true;
+  }
+
+  bool binary(json::binary_t &val) {
+    if (building_dom_)
+      dom_.binary(val);
+    return true;
+  }
+
+  bool start_object(size_t elements) {
+    if (building_dom_)
+      dom_.start_object(elements);
+    path_.emplace_back();  // replaced by each key
+    return true;
+  }
+
+  bool key(json::string_t &val) {
+    if (building_dom_)
+      dom_.key(val);
+    path_.back() = std::move(val);
+    return true;
+  }
+
+  bool end_object() {
+    if (building_dom_)
+      dom_.end_object();
+    path_.pop_back();
+    return true;
+  }
+
+  bool start_array(size_t elements) {
+    if (building_dom_)
+      dom_.start_array(elements);
+    path_.emplace_back(ARRAY_ELEMENT);
+    return true;
+  }
+
+  bool end_array() {
+    if (building_dom_)
+      dom_.end_array();
+    path_.pop_back();
+    return true;
+  }
+
+  bool parse_error(size_t, const std::string &, const nlohmann::detail::exception &) {
+    return false;
+  }
+
+ private:
+  [[nodiscard]] bool at(std::initializer_list<std::string_view> path) const {
+    return std::equal(path_.begin(), path_.end(), path.begin(), path.end());
+  }
+
+  IncomingMessage &message_;
+  std::vector<std::string> path_;
+
+  json dom_json_;
+  nlohmann::detail::json_sax_dom_parser<json> dom_;
+  bool building_dom_ = true;
+};
+}  // namespace
+
+bool is_streamed_method(std::string_view method) {
+  return std::find(STREAMED_METHODS.begin(), STREAMED_METHODS.end(), method) !=
+         STREAMED_METHODS.end();
+}
+
+bool is_interactive_method(std::string_view method) {
+  return std::find(INTERACTIVE_METHODS.begin(), INTERACTIVE_METHODS.end(), method) !=
+         INTERACTIVE_METHODS.end();
+}
+
+IncomingMessage parse_incoming_message(std::string_view frame) {
+  IncomingMessage message;
+  MessageSax sax(message);
+
+  // On malformed input the DOM parse below throws the parse_error with a proper diagnostic.
+  if (!nlohmann::json::sax_parse(frame.begin(), frame.end(), &sax)) {
+    message.json = nlohmann::json::parse(frame.begin(), frame.end());
+  } else {
+    message.json = sax.take_dom();
+  }
+  return message;
+}
+}  // namespace metalware
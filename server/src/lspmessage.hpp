@@ -0,0 +1,41 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "cancellation.hpp"
+#include "nlohmann/json.hpp"
+
+namespace metalware {
+// An incoming JSON-RPC message. For the hot methods (see is_streamed_method) the fields handlers
+// need are pulled out while the JSON is being streamed, so no DOM is built and the document text
+// is moved straight out of the parser. Every other message carries its full DOM in `json`.
+struct IncomingMessage {
+  std::string method;
+  nlohmann::json id;  // null for notifications
+  std::string uri;    // params.textDocument.uri
+  std::optional<std::string> text;  // didOpen: textDocument.text, didChange: last change text
+  std::optional<size_t> line;       // params.position.line
+  std::optional<size_t> character;  // params.position.character
+
+  nlohmann::json json;  // full message, only for methods that are not streamed
+
+  std::chrono::steady_clock::time_point received;
+  CancellationToken cancellation;  // cancelled by $/cancelRequest for this id
+
+  [[nodiscard]] bool streamed() const {
+    return json.is_null();
+  }
+};
+
+[[nodiscard]] bool is_streamed_method(std::string_view method);
+
+// Requests the user is waiting on. They are answered from the last completed compilation and never
+// wait for a diagnostics pass, which runs in the background.
+[[nodiscard]] bool is_interactive_method(std::string_view method);
+
+// Throws nlohmann::json::parse_error on malformed input.
+[[nodiscard]] IncomingMessage parse_incoming_message(std::string_view frame);
+}  // namespace metalware
@@ -1,8 +1,14 @@
+#include <charconv>
+
 #include "spdlog/sinks/basic_file_sink.h"
 #include "spdlog/spdlog.h"
 
 #if defined(_WIN32)
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
+#include <cstdio>
+#include <process.h>
+#define STDIN_FILENO _fileno(stdin)
+#define STDOUT_FILENO _fileno(stdout)
 #else
 #include <unistd.h>  // for getpid()
 
@@ -12,6 +18,7 @@
 
 #include "languageclient.hpp"
 #include "shared.hpp"
+#include "socket.hpp"
 
 // #define IGNORE_ALL_DIAGNOSTIC_FILTERS
 using namespace metalware;
@@ -35,6 +42,35 @@ void signal_handler(int signo) {
 #endif
 
 // HELPERS
+// Serves clients one after another on a local socket. The project lives in the packet handler
+// module, so its parsed state carries over from one client (editor session) to the next.
+int serve_socket(const ServerOptions &options) {
+#if defined(_WIN32)
+  spdlog::error("--listen is not supported on Windows");
+  return 1;
+#else
+  auto listener = SocketListener::create(options.listen_endpoint.value());
+  if (!listener.has_value()) {
+    return 1;
+  }
+
+  // A client may disconnect while we are writing to it; that must not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+
+  while (const auto fd = listener->accept_client()) {
+    spdlog::info("Client connected on {}", listener->endpoint());
+    {
+      auto client = std::make_shared<LanguageClient>(fd.value(), fd.value(), options);
+      client->setup();
+      client->handle_communication();
+    }
+    CLOSE_SOCKET(fd.value());
+    spdlog::info("Client disconnected");
+  }
+  return 1;
+#endif
+}
+
 int main(int argc, char *argv[]) {
   auto pid = getpid();
 #if defined(_WIN32)
@@ -60,7 +96,41 @@ int main(int argc, char *argv[]) {
   spdlog::flush_on(spdlog::level::info);
   spdlog::info("Starting hdl-server version: {}", VERSION);
 
-  std::shared_ptr<LanguageClient> client = std::make_shared<LanguageClient>();
+  ServerOptions options;
+  for (int i = 1; i < argc; i++) {
+    const std::string_view arg = argv[i];
+    if (arg == "--listen" && i + 1 < argc) {
+      options.listen_endpoint = argv[++i];
+      options.keep_project_between_sessions = true;
+    } else if (arg == "--debounce-ms" && i + 1 < argc) {
+      const std::string_view value = argv[++i];
+      int ms = 0;
+      if (const auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), ms);
+          ec != std::errc() || ptr != value.data() + value.size() || ms < 0) {
+        spdlog::warn("Ignoring invalid --debounce-ms value: {}", value);
+        continue;
+      }
+      options.change_debounce = std::chrono::milliseconds(ms);
+    } else if (arg == "--max-frame-mb" && i + 1 < argc) {
+      const std::string_view value = argv[++i];
+      size_t mb = 0;
+      if (const auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), mb);
+          ec != std::errc() || ptr != value.data() + value.size() || mb == 0) {
+        spdlog::warn("Ignoring invalid --max-frame-mb value: {}", value);
+        continue;
+      }
+      options.max_frame_size = mb * 1024 * 1024;
+    } else {
+      spdlog::warn("Ignoring unknown argument: {}", arg);
+    }
+  }
+
+  if (options.listen_endpoint.has_value()) {
+    return serve_socket(options);
+  }
+
+  std::shared_ptr<LanguageClient> client =
+      std::make_shared<LanguageClient>(STDIN_FILENO, STDOUT_FILENO, options);
   client->setup();
   client->handle_communication();
   return 0;
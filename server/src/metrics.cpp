@@ -0,0 +1,91 @@
+#include "metrics.hpp"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace metalware::metrics {
+
+namespace {
+struct Registry {
+  std::mutex mutex;
+  std::map<std::string, std::unique_ptr<Counter>, std::less<>> counters;
+  std::map<std::string, std::unique_ptr<Gauge>, std::less<>> gauges;
+  std::map<std::string, std::unique_ptr<Meter>, std::less<>> meters;
+};
+
+Registry& registry() {
+  static Registry r;
+  return r;
+}
+
+template <typename T>
+T& get_or_create(std::map<std::string, std::unique_ptr<T>, std::less<>>& metrics,
+    std::string_view name) {
+  auto itr = metrics.find(name);
+  if (itr == metrics.end()) {
+    itr = metrics.emplace(std::string(name), std::make_unique<T>()).first;
+  }
+  return *itr->second;
+}
+}  // namespace
+
+void Meter::mark() {
+  const auto now = std::chrono::steady_clock::now();
+  count_.fetch_add(1, std::memory_order_relaxed);
+  std::lock_guard lock(mutex_);
+  expire(now);
+  recent_.push_back(now);
+}
+
+double Meter::rate_per_second() {
+  std::lock_guard lock(mutex_);
+  expire(std::chrono::steady_clock::now());
+  return static_cast<double>(recent_.size()) / static_cast<double>(WINDOW.count());
+}
+
+void Meter::expire(std::chrono::steady_clock::time_point now) {
+  while (!recent_.empty() && now - recent_.front() > WINDOW) {
+    recent_.pop_front();
+  }
+}
+
+Counter& counter(std::string_view name) {
+  auto& r = registry();
+  std::lock_guard lock(r.mutex);
+  return get_or_create(r.counters, name);
+}
+
+Gauge& gauge(std::string_view name) {
+  auto& r = registry();
+  std::lock_guard lock(r.mutex);
+  return get_or_create(r.gauges, name);
+}
+
+Meter& meter(std::string_view name) {
+  auto& r = registry();
+  std::lock_guard lock(r.mutex);
+  return get_or_create(r.meters, name);
+}
+
+nlohmann::json to_json() {
+  auto& r = registry();
+  std::lock_guard lock(r.mutex);
+
+  nlohmann::json res;
+  res["counters"] = nlohmann::json::object();
+  res["gauges"] = nlohmann::json::object();
+  res["meters"] = nlohmann::json::object();
+  for (const auto& [name, c] : r.counters) {
+    res["counters"][name] = c->get();
+  }
+  for (const auto& [name, g] : r.gauges) {
+    res["gauges"][name] = g->get();
+  }
+  for (const auto& [name, m] : r.meters) {
+    res["meters"][name] = {{"count", m->count()}, {"rate_per_second", m->rate_per_second()}};
+  }
+  return res;
+}
+}  // namespace metalware::metrics
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string_view>
+
+#include "nlohmann/json.hpp"
+
+// Process-wide counters and gauges describing server health (queue depths, compile counts, ...).
+// Metrics are created on first use and live for the lifetime of the process, so references
+// returned by counter() and gauge() may be cached by callers.
+namespace metalware::metrics {
+class Counter {
+ public:
+  void add(int64_t n = 1) {
+    value_.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] int64_t get() const {
+    return value_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<int64_t> value_ = 0;
+};
+
+class Gauge {
+ public:
+  void set(int64_t v) {
+    value_.store(v, std::memory_order_relaxed);
+  }
+
+  // Raises the gauge to v if v is larger, for high-watermark style metrics.
+  void update_max(int64_t v) {
+    int64_t prev = value_.load(std::memory_order_relaxed);
+    while (prev < v && !value_.compare_exchange_weak(prev, v, std::memory_order_relaxed)) {
+    }
+  }
+
+  [[nodiscard]] int64_t get() const {
+    return value_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<int64_t> value_ = 0;
+};
+
+// Counts events and reports their rate over the last WINDOW, e.g. compilations per second.
+class Meter {
+ public:
+  static constexpr std::chrono::seconds WINDOW{10};
+
+  void mark();
+  [[nodiscard]] int64_t count() const {
+    return count_.load(std::memory_order_relaxed);
+  }
+  [[nodiscard]] double rate_per_second();
+
+ private:
+  void expire(std::chrono::steady_clock::time_point now);
+
+  std::atomic<int64_t> count_ = 0;
+  std::mutex mutex_;
+  std::deque<std::chrono::steady_clock::time_point> recent_;
+};
+
+Counter& counter(std::string_view name);
+Gauge& gauge(std::string_view name);
+Meter& meter(std::string_view name);
+
+// Returns every metric as {"counters": {...}, "gauges": {...}, "meters": {...}}.
+nlohmann::json to_json();
+}  // namespace metalware::metrics
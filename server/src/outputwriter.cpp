@@ -0,0 +1,198 @@
+#include "outputwriter.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <climits>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "metrics.hpp"
+#include "socket.hpp"
+#include "spdlog/spdlog.h"
+
+namespace metalware {
+
+namespace {
+#if defined(_WIN32)
+// There is no writev on Windows, so a batch is joined into one buffer and written at once.
+bool write_frames(int fd, const std::vector<OutputWriter::Frame>& frames, size_t& syscalls) {
+  std::string joined;
+  for (const auto& frame : frames) {
+    joined.append(frame.data, frame.offset);
+  }
+
+  size_t written = 0;
+  while (written < joined.size()) {
+    syscalls++;
+    const int n =
+        _write(fd, joined.data() + written, static_cast<unsigned int>(joined.size() - written));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      spdlog::error("Failed to write to output stream: {}", std::strerror(errno));
+      return false;
+    }
+    written += static_cast<size_t>(n);
+  }
+  return true;
+}
+#else
+bool write_frames(int fd, const std::vector<OutputWriter::Frame>& frames, size_t& syscalls) {
+  std::vector<iovec> iovs;
+  iovs.reserve(frames.size());
+  for (const auto& frame : frames) {
+    if (frame.data.size() > frame.offset) {
+      iovs.push_back(
+          {const_cast<char*>(frame.data.data()) + frame.offset, frame.data.size() - frame.offset});
+    }
+  }
+
+  size_t first = 0;
+  while (first < iovs.size()) {
+    const int count = static_cast<int>(std::min<size_t>(iovs.size() - first, IOV_MAX));
+    syscalls++;
+    ssize_t n = ::writev(fd, iovs.data() + first, count);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_for_fd(fd, /* for_write */ true))
+        continue;  // non-blocking socket in listen mode
+      spdlog::error("Failed to write to output stream: {}", std::strerror(errno));
+      return false;
+    }
+
+    // Skip fully written buffers and trim the partially written one.
+    while (n > 0 && first < iovs.size()) {
+      if (static_cast<size_t>(n) >= iovs[first].iov_len) {
+        n -= static_cast<ssize_t>(iovs[first].iov_len);
+        first++;
+      } else {
+        iovs[first].iov_base = static_cast<char*>(iovs[first].iov_base) + n;
+        iovs[first].iov_len -= static_cast<size_t>(n);
+        n = 0;
+      }
+    }
+  }
+  return true;
+}
+#endif
+}  // namespace
+
+OutputWriter::OutputWriter(int fd, size_t max_pending_bytes)
+    : fd_(fd), max_pending_bytes_(max_pending_bytes), thread_([this] {
+        run();
+      }) {}
+
+OutputWriter::~OutputWriter() {
+  close();
+}
+
+bool OutputWriter::write(std::string frame, size_t offset) {
+  std::unique_lock lock(mutex_);
+  if (pending_bytes_ >= max_pending_bytes_ && !closed_ && !failed_) {
+    metrics::counter("output_backpressure_stalls").add();
+    const auto start = std::chrono::steady_clock::now();
+    has_room_.wait(lock, [this] {
+      return closed_ || failed_ || pending_bytes_ < max_pending_bytes_;
+    });
+    metrics::counter("output_backpressure_wait_us")
+        .add(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+                .count());
+  }
+
+  if (closed_ || failed_) {
+    return false;
+  }
+
+  pending_bytes_ += frame.size() - offset;
+  pending_.push_back({std::move(frame), offset});
+  metrics::gauge("output_pending_bytes").set(static_cast<int64_t>(pending_bytes_));
+  metrics::gauge("output_pending_bytes_high_watermark")
+      .update_max(static_cast<int64_t>(pending_bytes_));
+  lock.unlock();
+  has_frames_.notify_one();
+  return true;
+}
+
+std::string OutputWriter::acquire_buffer() {
+  std::lock_guard lock(mutex_);
+  if (free_buffers_.empty()) {
+    return {};
+  }
+  std::string buffer = std::move(free_buffers_.back());
+  free_buffers_.pop_back();
+  return buffer;
+}
+
+void OutputWriter::close() {
+  {
+    std::lock_guard lock(mutex_);
+    closed_ = true;
+  }
+  has_frames_.notify_all();
+  has_room_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void OutputWriter::run() {
+  std::vector<Frame> batch;
+  while (true) {
+    size_t batch_bytes = 0;
+    {
+      std::unique_lock lock(mutex_);
+      has_frames_.wait(lock, [this] {
+        return closed_ || !pending_.empty();
+      });
+      if (pending_.empty()) {
+        return;  // closed and drained
+      }
+      batch.swap(pending_);
+      batch_bytes = pending_bytes_;
+    }
+
+    const bool ok = write_batch(batch);
+
+    {
+      std::lock_guard lock(mutex_);
+      // Keep a few written buffers around so that large responses do not reallocate every time.
+      for (auto& frame : batch) {
+        if (free_buffers_.size() < MAX_POOLED_BUFFERS &&
+            frame.data.capacity() <= MAX_POOLED_BUFFER_CAPACITY) {
+          frame.data.clear();
+          free_buffers_.push_back(std::move(frame.data));
+        }
+      }
+      pending_bytes_ -= batch_bytes;
+      failed_ = failed_ || !ok;
+      metrics::gauge("output_pending_bytes").set(static_cast<int64_t>(pending_bytes_));
+    }
+    batch.clear();
+    has_room_.notify_all();
+  }
+}
+
+bool OutputWriter::write_batch(const std::vector<Frame>& batch) {
+  size_t bytes = 0;
+  for (const auto& frame : batch) {
+    bytes += frame.data.size() - frame.offset;
+  }
+
+  size_t syscalls = 0;
+  const bool ok = write_frames(fd_, batch, syscalls);
+
+  metrics::counter("output_frames_written").add(static_cast<int64_t>(batch.size()));
+  metrics::counter("output_bytes_written").add(static_cast<int64_t>(bytes));
+  metrics::counter("output_write_calls").add(static_cast<int64_t>(syscalls));
+  return ok;
+}
+}  // namespace metalware
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace metalware {
+// Writes outgoing LSP frames to a file descriptor from a dedicated thread. Frames queued while a
+// write is in progress are coalesced into a single writev(2) call. When more than
+// `max_pending_bytes` are waiting (e.g. the editor stopped draining its pipe), producers block
+// until the backlog shrinks; such stalls are counted in the server metrics.
+class OutputWriter {
+ public:
+  explicit OutputWriter(int fd, size_t max_pending_bytes = DEFAULT_MAX_PENDING_BYTES);
+  ~OutputWriter();
+
+  OutputWriter(OutputWriter const&) = delete;
+  OutputWriter& operator=(OutputWriter const&) = delete;
+
+  // Queues a frame for writing; the bytes before `offset` are not part of it (see JsonWriter).
+  // Returns false if the writer is closed or the stream failed.
+  [[nodiscard]] bool write(std::string frame, size_t offset = 0);
+
+  // Returns an empty buffer, recycled from an already written frame when one is available.
+  [[nodiscard]] std::string acquire_buffer();
+
+  // Writes out every queued frame and stops the writer thread.
+  void close();
+
+  static constexpr size_t DEFAULT_MAX_PENDING_BYTES = 16 * 1024 * 1024;
+  static constexpr size_t MAX_POOLED_BUFFERS = 16;
+  static constexpr size_t MAX_POOLED_BUFFER_CAPACITY = 4 * 1024 * 1024;
+
+  struct Frame {
+    std::string data;
+    size_t offset = 0;
+  };
+
+ private:
+  void run();
+  [[nodiscard]] bool write_batch(const std::vector<Frame>& batch);
+
+  const int fd_;
+  const size_t max_pending_bytes_;
+
+  std::mutex mutex_;
+  std::condition_variable has_frames_;
+  std::condition_variable has_room_;
+  std::vector<Frame> pending_;
+  std::vector<std::string> free_buffers_;
+  size_t pending_bytes_ = 0;
+  bool closed_ = false;
+  bool failed_ = false;
+
+  std::thread thread_;
+};
+}  // namespace metalware
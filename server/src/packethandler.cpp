@@ -3,6 +3,7 @@
 #include "completions.hpp"
 #include "languageclient.hpp"
 #include "license.hpp"
+#include "metrics.hpp"
 #include "nlohmann/json.hpp"
 #include "spdlog/sinks/basic_file_sink.h"
 #include "spdlog/spdlog.h"
@@ -13,8 +14,78 @@
 
 namespace metalware {
 std::optional<std::shared_ptr<Project>> current_project;
+// Guards current_project and the project it points to. The dispatcher holds it while handling a
+// message; the diagnostics worker holds it except while it compiles.
+std::mutex project_mutex;
+
+namespace {
+// Of what publishDiagnostics sends for a file, so that an unchanged set need not be sent again.
+size_t fingerprint_published(const std::vector<Diagnostic> &file_diags) {
+  size_t seed = 0;
+  for (const auto &diag : file_diags) {
+    if (diag.severity == DiagnosticSeverity::None)
+      continue;
+    seed = utils::hash_combine(seed, utils::hash_text(diag.message));
+    seed = utils::hash_combine(seed, static_cast<size_t>(diag.severity));
+    for (const auto &position : {diag.range.start, diag.range.end}) {
+      seed = utils::hash_combine(seed, position.line);
+      seed = utils::hash_combine(seed, position.character);
+    }
+  }
+  return seed;
+}
+
+// Also the resultId of the file's diagnostics for pulling clients.
+std::string result_id(const std::vector<Diagnostic> &file_diags) {
+  return fmt::format("{:x}", fingerprint_published(file_diags));
+}
+
+void write_diagnostic_items(JsonWriter &writer, const std::vector<Diagnostic> &file_diags) {
+  writer.begin_array();
+  for (const auto &diag : file_diags) {
+    if (diag.severity == DiagnosticSeverity::None) {
+      continue;
+    }
+
+    writer.begin_object()
+        .key("message").value(diag.message)
+        .key("severity").value(static_cast<int>(diag.severity))
+        .key("range");
+    diag.range.write_json(writer);
+    writer.key("source").value(PRODUCT_NAME).end_object();
+  }
+  writer.end_array();
+}
+
+// A full report, or an unchanged one if the client already has `previous_result_id`.
+void write_document_report(JsonWriter &writer, const std::vector<Diagnostic> &file_diags,
+    std::string_view previous_result_id) {
+  const std::string id = result_id(file_diags);
+  if (id == previous_result_id) {
+    metrics::counter("diagnostic_pulls_unchanged").add();
+    writer.key("kind").value("unchanged").key("resultId").value(id);
+    return;
+  }
+  metrics::counter("diagnostic_pulls_full").add();
+  writer.key("kind").value("full").key("resultId").value(id).key("items");
+  write_diagnostic_items(writer, file_diags);
+}
+}  // namespace
 
 // HELPERS
+bool PacketHandler::send_request_cancelled(const nlohmann::json &id) const {
+  metrics::counter("requests_cancelled").add();
+  nlohmann::json response;
+  response["jsonrpc"] = "2.0";
+  response["id"] = id;
+  response["error"]["code"] = REQUEST_CANCELLED;
+  response["error"]["message"] = "Request cancelled";
+  std::string resp = serialize_json_message(response);
+  if (std::shared_ptr<LanguageClient> c = language_client_.lock())
+    return c->send_packet(std::move(resp));
+  return false;
+}
+
 std::string PacketHandler::serialize_json_message(const nlohmann::json &json_msg) {
   try {
     auto content = json_msg.dump(-1);
@@ -48,7 +119,7 @@ bool PacketHandler::send_project_structure_changed() const {
   response["method"] = "backend/projectStructureChanged";
   std::string resp = serialize_json_message(response);
   if (std::shared_ptr<LanguageClient> c = language_client_.lock())
-    return c->send_packet(resp);
+    return c->send_packet(std::move(resp));
   return false;
 }
 
@@ -57,10 +128,10 @@ bool PacketHandler::send_license_missing() const {
   response["jsonrpc"] = "2.0";
   response["method"] = "backend/licenseMissing";
   response["params"]["message"] = "License error: missing license";
-  const std::string resp = serialize_json_message(response);
+  std::string resp = serialize_json_message(response);
 
   if (std::shared_ptr<LanguageClient> c = language_client_.lock()) {
-    return c->send_packet(resp);
+    return c->send_packet(std::move(resp));
   } else {
     spdlog::error("Failed to send missing license!");
   }
@@ -74,7 +145,7 @@ bool PacketHandler::send_license_invalid() const {
   response["params"]["message"] = "License error: invalid license";
   auto resp = serialize_json_message(response);
   if (std::shared_ptr<LanguageClient> c = language_client_.lock())
-    return c->send_packet(resp);
+    return c->send_packet(std::move(resp));
   return false;
 }
 
@@ -85,7 +156,7 @@ bool PacketHandler::send_license_valid() const {
   response["params"]["message"] = "License is valid";
   std::string resp = serialize_json_message(response);
   if (std::shared_ptr<LanguageClient> c = language_client_.lock())
-    return c->send_packet(resp);
+    return c->send_packet(std::move(resp));
   return false;
 }
 
@@ -97,7 +168,7 @@ bool PacketHandler::send_cache_license() const {
   response["params"]["key"] = license::get_cached_license();
   std::string resp = serialize_json_message(response);
   if (std::shared_ptr<LanguageClient> c = language_client_.lock())
-    return c->send_packet(resp);
+    return c->send_packet(std::move(resp));
   return false;
 }
 
@@ -109,15 +180,12 @@ bool PacketHandler::send_warning(std::string_view msg) const {
   response["params"]["message"] = std::string(msg);
   std::string resp = serialize_json_message(response);
   if (std::shared_ptr<LanguageClient> c = language_client_.lock())
-    return c->send_packet(resp);
+    return c->send_packet(std::move(resp));
   return false;
 }
 
 [[nodiscard]] bool PacketHandler::send_diagnostics(
-    const std::vector<Diagnostic> &all_diagnostics) const {
-  if (!current_project.has_value())
-    return false;
-
+    Project &project, const std::vector<Diagnostic> &all_diagnostics) const {
   std::unordered_map<fs::path, std::vector<Diagnostic>> diagnostics_by_file;
   std::map<fs::path, std::vector<Diagnostic>> current_files_with_diagnostics;
 
@@ -136,7 +204,7 @@ bool PacketHandler::send_warning(std::string_view msg) const {
 
   // Create empty diagnostics for files that had diagnostics in the past but not anymore. This is to
   // clear the diagnostics in the LSP client.
-  for (const auto &[path, _] : current_project.value()->prev_files_with_diagnostics) {
+  for (const auto &[path, _] : project.prev_files_with_diagnostics) {
     if (!diagnostics_by_file.contains(path)) {
       spdlog::debug(
           "Old diagnostic to clear raw {} uri {}", path.string(), utils::path_to_uri(path));
@@ -145,78 +213,293 @@ bool PacketHandler::send_warning(std::string_view msg) const {
   }
 
   // Save the current files with diagnostics so they can be exonerated in the next call.
-  current_project.value()->prev_files_with_diagnostics = current_files_with_diagnostics;
+  project.prev_files_with_diagnostics = current_files_with_diagnostics;
 
-  // Send diagnostics for each file
+  std::shared_ptr<LanguageClient> c = language_client_.lock();
+  if (!c)
+    return true;
+
+  // Send diagnostics for each file whose set changed since it was last published.
+  auto &fingerprints = project.published_diagnostics_fingerprints;
+  int64_t skipped = 0;
+  bool changed = false;
   for (const auto &[filepath, file_diags] : diagnostics_by_file) {
-    nlohmann::json response;
-    response["jsonrpc"] = "2.0";
-    response["method"] = "textDocument/publishDiagnostics";
-    response["params"]["uri"] = utils::path_to_uri(filepath);
-    spdlog::debug("The URI is: {}", response["params"]["uri"].get<std::string>());
-    nlohmann::json diagnostics_json = nlohmann::json::array();
+    const size_t fingerprint = fingerprint_published(file_diags);
+    const auto itr = fingerprints.find(filepath);
+    if (itr != fingerprints.end() && itr->second == fingerprint) {
+      skipped++;
+      continue;
+    }
+    if (!pull_diagnostics_ && !send_file_diagnostics(*c, filepath, file_diags)) {
+      metrics::counter("diagnostics_publishes_skipped").add(skipped);
+      return false;
+    }
+    changed = true;
+    if (file_diags.empty())
+      fingerprints.erase(filepath);
+    else
+      fingerprints[filepath] = fingerprint;
+  }
+  metrics::counter("diagnostics_publishes_skipped").add(skipped);
 
-    for (const auto &diag : file_diags) {
-      if (diag.severity == DiagnosticSeverity::None) {
-        continue;
-      }
+  // Pulling clients fetch the files that changed themselves, once told that there are any.
+  return !pull_diagnostics_ || !changed || send_diagnostic_refresh(*c);
+}
 
-      nlohmann::json diag_json;
-      diag_json["message"] = diag.message;
-      diag_json["severity"] = static_cast<int>(diag.severity);
-      diag_json["range"]["start"]["line"] = diag.range.start.line;
-      diag_json["range"]["start"]["character"] = diag.range.start.character;
-      diag_json["range"]["end"]["line"] = diag.range.end.line;
-      diag_json["range"]["end"]["character"] = diag.range.end.character;
-      diag_json["source"] = "HDL Copilot";
-      diagnostics_json.push_back(diag_json);
-    }
+bool PacketHandler::send_diagnostic_refresh(LanguageClient &client) const {
+  JsonWriter writer(client.acquire_buffer());
+  writer.begin_object()
+      .key("jsonrpc").value("2.0")
+      .key("id").value(fmt::format("refresh-{}", next_request_id_++))
+      .key("method").value("workspace/diagnostic/refresh")
+      .end_object();
+  return client.send_packet(std::move(writer));
+}
 
-    response["params"]["diagnostics"] = diagnostics_json;
+// The frame is serialized straight into a recycled buffer.
+bool PacketHandler::send_file_diagnostics(LanguageClient &client, const fs::path &filepath,
+    const std::vector<Diagnostic> &file_diags) {
+  const std::string uri = utils::path_to_uri(filepath);
+  spdlog::debug("The URI is: {}", uri);
+
+  JsonWriter writer(client.acquire_buffer());
+  writer.begin_object()
+      .key("jsonrpc").value("2.0")
+      .key("method").value("textDocument/publishDiagnostics");
+  writer.key("params").begin_object().key("uri").value(uri);
+  writer.key("diagnostics");
+  write_diagnostic_items(writer, file_diags);
+  writer.end_object().end_object();
+
+  return client.send_packet(std::move(writer));
+}
 
-    std::string resp = serialize_json_message(response);
-    if (std::shared_ptr<LanguageClient> c = language_client_.lock())
-      if (!c->send_packet(resp)) {
-        return false;
-      }
+// Publishes the parse diagnostics of the edited file ahead of the full pass, which replaces them.
+// They replace what the client shows for the file only while it has syntax errors, so that the
+// semantic diagnostics of a file that parses do not flicker with every edit.
+bool PacketHandler::report_parse_diagnostics(const std::shared_ptr<Project> &project,
+    const CompileInputs &inputs, const fs::path &edited_file,
+    const CancellationToken &cancellation) {
+  const auto last = std::chrono::high_resolution_clock::now();
+  const auto diagnostics = Project::find_parse_diagnostics(inputs, edited_file, cancellation);
+  if (!diagnostics.has_value()) {
+    return true;
   }
+
+  std::lock_guard lock(project_mutex);
+  if (cancellation.is_cancelled() || current_project != project) {
+    return true;
+  }
+
+  auto &published = project->prev_files_with_diagnostics;
+  const auto previous = published.find(edited_file);
+  const bool had_syntax_errors = previous != published.end() &&
+      std::any_of(previous->second.begin(), previous->second.end(), [](const auto &diag) {
+        return diag.syntax;
+      });
+  if (diagnostics.value().empty() && !had_syntax_errors) {
+    return true;
+  }
+
+  if (diagnostics.value().empty()) {
+    published.erase(edited_file);
+  } else {
+    published[edited_file] = diagnostics.value();
+  }
+
+  spdlog::info("Parse diagnostics of {} took: {}ms, {} diagnostics",
+      edited_file.string(),
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::high_resolution_clock::now() - last)
+          .count(),
+      diagnostics.value().size());
+  metrics::counter("parse_diagnostics_published").add();
+
+  std::shared_ptr<LanguageClient> c = language_client_.lock();
+  if (!c)
+    return true;
+  if (pull_diagnostics_ ? !send_diagnostic_refresh(*c)
+                        : !send_file_diagnostics(*c, edited_file, diagnostics.value()))
+    return false;
+  if (diagnostics.value().empty())
+    project->published_diagnostics_fingerprints.erase(edited_file);
+  else
+    project->published_diagnostics_fingerprints[edited_file] =
+        fingerprint_published(diagnostics.value());
   return true;
 }
 
-bool PacketHandler::find_and_report_diagnostics() {
+bool PacketHandler::schedule_diagnostics(const std::optional<fs::path> &edited_file) {
   if (!current_project.has_value()) {
     spdlog::error("Find and report: No current project");
     return false;
   }
 
-  LICENSE_CHECK
+  {
+    std::lock_guard lock(schedule_mutex_);
+    diagnostics_requested_ = true;
+    if (edited_file.has_value())
+      edited_files_.insert(edited_file.value());
+  }
+  // A pass that is already running works on stale inputs.
+  if (std::shared_ptr<LanguageClient> c = language_client_.lock())
+    c->cancel_diagnostics_pass();
+  schedule_cv_.notify_one();
+  return true;
+}
 
-  std::vector<std::string_view> to_del;
-  // Send unsent compiler warnings.
-  for (auto &[msg, ack] : current_project.value()->compiler_warnings) {
-    spdlog::warn("Compiler warning: {}", msg);
-    if (!ack) {
-      if (!send_warning(msg)) {
-        spdlog::error("Failed to send warning: {}", msg);
-      }
-      if (std::find(REPETABLE_WARNINGS.begin(), REPETABLE_WARNINGS.end(), msg) ==
-          REPETABLE_WARNINGS.end()) {
-        current_project.value()->compiler_warnings[msg] = true;
-      } else {
-        to_del.push_back(msg);
+void PacketHandler::run_diagnostics_worker() {
+  while (true) {
+    std::set<fs::path> edited_files;
+    {
+      std::unique_lock lock(schedule_mutex_);
+      const auto requested = [this] {
+        return stopping_ || diagnostics_requested_;
+      };
+      if (retry_skipped_pass_)
+        schedule_cv_.wait_for(lock, SKIPPED_PASS_RETRY_DELAY, requested);
+      else
+        schedule_cv_.wait(lock, requested);
+      if (stopping_)
+        return;
+      diagnostics_requested_ = false;
+      retry_skipped_pass_ = false;
+      edited_files.swap(edited_files_);
+    }
+
+    if (!find_and_report_diagnostics(edited_files)) {
+      spdlog::error("Failed to find and report diagnostics");
+    }
+  }
+}
+
+void PacketHandler::stop() {
+  {
+    std::lock_guard lock(schedule_mutex_);
+    stopping_ = true;
+  }
+  if (std::shared_ptr<LanguageClient> c = language_client_.lock())
+    c->cancel_diagnostics_pass();
+  schedule_cv_.notify_all();
+  if (diagnostics_worker_.joinable())
+    diagnostics_worker_.join();
+}
+
+// Runs on the diagnostics worker. The project is locked only to capture the compile inputs and
+// again to publish the snapshot and report, so requests keep being served while it compiles.
+bool PacketHandler::find_and_report_diagnostics(const std::set<fs::path> &edited_files) {
+  std::shared_ptr<LanguageClient> c = language_client_.lock();
+  if (!c)
+    return false;
+
+  // Edits preempt the pass, unless the last few passes were all preempted: then this one is
+  // allowed to finish, so that the editor still gets diagnostics while the user keeps typing.
+  const bool cancellable = cancelled_passes_in_a_row_ < MAX_CANCELLED_PASSES_IN_A_ROW;
+  const CancellationToken cancellation = c->begin_diagnostics_pass(cancellable);
+
+  // Growing the dependency closure reads files, so it happens before the project is locked for the
+  // compile inputs.
+  std::optional<Project::ClosureUpdate> closure_update;
+  {
+    std::lock_guard lock(project_mutex);
+    if (current_project.has_value())
+      closure_update = current_project.value()->capture_closure_update();
+  }
+  if (closure_update.has_value())
+    Project::update_dependency_closure(closure_update.value());
+
+  std::shared_ptr<Project> project;
+  CompileInputs inputs;
+  SnapshotPtr cached;
+  {
+    std::lock_guard lock(project_mutex);
+    if (!current_project.has_value()) {
+      spdlog::error("Find and report: No current project");
+      return false;
+    }
+    project = current_project.value();
+
+    LICENSE_CHECK
+
+    std::vector<std::string_view> to_del;
+    // Send unsent compiler warnings.
+    for (auto &[msg, ack] : project->compiler_warnings) {
+      spdlog::warn("Compiler warning: {}", msg);
+      if (!ack) {
+        if (!send_warning(msg)) {
+          spdlog::error("Failed to send warning: {}", msg);
+        }
+        if (std::find(REPETABLE_WARNINGS.begin(), REPETABLE_WARNINGS.end(), msg) ==
+            REPETABLE_WARNINGS.end()) {
+          project->compiler_warnings[msg] = true;
+        } else {
+          to_del.push_back(msg);
+        }
       }
     }
+
+    for (const auto &msg : to_del) {
+      project->compiler_warnings.erase(msg);
+    }
+
+    inputs = project->capture_compile_inputs();
+    cached = project->find_snapshot(inputs);
   }
 
-  for (const auto &msg : to_del) {
-    current_project.value()->compiler_warnings.erase(msg);
+  for (const auto &edited_file : edited_files) {
+    if (cached || cancellation.is_cancelled())
+      break;
+    if (!report_parse_diagnostics(project, inputs, edited_file, cancellation))
+      spdlog::error("Failed to report parse diagnostics");
   }
 
   // Time diagnostics
   auto last = std::chrono::high_resolution_clock::now();
 
-  const auto lsp_diagnostics = current_project.value()->find_diagnostics();
-  const bool res = send_diagnostics(lsp_diagnostics);
+  if (!cached && !project->reserve_snapshot()) {
+    // Tried again shortly, for the files edited so far too.
+    std::lock_guard lock(schedule_mutex_);
+    edited_files_.insert(edited_files.begin(), edited_files.end());
+    retry_skipped_pass_ = true;
+    metrics::counter("diagnostics_passes_skipped").add();
+    return true;
+  }
+
+  // Switching back to a recent define set publishes its snapshot again without compiling.
+  auto snapshot = cached ? nonstd::expected<SnapshotPtr, std::string>(cached)
+                         : Project::build_snapshot(std::move(inputs), cancellation);
+  if (cached) {
+    spdlog::info("Reusing the compilation of a recent define set");
+  } else if (snapshot.has_value()) {
+    spdlog::info("Compilation and elaboration took: {}ms, {} diagnostics",
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - last)
+            .count(),
+        snapshot.value()->diagnostics.size());
+  }
+
+  // Declared before the lock, so that the snapshots it supersedes are destroyed after unlocking.
+  std::vector<SnapshotPtr> superseded;
+  std::lock_guard lock(project_mutex);
+  if (cancellation.is_cancelled() || current_project != project) {
+    spdlog::info("Diagnostics pass cancelled after {}ms",
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - last)
+            .count());
+    metrics::counter("diagnostics_passes_cancelled").add();
+    cancelled_passes_in_a_row_++;
+    return true;
+  }
+  cancelled_passes_in_a_row_ = 0;
+
+  bool res = false;
+  if (snapshot.has_value()) {
+    superseded = project->publish(snapshot.value());
+    res = send_diagnostics(*project, snapshot.value()->diagnostics);
+  } else {
+    spdlog::error("Compilation failed: {}", snapshot.error());
+    res = send_diagnostics(*project, {});
+  }
 
   spdlog::info("Time to find and send diagnostics: {}ms",
       std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -225,8 +508,8 @@ bool PacketHandler::find_and_report_diagnostics() {
   return res;
 }
 
-CompletionList PacketHandler::get_completions(
-    std::string_view prefix, const fs::path &filepath, size_t line, size_t col) {
+CompletionList PacketHandler::get_completions(std::string_view prefix, const fs::path &filepath,
+    size_t line, size_t col, const CancellationToken &cancellation) {
   if (!current_project.has_value())
     return {};
 
@@ -261,7 +544,7 @@ CompletionList PacketHandler::get_completions(
     }
   }
 
-  const auto modules = current_project.value()->get_modules();
+  const auto modules = current_project.value()->get_modules(cancellation);
 
   // MODULE INSTANTIATION
   // TODO: make sure we are within the right scope
@@ -311,7 +594,7 @@ CompletionList PacketHandler::get_completions(
 }
 
 // HANDLERS
-bool PacketHandler::handle_initialize(const nlohmann::json &json_msg) const {
+bool PacketHandler::handle_initialize(const nlohmann::json &json_msg) {
   spdlog::info("Received initialize request");
   // Make sure id is present
   if (!json_msg.contains("id")) {
@@ -329,8 +612,19 @@ bool PacketHandler::handle_initialize(const nlohmann::json &json_msg) const {
   response["result"]["capabilities"]["codeActionProvider"] = false;
   response["result"]["capabilities"]["definitionProvider"] = true;
 
-  response["result"]["capabilities"]["diagnosticProvider"]["interFileDependencies"] = false;
-  response["result"]["capabilities"]["diagnosticProvider"]["workspaceDiagnostics"] = false;
+  // Clients that pull diagnostics are told when to pull again, so those that cannot be told are
+  // still pushed to.
+  using json_pointer = nlohmann::json::json_pointer;
+  nlohmann::json capabilities = nlohmann::json::object();
+  if (json_msg.contains("params"))
+    capabilities = json_msg["params"].value("capabilities", capabilities);
+  pull_diagnostics_ =
+      capabilities.contains(json_pointer("/textDocument/diagnostic")) &&
+      capabilities.value(json_pointer("/workspace/diagnostics/refreshSupport"), false);
+  spdlog::info("Diagnostics are {}", pull_diagnostics_ ? "pulled" : "pushed");
+
+  response["result"]["capabilities"]["diagnosticProvider"]["interFileDependencies"] = true;
+  response["result"]["capabilities"]["diagnosticProvider"]["workspaceDiagnostics"] = true;
 
   response["result"]["capabilities"]["documentFormattingProvider"] = false;
   response["result"]["capabilities"]["documentHighlightProvider"] = false;
@@ -346,7 +640,7 @@ bool PacketHandler::handle_initialize(const nlohmann::json &json_msg) const {
 
   bool res = false;
   if (std::shared_ptr<LanguageClient> c = language_client_.lock()) {
-    res = c->send_packet(resp);
+    res = c->send_packet(std::move(resp));
   } else {
     spdlog::error("Get socket client failed");
   }
@@ -367,59 +661,57 @@ bool PacketHandler::handle_initialize(const nlohmann::json &json_msg) const {
   return res;
 }
 
-bool PacketHandler::handle_definition(const nlohmann::json &json_msg) const {
+bool PacketHandler::handle_definition(const IncomingMessage &message) const {
   spdlog::info("Received definition request");
 
   if (!current_project.has_value())
     return false;
 
-  if (!json_msg.contains("params") || !json_msg["params"].contains("position") ||
-      !json_msg["params"]["position"].contains("line") ||
-      !json_msg["params"]["position"].contains("character") ||
-      !json_msg["params"].contains("textDocument") ||
-      !json_msg["params"]["textDocument"].contains("uri")) {
-    spdlog::error("Invalid definition request: {}", json_msg.dump(4));
+  if (message.uri.empty() || !message.line.has_value() || !message.character.has_value()) {
+    spdlog::error("Invalid definition request: missing uri or position");
     return false;
   }
 
-  const auto path =
-      utils::uri_to_path(json_msg["params"]["textDocument"]["uri"].get<std::string>());
-  const auto row = json_msg["params"]["position"]["line"].get<size_t>();
-  const auto col = json_msg["params"]["position"]["character"].get<size_t>();
+  if (message.cancellation.is_cancelled())
+    return send_request_cancelled(message.id);
 
-  std::vector<Location> locations = current_project.value()->lookup(path, row, col);
+  const auto path = utils::uri_to_path(message.uri);
+  const auto row = message.line.value();
+  const auto col = message.character.value();
+
+  std::vector<Location> locations =
+      current_project.value()->lookup(path, row, col, message.cancellation);
+  if (message.cancellation.is_cancelled())
+    return send_request_cancelled(message.id);
 
   nlohmann::json response;
   response["jsonrpc"] = "2.0";
-  response["id"] = json_msg["id"];
+  response["id"] = message.id;
   response["result"] = nlohmann::json::array();
 
   for (const auto &loc : locations) {
     response["result"].push_back(loc.to_json());
   }
 
-  const auto resp = serialize_json_message(response);
+  auto resp = serialize_json_message(response);
   if (std::shared_ptr<LanguageClient> c = language_client_.lock())
-    return c->send_packet(resp);
+    return c->send_packet(std::move(resp));
 
   return true;
 }
 
-bool PacketHandler::handle_did_open(const nlohmann::json &json_msg) {
+bool PacketHandler::handle_did_open(IncomingMessage &&message) {
   if (!current_project.has_value())
     return false;
 
-  if (!json_msg.contains("params") || !json_msg["params"].contains("textDocument") ||
-      !json_msg["params"]["textDocument"].contains("uri") ||
-      !json_msg["params"]["textDocument"].contains("text")) {
-    spdlog::error("Invalid didOpen request: {}", json_msg.dump(4));
+  if (message.uri.empty() || !message.text.has_value()) {
+    spdlog::error("Invalid didOpen request: missing uri or text");
     return false;
   }
 
-  auto filepath = utils::uri_to_path(json_msg["params"]["textDocument"]["uri"].get<std::string>());
-  const std::string text = json_msg["params"]["textDocument"]["text"];
-  if (current_project.value()->add_file(filepath, text)) {
-    return find_and_report_diagnostics();
+  auto filepath = utils::uri_to_path(message.uri);
+  if (current_project.value()->add_file(filepath, std::move(message.text.value()))) {
+    return schedule_diagnostics();
   }
 
   return true;
@@ -443,7 +735,7 @@ bool PacketHandler::handle_include_resource(const nlohmann::json &json_msg) cons
     response["method"] = "backend/exclusionsChanged";
     auto resp = serialize_json_message(response);
     if (std::shared_ptr<LanguageClient> c = language_client_.lock())
-      return c->send_packet(resp);
+      return c->send_packet(std::move(resp));
   }
   return false;
 }
@@ -466,7 +758,7 @@ bool PacketHandler::handle_exclude_resource(const nlohmann::json &json_msg) cons
     response["method"] = "backend/exclusionsChanged";
     auto resp = serialize_json_message(response);
     if (std::shared_ptr<LanguageClient> c = language_client_.lock())
-      return c->send_packet(resp);
+      return c->send_packet(std::move(resp));
   }
   return true;
 }
@@ -498,7 +790,7 @@ bool PacketHandler::handle_set_macros(const nlohmann::json &json_msg) const {
     response["method"] = "backend/macrosChanged";
     auto resp = serialize_json_message(response);
     if (std::shared_ptr<LanguageClient> c = language_client_.lock())
-      return c->send_packet(resp);
+      return c->send_packet(std::move(resp));
   }
   return true;
 }
@@ -517,79 +809,96 @@ bool PacketHandler::handle_did_close(const nlohmann::json &json_msg) {
   auto filepath = utils::uri_to_path(json_msg["params"]["textDocument"]["uri"].get<std::string>());
   current_project.value()->remove_file_if_no_ent(filepath);
 
-  return find_and_report_diagnostics();
+  return schedule_diagnostics();
 }
 
-bool PacketHandler::handle_text_document_completion(const nlohmann::json &json_msg) const {
+bool PacketHandler::handle_did_save(const nlohmann::json &json_msg) {
+  LICENSE_CHECK
+  if (!current_project.has_value())
+    return false;
+
+  if (!json_msg.contains("params") || !json_msg["params"].contains("textDocument") ||
+      !json_msg["params"]["textDocument"].contains("uri")) {
+    spdlog::error("Invalid didSave request: {}", json_msg.dump(4));
+    return false;
+  }
+
+  // The buffer still holds the saved text, so there is nothing to compile again until it changes.
+  current_project.value()->invalidate_source(
+      utils::uri_to_path(json_msg["params"]["textDocument"]["uri"].get<std::string>()));
+  return true;
+}
+
+bool PacketHandler::handle_text_document_completion(const IncomingMessage &message) const {
   LICENSE_CHECK
 
   if (!current_project.has_value())
     return false;
 
-  spdlog::debug("Received completion request {}", json_msg.dump(4));
+  spdlog::debug("Received completion request for {}", message.uri);
 
-  if (!json_msg.contains("params") || !json_msg["params"].contains("position") ||
-      !json_msg["params"]["position"].contains("line") ||
-      !json_msg["params"]["position"].contains("character") ||
-      !json_msg["params"].contains("textDocument") ||
-      !json_msg["params"]["textDocument"].contains("uri")) {
+  if (message.uri.empty() || !message.line.has_value() || !message.character.has_value()) {
     return false;
   }
 
   // identify characters based on position
-  const size_t col = json_msg["params"]["position"]["character"];
-  const size_t line = json_msg["params"]["position"]["line"];
+  const size_t col = message.character.value();
+  const size_t line = message.line.value();
 
-  fs::path filepath =
-      utils::uri_to_path(json_msg["params"]["textDocument"]["uri"].get<std::string>());
+  fs::path filepath = utils::uri_to_path(message.uri);
 
-  std::string buff;
-  nlohmann::json response;
-  response["jsonrpc"] = "2.0";
-  response["id"] = json_msg["id"];
+  if (message.cancellation.is_cancelled())
+    return send_request_cancelled(message.id);
 
+  std::string buff;
   auto start = std::chrono::high_resolution_clock::now();
   if (current_project.value()->get_text_from_file_loc(filepath, line, col, buff)) {
-    const auto completions = get_completions(buff, filepath, line, col);
-    response["result"]["isIncomplete"] = false;
-    response["result"]["items"] = nlohmann::json::array();
+    const auto completions = get_completions(buff, filepath, line, col, message.cancellation);
+    if (message.cancellation.is_cancelled())
+      return send_request_cancelled(message.id);
+
+    std::shared_ptr<LanguageClient> c = language_client_.lock();
+    if (!c)
+      return true;
+
+    JsonWriter writer(c->acquire_buffer());
+    writer.begin_object().key("jsonrpc").value("2.0").key("id").json(message.id);
+    writer.key("result").begin_object().key("isIncomplete").value(false);
+    writer.key("items").begin_array();
     for (const auto &completion : completions.items) {
       spdlog::debug("Completion: {}", completion.label);
-      response["result"]["items"].push_back(completion.to_json());
+      completion.write_json(writer);
     }
+    writer.end_array().end_object().end_object();
+
     auto end = std::chrono::high_resolution_clock::now();
     spdlog::info("Time to get {} completions: {}ms",
         completions.items.size(),
         std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count());
-    auto resp = serialize_json_message(response);
-    if (std::shared_ptr<LanguageClient> c = language_client_.lock())
-      return c->send_packet(resp);
+    return c->send_packet(std::move(writer));
   }
 
   return false;
 }
 
-bool PacketHandler::handle_did_change(const nlohmann::json &json_msg) {
+bool PacketHandler::handle_did_change(IncomingMessage &&message) {
   LICENSE_CHECK
   if (!current_project.has_value())
     return false;
 
   spdlog::info("Received didChange request");
 
-  if (!json_msg.contains("params") || !json_msg["params"].contains("textDocument") ||
-      !json_msg["params"]["textDocument"].contains("uri")) {
-    spdlog::error("Invalid didChange request: {}", json_msg.dump(4));
+  if (message.uri.empty() || !message.text.has_value()) {
+    spdlog::error("Invalid didChange request: missing uri or content changes");
     return false;
   }
 
-  spdlog::info(" - uri: {}", json_msg["params"]["textDocument"]["uri"].get<std::string>());
+  spdlog::info(" - uri: {}", message.uri);
 
-  const std::string text = json_msg["params"]["contentChanges"][0]["text"];
-  const fs::path filepath =
-      utils::uri_to_path(json_msg["params"]["textDocument"]["uri"].get<std::string>());
+  const fs::path filepath = utils::uri_to_path(message.uri);
 
-  current_project.value()->update_file_buffer(filepath, text);
-  return find_and_report_diagnostics();
+  current_project.value()->update_file_buffer(filepath, std::move(message.text.value()));
+  return schedule_diagnostics(filepath);
 }
 
 bool PacketHandler::handle_add_root_unit(const nlohmann::json &json_msg) {
@@ -618,7 +927,7 @@ bool PacketHandler::handle_add_root_unit(const nlohmann::json &json_msg) {
     spdlog::error("Failed to send project structure changed");
   }
 
-  return find_and_report_diagnostics();
+  return schedule_diagnostics();
 }
 
 bool PacketHandler::handle_remove_root_unit(const nlohmann::json &json_msg) {
@@ -646,7 +955,7 @@ bool PacketHandler::handle_remove_root_unit(const nlohmann::json &json_msg) {
     spdlog::error("Failed to send project structure changed");
   }
 
-  return find_and_report_diagnostics();
+  return schedule_diagnostics();
 }
 
 bool PacketHandler::handle_set_license_key(const nlohmann::json &json_msg) {
@@ -680,7 +989,7 @@ bool PacketHandler::handle_set_license_key(const nlohmann::json &json_msg) {
     }
   }
 
-  return find_and_report_diagnostics();
+  return schedule_diagnostics();
 }
 
 bool PacketHandler::handle_get_diagnostic_strings_for_line(const nlohmann::json &json_msg) const {
@@ -719,7 +1028,102 @@ bool PacketHandler::handle_get_diagnostic_strings_for_line(const nlohmann::json
 
   auto resp = serialize_json_message(response);
   if (std::shared_ptr<LanguageClient> c = language_client_.lock())
-    return c->send_packet(resp);
+    return c->send_packet(std::move(resp));
+  return true;
+}
+
+bool PacketHandler::handle_document_diagnostic(const nlohmann::json &json_msg) const {
+  if (!json_msg.contains("id") || !json_msg.contains("params") ||
+      !json_msg["params"].contains("textDocument") ||
+      !json_msg["params"]["textDocument"].contains("uri")) {
+    spdlog::error("Invalid textDocument/diagnostic request: {}", json_msg.dump(4));
+    return false;
+  }
+
+  std::shared_ptr<LanguageClient> c = language_client_.lock();
+  if (!c)
+    return true;
+
+  const auto &params = json_msg["params"];
+  const auto filepath = utils::uri_to_path(params["textDocument"]["uri"].get<std::string>());
+  const std::string previous_result_id = params.value("previousResultId", "");
+
+  static const std::vector<Diagnostic> NO_DIAGNOSTICS;
+  const std::vector<Diagnostic> *file_diags = &NO_DIAGNOSTICS;
+  if (current_project.has_value()) {
+    const auto &published = current_project.value()->prev_files_with_diagnostics;
+    if (const auto itr = published.find(filepath); itr != published.end())
+      file_diags = &itr->second;
+  }
+
+  JsonWriter writer(c->acquire_buffer());
+  writer.begin_object().key("jsonrpc").value("2.0").key("id").json(json_msg["id"]);
+  writer.key("result").begin_object();
+  write_document_report(writer, *file_diags, previous_result_id);
+  writer.end_object().end_object();
+  return c->send_packet(std::move(writer));
+}
+
+// Reports every file with diagnostics, and clears those the client has others for.
+bool PacketHandler::handle_workspace_diagnostic(const nlohmann::json &json_msg) const {
+  if (!json_msg.contains("id")) {
+    spdlog::error("Invalid workspace/diagnostic request: {}", json_msg.dump(4));
+    return false;
+  }
+
+  std::shared_ptr<LanguageClient> c = language_client_.lock();
+  if (!c)
+    return true;
+
+  std::map<fs::path, std::string> previous_result_ids;
+  if (json_msg.contains("params") && json_msg["params"].contains("previousResultIds")) {
+    for (const auto &previous : json_msg["params"]["previousResultIds"]) {
+      previous_result_ids[utils::uri_to_path(previous.value("uri", ""))] =
+          previous.value("value", "");
+    }
+  }
+
+  static const std::map<fs::path, std::vector<Diagnostic>> NO_FILES;
+  const auto &published =
+      current_project.has_value() ? current_project.value()->prev_files_with_diagnostics : NO_FILES;
+  const auto write_item = [&](JsonWriter &writer, const fs::path &filepath,
+                              const std::vector<Diagnostic> &file_diags) {
+    const auto previous = previous_result_ids.find(filepath);
+    writer.begin_object()
+        .key("uri").value(utils::path_to_uri(filepath))
+        .key("version").null();
+    write_document_report(
+        writer, file_diags, previous == previous_result_ids.end() ? "" : previous->second);
+    writer.end_object();
+  };
+
+  JsonWriter writer(c->acquire_buffer());
+  writer.begin_object().key("jsonrpc").value("2.0").key("id").json(json_msg["id"]);
+  writer.key("result").begin_object().key("items").begin_array();
+  for (const auto &[filepath, file_diags] : published)
+    write_item(writer, filepath, file_diags);
+  for (const auto &[filepath, _] : previous_result_ids) {
+    if (!published.contains(filepath))
+      write_item(writer, filepath, {});
+  }
+  writer.end_array().end_object().end_object();
+  return c->send_packet(std::move(writer));
+}
+
+bool PacketHandler::handle_get_server_metrics(const nlohmann::json &json_msg) const {
+  if (!json_msg.contains("id")) {
+    spdlog::error("Invalid getServerMetrics request: {}", json_msg.dump(4));
+    return false;
+  }
+
+  nlohmann::json response;
+  response["jsonrpc"] = "2.0";
+  response["id"] = json_msg["id"];
+  response["result"] = metrics::to_json();
+
+  auto resp = serialize_json_message(response);
+  if (std::shared_ptr<LanguageClient> c = language_client_.lock())
+    return c->send_packet(std::move(resp));
   return true;
 }
 
@@ -733,7 +1137,7 @@ bool PacketHandler::handle_reload_dotfile(const nlohmann::json &json_msg) {
   }
 
   // Recompile the project
-  return find_and_report_diagnostics();
+  return schedule_diagnostics();
 }
 
 bool PacketHandler::handle_set_project_path(const nlohmann::json &json_msg) {
@@ -744,6 +1148,27 @@ bool PacketHandler::handle_set_project_path(const nlohmann::json &json_msg) {
 
   spdlog::info("Setting project path: {}", json_msg["params"]["path"].get<std::string>());
 
+  // path object represents the path to the project
+  auto p = json_msg["params"]["path"].get<std::string>();
+  utils::normalize_path(p);
+
+  // A long-lived server keeps its parsed project across editor sessions. Unsaved buffers of the
+  // previous session are dropped and, since the new client has not seen any diagnostics yet,
+  // everything gets published again.
+  if (options_.keep_project_between_sessions && current_project.has_value() &&
+      current_project.value()->path() == fs::path(p)) {
+    spdlog::info("Reusing project from previous session");
+    current_project.value()->clear_file_buffers();
+    current_project.value()->prev_files_with_diagnostics.clear();
+    current_project.value()->published_diagnostics_fingerprints.clear();
+    current_project.value()->license_shared_with_client = false;
+    if (!current_project.value()->load_dotfile()) {
+      spdlog::error("Failed to load dotfile");
+      return false;
+    }
+    return schedule_diagnostics();
+  }
+
   if (!current_project.has_value()) {
     spdlog::info("Creating new project..");
   } else {
@@ -752,10 +1177,6 @@ bool PacketHandler::handle_set_project_path(const nlohmann::json &json_msg) {
     current_project.reset();
   }
 
-  // path object represents the path to the project
-  auto p = json_msg["params"]["path"].get<std::string>();
-  utils::normalize_path(p);
-
   auto maybe_proj = Project::create(p);
   if (maybe_proj.has_value()) {
     current_project = maybe_proj.value();
@@ -766,7 +1187,7 @@ bool PacketHandler::handle_set_project_path(const nlohmann::json &json_msg) {
     }
   }
 
-  return find_and_report_diagnostics();
+  return schedule_diagnostics();
 }
 
 bool PacketHandler::handle_json_message_impl(const nlohmann::json &json_msg) {
@@ -777,15 +1198,7 @@ bool PacketHandler::handle_json_message_impl(const nlohmann::json &json_msg) {
     if (method == "initialize") {
       return handle_initialize(json_msg);
     } else if (method == "initialized") {
-      return find_and_report_diagnostics();
-    } else if (method == "textDocument/completion") {
-      return handle_text_document_completion(json_msg);
-    } else if (method == "textDocument/didChange") {
-      return handle_did_change(json_msg);
-    } else if (method == "textDocument/didOpen") {
-      return handle_did_open(json_msg);
-    } else if (method == "textDocument/definition") {
-      return handle_definition(json_msg);
+      return schedule_diagnostics();
     } else if (method == "includeResource") {
       return handle_include_resource(json_msg);
     } else if (method == "excludeResource") {
@@ -793,13 +1206,16 @@ bool PacketHandler::handle_json_message_impl(const nlohmann::json &json_msg) {
     } else if (method == "setMacros") {
       return handle_set_macros(json_msg);
     } else if (method == "recompile") {
-      return find_and_report_diagnostics();
+      if (current_project.has_value())
+        current_project.value()->invalidate_sources();
+      return schedule_diagnostics();
     } else if (method == "textDocument/didClose") {
       return handle_did_close(json_msg);
     } else if (method == "textDocument/didSave") {
-      return true;
+      return handle_did_save(json_msg);
     } else if (method == "shutdown") {
-      current_project.reset();
+      if (!options_.keep_project_between_sessions)
+        current_project.reset();
       return true;
     } else if (method == "$/setTrace") {
       return true;
@@ -809,6 +1225,12 @@ bool PacketHandler::handle_json_message_impl(const nlohmann::json &json_msg) {
       return handle_reload_dotfile(json_msg);
     } else if (method == "getDiagnosticStringsForLine") {
       return handle_get_diagnostic_strings_for_line(json_msg);
+    } else if (method == "textDocument/diagnostic") {
+      return handle_document_diagnostic(json_msg);
+    } else if (method == "workspace/diagnostic") {
+      return handle_workspace_diagnostic(json_msg);
+    } else if (method == "getServerMetrics") {
+      return handle_get_server_metrics(json_msg);
     } else if (method == "setLicenseKey") {
       return handle_set_license_key(json_msg);
     } else if (method == "compiler/addRootUnit") {
@@ -820,19 +1242,52 @@ bool PacketHandler::handle_json_message_impl(const nlohmann::json &json_msg) {
       return true;
     }
   }
-  return false;
+  // A response to one of our requests, e.g. workspace/diagnostic/refresh.
+  return json_msg.contains("id");
 }
 
-PacketHandler::PacketHandler(const std::weak_ptr<LanguageClient> &language_client)
-    : language_client_(language_client) {
+PacketHandler::PacketHandler(
+    const std::weak_ptr<LanguageClient> &language_client, const ServerOptions &options)
+    : language_client_(language_client), options_(options) {
   // check if socket client is valid
   if (language_client.expired()) {
     spdlog::error("Language client in init is expired");
   }
+
+  diagnostics_worker_ = std::thread([this] {
+    run_diagnostics_worker();
+  });
+}
+
+PacketHandler::~PacketHandler() {
+  stop();
+}
+
+// The hot methods arrive already picked apart by the streaming parser (see lspmessage.hpp) and are
+// dispatched here; everything else goes through the JSON handlers.
+bool PacketHandler::handle_message_impl(IncomingMessage &&message) {
+  if (!message.streamed()) {
+    return handle_json_message_impl(message.json);
+  }
+
+  spdlog::info("Received JSON message: {}", message.method);
+  if (message.method == "textDocument/completion") {
+    return handle_text_document_completion(message);
+  } else if (message.method == "textDocument/didChange") {
+    return handle_did_change(std::move(message));
+  } else if (message.method == "textDocument/didOpen") {
+    return handle_did_open(std::move(message));
+  } else if (message.method == "textDocument/definition") {
+    return handle_definition(message);
+  }
+
+  spdlog::error("Unhandled streamed method: {}", message.method);
+  return true;
 }
 
-bool PacketHandler::handle_json_message(const nlohmann::json &json_msg) {
-  bool res = handle_json_message_impl(json_msg);
+bool PacketHandler::handle_message(IncomingMessage &&message) {
+  std::lock_guard lock(project_mutex);
+  bool res = handle_message_impl(std::move(message));
   // If license is valid and it has not been shared with frontend, send it.
   if (current_project.has_value() && license::is_valid() &&
       !current_project.value()->license_shared_with_client) {
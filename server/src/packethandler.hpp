@@ -1,6 +1,11 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
+#include <mutex>
+#include <set>
+#include <thread>
 
 #include "nlohmann/json.hpp"
 #include "project.hpp"
@@ -12,6 +17,8 @@ namespace metalware {
 
   enum InsertTextFormat { PlainText = 1, Snippet = 2 };
 
+  static constexpr int REQUEST_CANCELLED = -32800;  // LSP ErrorCodes.RequestCancelled
+
   namespace fs = std::filesystem;
 
   struct Diagnostic;
@@ -31,6 +38,12 @@ namespace metalware {
           {"newText", newText}
       };
     }
+
+    void write_json(JsonWriter &writer) const {
+      writer.begin_object().key("range");
+      range.write_json(writer);
+      writer.key("newText").value(newText).end_object();
+    }
   };
 
   struct CompletionItem {
@@ -52,6 +65,21 @@ namespace metalware {
           }}
       };
     }
+
+    void write_json(JsonWriter &writer) const {
+      writer.begin_object()
+          .key("label").value(label)
+          .key("kind").value(kind)
+          .key("insertTextFormat").value(static_cast<int>(insertTextFormat))
+          .key("textEdit");
+      textEdit.write_json(writer);
+      writer.key("labelDetails")
+          .begin_object()
+          .key("detail").value(details.detail)
+          .key("description").value(details.description)
+          .end_object()
+          .end_object();
+    }
   };
 
   struct CompletionList {
@@ -60,26 +88,32 @@ namespace metalware {
 
   class PacketHandler {
     public:
-      explicit PacketHandler(const std::weak_ptr<LanguageClient>& language_client);
+      PacketHandler(const std::weak_ptr<LanguageClient>& language_client,
+          const ServerOptions& options);
+      ~PacketHandler();
       // HANDLERS
-      [[nodiscard]] bool handle_json_message(const nlohmann::json &json_msg);
+      [[nodiscard]] bool handle_message(IncomingMessage &&message);
+      // Stops the diagnostics worker, abandoning a pass that is in progress.
+      void stop();
     private:
-      [[nodiscard]] static CompletionList get_completions(
-        std::string_view prefix, const fs::path &filepath, size_t line, size_t col);
+      [[nodiscard]] static CompletionList get_completions(std::string_view prefix,
+        const fs::path &filepath, size_t line, size_t col, const CancellationToken &cancellation);
 
       static bool is_utf8(std::string_view str);
       static std::string serialize_json_message(const nlohmann::json &json_msg);
 
+      [[nodiscard]] bool handle_message_impl(IncomingMessage &&message);
       [[nodiscard]] bool handle_json_message_impl(const nlohmann::json &json_msg);
       [[nodiscard]] bool handle_include_resource(const nlohmann::json &json_msg) const;
-      [[nodiscard]] bool handle_did_change(const nlohmann::json &json_msg);
+      [[nodiscard]] bool handle_did_change(IncomingMessage &&message);
       [[nodiscard]] bool handle_did_close(const nlohmann::json &json_msg);
+      [[nodiscard]] bool handle_did_save(const nlohmann::json &json_msg);
       [[nodiscard]] bool handle_set_macros(const nlohmann::json &json_msg) const;
-      [[nodiscard]] bool handle_initialize(const nlohmann::json &json_msg) const;
-      [[nodiscard]] bool handle_did_open(const nlohmann::json &json_msg);
-      [[nodiscard]] bool handle_definition(const nlohmann::json &json_msg) const;
+      [[nodiscard]] bool handle_initialize(const nlohmann::json &json_msg);
+      [[nodiscard]] bool handle_did_open(IncomingMessage &&message);
+      [[nodiscard]] bool handle_definition(const IncomingMessage &message) const;
       [[nodiscard]] bool handle_exclude_resource(const nlohmann::json &json_msg) const;
-      [[nodiscard]] bool handle_text_document_completion(const nlohmann::json &json_msg) const;
+      [[nodiscard]] bool handle_text_document_completion(const IncomingMessage &message) const;
       [[nodiscard]] bool handle_set_project_path(const nlohmann::json &json_msg);
       [[nodiscard]] bool handle_reload_dotfile(const nlohmann::json &json_msg);
 
@@ -88,18 +122,55 @@ namespace metalware {
 
       [[nodiscard]] bool handle_set_license_key(const nlohmann::json &json_msg);
       [[nodiscard]] bool handle_get_diagnostic_strings_for_line(const nlohmann::json &json_msg) const;
+      [[nodiscard]] bool handle_get_server_metrics(const nlohmann::json &json_msg) const;
+      [[nodiscard]] bool handle_document_diagnostic(const nlohmann::json &json_msg) const;
+      [[nodiscard]] bool handle_workspace_diagnostic(const nlohmann::json &json_msg) const;
 
       [[nodiscard]] bool send_license_missing() const;
       [[nodiscard]] bool send_license_invalid() const;
       [[nodiscard]] bool send_license_valid() const;
       [[nodiscard]] bool send_cache_license() const;
       [[nodiscard]] bool send_warning(std::string_view msg) const;
+      [[nodiscard]] bool send_request_cancelled(const nlohmann::json &id) const;
       [[nodiscard]] bool send_project_structure_changed() const;
 
-      [[nodiscard]] bool send_diagnostics(const std::vector<Diagnostic> &all_diagnostics) const;
-
-      [[nodiscard]] bool find_and_report_diagnostics();
+      [[nodiscard]] bool send_diagnostics(
+          Project &project, const std::vector<Diagnostic> &all_diagnostics) const;
+      [[nodiscard]] static bool send_file_diagnostics(LanguageClient &client,
+          const fs::path &filepath, const std::vector<Diagnostic> &file_diags);
+      // Asks a client that pulls diagnostics to pull them again.
+      [[nodiscard]] bool send_diagnostic_refresh(LanguageClient &client) const;
+      [[nodiscard]] bool report_parse_diagnostics(const std::shared_ptr<Project> &project,
+          const CompileInputs &inputs, const fs::path &edited_file,
+          const CancellationToken &cancellation);
+
+      // Diagnostics are background work: handlers only schedule a pass, which runs on the
+      // diagnostics worker while completions and definitions are served from the last completed
+      // compilation.
+      // `edited_file` is the buffer that changed, whose syntax errors are reported first, along
+      // with those of the other buffers edited since the last pass.
+      [[nodiscard]] bool schedule_diagnostics(
+          const std::optional<fs::path> &edited_file = std::nullopt);
+      void run_diagnostics_worker();
+      [[nodiscard]] bool find_and_report_diagnostics(const std::set<fs::path> &edited_files);
 
       std::weak_ptr<LanguageClient> language_client_;
+      ServerOptions options_;
+      // Whether the client pulls diagnostics rather than having them pushed, as negotiated on
+      // initialize. Guarded by project_mutex.
+      bool pull_diagnostics_ = false;
+      mutable int64_t next_request_id_ = 0;  // of our requests to the client, ditto
+
+      static constexpr int MAX_CANCELLED_PASSES_IN_A_ROW = 3;
+      // Until a pass skipped for want of snapshots (see Project::reserve_snapshot) runs again.
+      static constexpr std::chrono::milliseconds SKIPPED_PASS_RETRY_DELAY{250};
+      std::mutex schedule_mutex_;
+      std::condition_variable schedule_cv_;
+      bool diagnostics_requested_ = false;
+      std::set<fs::path> edited_files_;  // since the last pass, guarded by schedule_mutex_
+      bool retry_skipped_pass_ = false;  // ditto
+      bool stopping_ = false;
+      int cancelled_passes_in_a_row_ = 0;  // worker only
+      std::thread diagnostics_worker_;
   };
 }
@@ -1,8 +1,10 @@
 #include "project.hpp"
 
+#include <array>
 #include <fstream>
 
 #include "lookupvisitor.hpp"
+#include "metrics.hpp"
 #include "packethandler.hpp"
 #include "slang/ast/ASTVisitor.h"
 #include "slang/ast/Compilation.h"
@@ -45,7 +47,7 @@ void add_include_dirs(const std::set<fs::path> &files, std::vector<fs::path> &in
   }
 }
 
-bool has_include_statement(const std::string &text) {
+bool has_include_statement(std::string_view text) {
   size_t n = text.find("`include", 0);
   if (n != std::string::npos) {
     n = text.find("\"", n + 8);
@@ -62,78 +64,217 @@ bool has_include_statement(const std::string &text) {
   return false;
 }
 
-}  // namespace
+using utils::hash_combine;
+using utils::hash_text;
 
-int Project::get_fp_rank(const fs::path &p) {
-  // Check if in fp_ranks unoredred_map
-  if (fp_ranks.find(p) != fp_ranks.end()) {
-    return fp_ranks[p];
+// The same defines in a canonical order: only the last definition of a name counts.
+std::string normalize_defines(const std::vector<std::string> &defines) {
+  std::map<std::string_view, std::string_view> by_name;
+  for (std::string_view define : defines)
+    by_name[define.substr(0, define.find('='))] = define;
+
+  std::string configuration;
+  for (const auto &[name, define] : by_name) {
+    configuration += define;
+    configuration += '\n';
   }
+  return configuration;
+}
 
-  return 9999;
+size_t fingerprint_structure(const CompileInputs &inputs) {
+  size_t seed = inputs.syntax_trees ? inputs.syntax_trees->invalidations() : 0;
+  for (const auto &dir : inputs.include_dirs)
+    seed = hash_combine(seed, hash_text(dir.string()));
+  seed = hash_combine(seed, inputs.target_files.size());
+  for (const auto &file : inputs.target_files)
+    seed = hash_combine(seed, hash_text(file));
+  for (const auto &library : inputs.libraries)
+    seed = hash_combine(seed, library.generation);
+  if (inputs.filter.suppressions)
+    seed = hash_combine(seed, inputs.filter.suppressions->fingerprint());
+  seed = hash_combine(seed, inputs.filter.excluded_paths.size());
+  for (const auto &path : inputs.filter.excluded_paths)
+    seed = hash_combine(seed, hash_text(path.string()));
+  for (const auto &[path, principal] : inputs.filter.root_units)
+    seed = hash_combine(hash_combine(seed, hash_text(path.string())), principal);
+  return seed;
 }
 
-void Project::set_fp_rank(const fs::path &path, int rank) {
-  fp_ranks[path] = rank;
+size_t fingerprint_inputs(const CompileInputs &inputs) {
+  size_t seed = inputs.structure;
+  for (const auto &[path, hash] : inputs.buffer_hashes)
+    seed = hash_combine(hash_combine(seed, hash_text(path.string())), hash);
+  return seed;
 }
 
-bool Project::add_target_files_to_compilation(const std::vector<fs::path> &target_file_paths,
-    const std::shared_ptr<slang::ast::Compilation> &compilation) {
-  non_inlined_fp_string_cache.clear();
-  for (const auto &p : target_file_paths)
-    non_inlined_fp_string_cache.push_back(p.string());
+size_t count_library_files(const std::vector<LibraryInputs> &libraries) {
+  size_t files = 0;
+  for (const auto &library : libraries)
+    files += library.file_count;
+  return files;
+}
 
-  // Definition: A target file is non-inlined source file passed to the compiler.
-  // Create a vector of string_views from the vector of strings
-  std::vector<std::string_view> file_paths_views;
-  file_paths_views.reserve(target_file_paths.size());  // Reserve to avoid reallocations
+// The text of `path`: its editor buffer if it has one, else the file on disk.
+std::optional<std::string> read_source(
+    const fs::path &path, const std::unordered_map<std::string, std::string_view> &buffers) {
+  if (const auto itr = buffers.find(path.string()); itr != buffers.end())
+    return std::string(itr->second);
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return std::nullopt;
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
 
-  for (const auto &path_str : non_inlined_fp_string_cache) {
-    file_paths_views.emplace_back(path_str);
+// Adds every name `header` can be included by, from its file name to its full path, as the scan
+// does for source files.
+void add_include_names(const fs::path &header, std::map<std::string, std::set<fs::path>> &names) {
+  fs::path p = header;
+  std::string suffix;
+  while (!p.empty()) {
+    names[p.filename().string() + suffix].insert(header);
+    suffix = "/" + p.filename().string() + suffix;
+    if (p == p.parent_path())
+      break;
+    p = p.parent_path();
   }
+}
 
-  if (file_paths_views.empty()) {
-    spdlog::error("No target files found for compilation");
-    return false;
+// The texts `text` includes, directly or through other headers, found among `headers` by path and
+// `header_names` by the names they can be included by.
+std::vector<std::string_view> find_included_texts(std::string_view text,
+    const std::unordered_map<std::string, std::string_view> &headers,
+    const std::map<std::string, std::set<fs::path>> &header_names) {
+  std::vector<std::string_view> included;
+  std::unordered_set<std::string> visited;
+  std::vector<std::string_view> pending = {text};
+  while (!pending.empty()) {
+    const auto next = pending.back();
+    pending.pop_back();
+    for (const auto &name : find_include_names(next)) {
+      const auto itr = header_names.find(name);
+      if (itr == header_names.end())
+        continue;
+      for (const auto &path : itr->second) {
+        if (!visited.insert(path.string()).second)
+          continue;
+        const auto header = headers.find(path.string());
+        if (header == headers.end())
+          continue;
+        included.push_back(header->second);
+        pending.push_back(header->second);
+      }
+    }
   }
+  return included;
+}
 
-  slang::Bag bag;
+// The stages of collect_diagnostics, in the order diagnostics go through them. Only the first three
+// drop any: a diagnostic that is not suppressed gets published.
+enum class DiagnosticStage { Resolve, Exclude, Suppress, Severity, Format };
+constexpr auto LAST_DROPPING_STAGE = DiagnosticStage::Suppress;
+constexpr std::array<std::string_view, 5> DIAGNOSTIC_STAGE_NAMES = {
+    "resolve", "exclude", "suppress", "severity", "format"};
 
-  // Add predefines
-  slang::parsing::PreprocessorOptions preproc_options;
-  preproc_options.predefines.insert(
-      preproc_options.predefines.end(), this->defines.begin(), this->defines.end());
+// How many diagnostics each stage let through or dropped, and the time spent in it, over a pass.
+class DiagnosticPipeline {
+ public:
+  // Starts the first stage of the next diagnostic.
+  void begin() {
+    stage_start_ = Clock::now();
+  }
 
-  bag.set(preproc_options);
-  // Create a span from the vector of string_views
-  std::span<std::string_view> paths_span(file_paths_views);
+  // Ends `stage`, and starts the next.
+  void pass(DiagnosticStage stage) {
+    passed_[end(stage)]++;
+  }
 
-  // Create a single tree (compilation unit) for all top files
-  if (const auto tree =
-          ss::SyntaxTree::fromFiles(paths_span, *source_manager, bag, source_library.get());
-      tree.has_value()) {
-    compilation->addSyntaxTree(tree.value());
-  } else {
-    spdlog::error("Failed to add syntax tree for target files");
-    return false;
+  void drop(DiagnosticStage stage) {
+    dropped_[end(stage)]++;
   }
-  return true;
+
+  // E.g. "resolve 1200-0 1ms, exclude 1200-900 0ms, ...": passed-dropped and time of each stage.
+  [[nodiscard]] std::string summary() const {
+    std::string text;
+    for (size_t i = 0; i < STAGES; i++) {
+      text += fmt::format("{}{} {}-{} {}ms",
+          i == 0 ? "" : ", ",
+          DIAGNOSTIC_STAGE_NAMES[i],
+          passed_[i],
+          dropped_[i],
+          std::chrono::duration_cast<std::chrono::milliseconds>(time_[i]).count());
+    }
+    return text;
+  }
+
+  void record() const {
+    for (size_t i = 0; i < STAGES; i++) {
+      const auto name = DIAGNOSTIC_STAGE_NAMES[i];
+      metrics::counter(fmt::format("diagnostics_passed_{}", name))
+          .add(static_cast<int64_t>(passed_[i]));
+      if (i <= static_cast<size_t>(LAST_DROPPING_STAGE)) {
+        metrics::counter(fmt::format("diagnostics_dropped_{}", name))
+            .add(static_cast<int64_t>(dropped_[i]));
+      }
+      metrics::counter(fmt::format("diagnostics_{}_us", name))
+          .add(std::chrono::duration_cast<std::chrono::microseconds>(time_[i]).count());
+    }
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  static constexpr size_t STAGES = DIAGNOSTIC_STAGE_NAMES.size();
+
+  size_t end(DiagnosticStage stage) {
+    const auto now = Clock::now();
+    const auto i = static_cast<size_t>(stage);
+    time_[i] += now - stage_start_;
+    stage_start_ = now;
+    return i;
+  }
+
+  Clock::time_point stage_start_;
+  std::array<size_t, STAGES> passed_ = {};
+  std::array<size_t, STAGES> dropped_ = {};
+  std::array<Clock::duration, STAGES> time_ = {};
+};
+
+void report_live_snapshots(size_t alive) {
+  metrics::gauge("snapshots_alive").set(static_cast<int64_t>(alive));
+  metrics::gauge("snapshots_alive_high_watermark").update_max(static_cast<int64_t>(alive));
 }
+}  // namespace
 
-// Note: Calling this function assumes scan_files has been called.
-// Note: the compilation will cache!
-nonstd::expected<std::shared_ptr<slang::ast::Compilation>, std::string> Project::compile() {
-  if (cached_compilation.has_value()) {
-    spdlog::info("Compilation: using cached compilation!");
-    return cached_compilation.value();
+CompilationSnapshot::CompilationSnapshot(std::shared_ptr<SnapshotAccount> account)
+    : account(std::move(account)) {
+  report_live_snapshots(++this->account->alive);
+}
+
+CompilationSnapshot::~CompilationSnapshot() {
+  report_live_snapshots(--account->alive);
+}
+
+int Project::get_fp_rank(const fs::path &p) {
+  // Check if in fp_ranks unoredred_map
+  if (fp_ranks.find(p) != fp_ranks.end()) {
+    return fp_ranks[p];
   }
 
-  source_manager = std::make_shared<slang::SourceManager>();
-  source_library = std::make_shared<slang::SourceLibrary>();
-  source_library->isDefault = true;
+  return 9999;
+}
 
-  slang::Bag bag;
-  auto compilation = std::make_shared<slang::ast::Compilation>(bag, source_library.get());
+void Project::set_fp_rank(const fs::path &path, int rank) {
+  fp_ranks[path] = rank;
+}
+
+// Note: Calling this function assumes scan_files has been called.
+CompileInputs Project::capture_compile_inputs() {
+  if (partial_compilation)
+    update_dependency_closure();
+
+  CompileInputs inputs;
+  inputs.defines = defines;
+  inputs.syntax_trees = syntax_tree_cache;
+  inputs.snapshots = snapshot_account;
 
   // Sort root units so that principal root unit is last
   std::vector<std::pair<fs::path, std::shared_ptr<RootUnit>>> sorted_root_units;
@@ -151,56 +292,523 @@ nonstd::expected<std::shared_ptr<slang::ast::Compilation>, std::string> Project:
   // Handle each root unit
   for (const auto &[root_unit_path, root_unit] : sorted_root_units) {
     spdlog::info("Handling root unit: {}", root_unit_path.string());
-    add_include_dirs(root_unit->header_files(), source_library->includeDirs);
+    add_include_dirs(root_unit->header_files(), inputs.include_dirs);
 
-    // Cache open files to source manager.
-    for (const auto &[fp, buff] : root_unit->file_buffers()) {
-      if (source_manager->isCached(fp.string())) {
-        spdlog::warn("Compilation: file already in source manager cache: {}", fp.string());
+    for (const auto &[fp, buff] : root_unit->file_buffers())
+      inputs.buffers.emplace_back(fp, buff);
+
+    target_file_paths = root_unit->non_inlined_files();
+    if (partial_compilation) {
+      const auto needed = [this](const fs::path &p) {
+        return dependency_closure->contains(p);
+      };
+      // Libraries are compiled whole or not at all, so that their snapshots stay valid.
+      if (root_unit->principal()) {
+        std::erase_if(target_file_paths, [&needed](const fs::path &p) {
+          return !needed(p);
+        });
+      } else if (std::none_of(target_file_paths.begin(), target_file_paths.end(), needed)) {
         continue;
       }
+    }
+
+    // Sort in reverse target_file_paths by their ranks in get_fp_rank(path). Ranks only order
+    // files within a root unit, so that each library stays in one piece.
+    std::stable_sort(target_file_paths.begin(),
+        target_file_paths.end(),
+        [this](const auto &lhs, const auto &rhs) {
+          return get_fp_rank(lhs) > get_fp_rank(rhs);
+        });
+
+    if (!root_unit->principal())
+      inputs.libraries.push_back(
+          {root_unit_path, root_unit->generation(), target_file_paths.size()});
+
+    for (const auto &p : target_file_paths)
+      inputs.target_files.push_back(p.string());
+  }
+
+  inputs.filter.suppressions = suppression_index;
+  inputs.filter.excluded_paths = excluded_paths;
+  for (const auto &[root_unit_path, root_unit] : root_units)
+    inputs.filter.root_units.emplace_back(root_unit_path, root_unit->principal());
+
+  inputs.configuration = normalize_defines(inputs.defines);
+  for (const auto &[path, text] : inputs.buffers)
+    inputs.buffer_hashes[path] = hash_text(text);
+  inputs.structure = fingerprint_structure(inputs);
+  inputs.fingerprint = fingerprint_inputs(inputs);
+
+  if (incremental_diagnostics) {
+    if (const auto published = current_snapshot())
+      inputs.recheck_base = published->base ? published->base : published;
+    inputs.declared_name_to_paths = declared_name_to_paths;
+    inputs.include_name_to_paths = include_name_to_paths;
+  }
+  return inputs;
+}
 
-      spdlog::debug("Caching buffered file to source manager: {}", fp.string());
-      const auto _ = source_manager->assignText(
-          fp.string(), buff, slang::SourceLocation(), source_library.get());
+void Project::plan_recheck(CompileInputs &inputs) {
+  const SnapshotPtr base = std::move(inputs.recheck_base);
+  if (!base || !base->references || base->configuration != inputs.configuration ||
+      base->structure != inputs.structure) {
+    return;
+  }
+
+  // The files edited since, including those whose buffer was closed and that are back to the text
+  // on disk.
+  std::set<fs::path> edited;
+  for (const auto &[path, hash] : inputs.buffer_hashes) {
+    const auto itr = base->buffer_hashes.find(path);
+    if (itr == base->buffer_hashes.end() || itr->second != hash)
+      edited.insert(path);
+  }
+  for (const auto &[path, _] : base->buffer_hashes) {
+    if (!inputs.buffer_hashes.contains(path))
+      edited.insert(path);
+  }
+  if (edited.empty())
+    return;
+
+  // Only edits to principal target files can be followed: headers and libraries reach into files
+  // in ways the references do not tell.
+  const auto principal_begin =
+      inputs.target_files.begin() + static_cast<ptrdiff_t>(count_library_files(inputs.libraries));
+  const std::unordered_set<std::string> principal(principal_begin, inputs.target_files.end());
+  for (const auto &path : edited) {
+    if (!principal.contains(path.string()) || !base->references->contains(path))
+      return;
+  }
+
+  std::unordered_map<std::string, std::string_view> buffers;
+  for (const auto &[path, text] : inputs.buffers)
+    buffers.emplace(path.string(), text);
+  const auto read = [&buffers](const fs::path &path) {
+    return read_source(path, buffers);
+  };
+
+  // The edited files, those referring to what they declared or bound into before or do now, and
+  // from there up the instantiators to the top modules: a module only elaborates as part of them,
+  // and hierarchical references start from them.
+  std::unordered_set<std::string> changed_names;
+  std::unordered_set<std::string> reached;
+  for (const auto &path : edited) {
+    const auto &before = base->references->declared_names(path);
+    changed_names.insert(before.begin(), before.end());
+    const auto &bound = base->references->bind_targets(path);
+    reached.insert(bound.begin(), bound.end());
+    bool indexed = !before.empty() || !bound.empty();
+    if (const auto text = read(path); text.has_value()) {
+      for (auto &name : find_declarations(text.value())) {
+        changed_names.insert(std::move(name));
+        indexed = true;
+      }
+      for (auto &name : find_bind_targets(text.value())) {
+        reached.insert(std::move(name));
+        indexed = true;
+      }
     }
+    // A file that neither declares nor binds anything, e.g. one of macros, reaches the files after
+    // it in ways the references do not tell.
+    if (!indexed) {
+      spdlog::info("Checking all files, the index has nothing for {}", path.string());
+      return;
+    }
+  }
+  reached.insert(changed_names.begin(), changed_names.end());
+  auto rechecked = base->references->referrers(reached);
+  rechecked.insert(edited.begin(), edited.end());
+
+  std::vector<fs::path> pending(rechecked.begin(), rechecked.end());
+  while (!pending.empty()) {
+    const fs::path path = std::move(pending.back());
+    pending.pop_back();
+    std::unordered_set<std::string> names;
+    for (const auto *list :
+        {&base->references->declared_names(path), &base->references->bind_targets(path)}) {
+      for (const auto &name : *list) {
+        if (reached.insert(name).second)
+          names.insert(name);
+      }
+    }
+    for (const auto &referrer : base->references->referrers(names)) {
+      if (rechecked.insert(referrer).second)
+        pending.push_back(referrer);
+    }
+  }
 
-    for (const auto &fp : root_unit->non_inlined_files())
-      target_file_paths.push_back(fp);
+  DependencyClosure closure;
+  for (const auto &path : rechecked) {
+    if (const auto text = read(path); text.has_value()) {
+      closure.add(
+          path, text.value(), *inputs.declared_name_to_paths, *inputs.include_name_to_paths, read);
+    }
   }
 
-  // Sort in reverse target_file_paths by their ranks in get_fp_rank(path)
-  std::sort(
-      target_file_paths.begin(), target_file_paths.end(), [this](const auto &lhs, const auto &rhs) {
-        return get_fp_rank(lhs) > get_fp_rank(rhs);
-      });
+  const auto needed = [&closure](const std::string &p) {
+    return closure.contains(p);
+  };
+  const auto compiled =
+      static_cast<size_t>(std::count_if(principal_begin, inputs.target_files.end(), needed));
+  // A file the base did not index, e.g. one that failed to parse then, has no references to follow.
+  const auto indexed = [&](const std::string &p) {
+    return !needed(p) || base->references->contains(p);
+  };
+  const auto unindexed = std::find_if_not(principal_begin, inputs.target_files.end(), indexed);
+  if (unindexed != inputs.target_files.end()) {
+    spdlog::info("Checking all files, {} is not indexed", *unindexed);
+    return;
+  }
+  // Past half of the files, a full pass costs little more and gives the next edits a fresh base.
+  if (compiled * 2 > principal.size()) {
+    spdlog::info("Checking all files, an edit reaches {} of {}", compiled, principal.size());
+    return;
+  }
+
+  // Libraries are compiled whole or not at all, as in a partial compilation.
+  std::vector<std::string> target_files;
+  std::vector<LibraryInputs> libraries;
+  auto first = inputs.target_files.begin();
+  for (const auto &library : inputs.libraries) {
+    const auto last = first + static_cast<ptrdiff_t>(library.file_count);
+    if (std::any_of(first, last, needed)) {
+      target_files.insert(target_files.end(), first, last);
+      libraries.push_back(library);
+    }
+    first = last;
+  }
+  std::copy_if(
+      principal_begin, inputs.target_files.end(), std::back_inserter(target_files), needed);
+
+  spdlog::info("Rechecking {} of {} files ({} edited), compiling {}",
+      rechecked.size(),
+      principal.size(),
+      edited.size(),
+      compiled);
+  inputs.target_files = std::move(target_files);
+  inputs.libraries = std::move(libraries);
+  inputs.base = base;
+  inputs.rechecked = std::move(rechecked);
+  inputs.changed_names = std::move(changed_names);
+}
+
+// Only reads `inputs`, so it may run on any thread while the project keeps changing.
+nonstd::expected<CompileResult, std::string> Project::build(
+    CompileInputs inputs, const CancellationToken &cancellation) {
+  const auto cache =
+      inputs.syntax_trees ? inputs.syntax_trees : std::make_shared<SyntaxTreeCache>();
+  auto parsed = cache->parse(inputs.buffers,
+      inputs.include_dirs,
+      inputs.target_files,
+      inputs.libraries,
+      inputs.defines,
+      cancellation,
+      /* subset */ inputs.base != nullptr);
+  if (!parsed.has_value()) {
+    return nonstd::make_unexpected(parsed.error());
+  }
+
+  if (cancellation.is_cancelled()) {
+    return nonstd::make_unexpected("Compilation cancelled");
+  }
+
+  CompileResult result;
+  result.source_manager = std::move(parsed.value().source_manager);
+  result.source_library = std::move(parsed.value().source_library);
+
+  slang::Bag bag;
+  result.compilation =
+      std::make_shared<slang::ast::Compilation>(bag, result.source_library.get());
+  for (const auto &tree : parsed.value().trees)
+    result.compilation->addSyntaxTree(tree);
+
+  result.target_files = std::move(inputs.target_files);
+  result.texts = std::move(parsed.value().texts);
+  return result;
+}
+
+// Compiles, elaborates and indexes `inputs` into a snapshot. Like build, it only reads its inputs.
+nonstd::expected<SnapshotPtr, std::string> Project::build_snapshot(
+    CompileInputs inputs, const CancellationToken &cancellation) {
+  plan_recheck(inputs);
+  const DiagnosticFilter filter = std::move(inputs.filter);
+  const auto rechecked = std::move(inputs.rechecked);
+  const auto changed_names = std::move(inputs.changed_names);
+  const size_t library_files = count_library_files(inputs.libraries);
+  const auto heap_before = utils::heap_bytes();
+  auto snapshot = std::make_shared<CompilationSnapshot>(
+      inputs.snapshots ? std::move(inputs.snapshots) : std::make_shared<SnapshotAccount>());
+  snapshot->configuration = std::move(inputs.configuration);
+  snapshot->structure = inputs.structure;
+  snapshot->fingerprint = inputs.fingerprint;
+  snapshot->buffer_hashes = std::move(inputs.buffer_hashes);
+  snapshot->base = std::move(inputs.base);
+  const auto &base = snapshot->base;
+
+  auto result = build(std::move(inputs), cancellation);
+  if (!result.has_value()) {
+    return nonstd::make_unexpected(result.error());
+  }
+
+  snapshot->compile = std::move(result.value());
+  const auto &compilation = snapshot->compile.compilation;
+
+  // Elaborates the design.
+  auto diagnostics = collect_diagnostics(compilation, filter, cancellation);
+  if (!diagnostics.has_value()) {
+    return nonstd::make_unexpected("Compilation cancelled");
+  }
+  if (base) {
+    // The other files compiled are only there for the rechecked ones to elaborate.
+    size_t reused = 0;
+    for (const auto &diag : base->diagnostics) {
+      if (!rechecked.contains(diag.filepath)) {
+        snapshot->diagnostics.push_back(diag);
+        reused++;
+      }
+    }
+    for (auto &diag : diagnostics.value()) {
+      if (rechecked.contains(diag.filepath))
+        snapshot->diagnostics.push_back(std::move(diag));
+    }
+    metrics::counter("diagnostics_files_rechecked").add(static_cast<int64_t>(rechecked.size()));
+    metrics::counter("diagnostics_reused").add(static_cast<int64_t>(reused));
+  } else {
+    snapshot->diagnostics = std::move(diagnostics.value());
+  }
+
+  auto modules = collect_modules(*compilation, cancellation);
+  if (!modules.has_value()) {
+    return nonstd::make_unexpected("Compilation cancelled");
+  }
+  snapshot->modules = std::move(modules.value());
+  if (base) {
+    // Those of the files not compiled, unless an edit removed or redeclared them.
+    std::unordered_set<std::string_view> compiled;
+    for (const auto &module : snapshot->modules)
+      compiled.insert(module.name);
+    for (const auto &module : base->modules) {
+      if (!compiled.contains(module.name) && !changed_names.contains(module.name))
+        snapshot->modules.push_back(module);
+    }
+  }
+
+  auto lookup_index = std::make_shared<LookupCacheVisitor>(compilation);
+  for (const auto &tree : compilation->getSyntaxTrees()) {
+    if (cancellation.is_cancelled()) {
+      return nonstd::make_unexpected("Compilation cancelled");
+    }
+    tree->root().visit(*lookup_index);
+  }
+  snapshot->lookup_index = std::move(lookup_index);
+
+  if (!base) {
+    // What a file includes counts as part of it, as it does when compiled.
+    std::unordered_map<std::string, std::string_view> headers;
+    std::map<std::string, std::set<fs::path>> header_names;
+    for (const auto &tree : compilation->getSyntaxTrees()) {
+      for (const auto &include : tree->getIncludeDirectives()) {
+        if (!include.buffer)
+          continue;
+        const auto path =
+            SyntaxTreeCache::source_path(*snapshot->compile.source_manager, include.buffer.id);
+        if (headers.emplace(path.string(), include.buffer.data).second)
+          add_include_names(path, header_names);
+      }
+    }
 
-  if (!add_target_files_to_compilation(target_file_paths, compilation)) {
-    return nonstd::make_unexpected("Failed to add target files to compilation");
+    auto references = std::make_shared<ReferenceIndex>();
+    const auto &files = snapshot->compile.target_files;
+    const auto &texts = snapshot->compile.texts;
+    for (size_t i = library_files; i < files.size(); i++) {
+      if (cancellation.is_cancelled()) {
+        return nonstd::make_unexpected("Compilation cancelled");
+      }
+      references->add(files[i], texts[i], find_included_texts(texts[i], headers, header_names));
+    }
+    snapshot->references = std::move(references);
   }
 
-  cached_compilation = compilation;
-  return compilation;
+  if (const auto heap_after = utils::heap_bytes(); heap_before && heap_after) {
+    snapshot->heap_growth = heap_after.value() > heap_before.value()
+                                ? heap_after.value() - heap_before.value()
+                                : 0;
+  }
+  metrics::gauge("snapshot_heap_growth_last").set(static_cast<int64_t>(snapshot->heap_growth));
+  spdlog::info("The heap grew by {} MiB while compiling", snapshot->heap_growth >> 20);
+
+  metrics::meter("compilations").mark();
+  return SnapshotPtr(std::move(snapshot));
+}
+
+std::vector<SnapshotPtr> Project::publish(SnapshotPtr snapshot) {
+  std::vector<SnapshotPtr> superseded;
+  std::lock_guard lock(snapshot_mutex);
+
+  // Snapshots of older inputs can never be found again.
+  for (auto itr = recent_snapshots.begin(); itr != recent_snapshots.end();) {
+    if ((*itr)->fingerprint != snapshot->fingerprint ||
+        (*itr)->configuration == snapshot->configuration) {
+      superseded.push_back(std::move(*itr));
+      itr = recent_snapshots.erase(itr);
+    } else {
+      ++itr;
+    }
+  }
+  recent_snapshots.push_front(snapshot);
+  if (recent_snapshots.size() > MAX_CACHED_CONFIGURATIONS) {
+    superseded.push_back(std::move(recent_snapshots.back()));
+    recent_snapshots.pop_back();
+  }
+
+  // The published snapshot is always among the recent ones, so this never releases it here.
+  published_snapshot = std::move(snapshot);
+  return superseded;
+}
+
+bool Project::reserve_snapshot() {
+  // Evicted outside the lock, as destroying a compilation takes a while.
+  std::vector<SnapshotPtr> evicted;
+  {
+    std::lock_guard lock(snapshot_mutex);
+    // A snapshot that is the base of a kept one stays alive, and an evicted one takes its base
+    // along unless that is kept too.
+    const auto is_base = [this](const SnapshotPtr &snapshot) {
+      return std::any_of(recent_snapshots.begin(), recent_snapshots.end(),
+          [&snapshot](const SnapshotPtr &kept) { return kept->base == snapshot; });
+    };
+    const auto is_kept = [&](const SnapshotPtr &snapshot) {
+      return is_base(snapshot) ||
+             std::find(recent_snapshots.begin(), recent_snapshots.end(), snapshot) !=
+                 recent_snapshots.end();
+    };
+    size_t freed = 0;
+    for (auto itr = recent_snapshots.end();
+         itr != recent_snapshots.begin() && live_snapshots() >= MAX_LIVE_SNAPSHOTS + freed;) {
+      --itr;
+      if (*itr == published_snapshot || is_base(*itr))
+        continue;
+      SnapshotPtr snapshot = std::move(*itr);
+      itr = recent_snapshots.erase(itr);
+      freed += snapshot->base && !is_kept(snapshot->base) ? 2 : 1;
+      evicted.push_back(std::move(snapshot));
+    }
+  }
+  metrics::counter("snapshots_evicted").add(static_cast<int64_t>(evicted.size()));
+  evicted.clear();
+
+  if (live_snapshots() < MAX_LIVE_SNAPSHOTS)
+    return true;
+  spdlog::warn("Requests still read {} snapshots, not building another", live_snapshots());
+  metrics::counter("snapshot_cap_reached").add();
+  return false;
+}
+
+SnapshotPtr Project::find_snapshot(const CompileInputs &inputs) {
+  std::lock_guard lock(snapshot_mutex);
+  for (auto itr = recent_snapshots.begin(); itr != recent_snapshots.end(); ++itr) {
+    if ((*itr)->fingerprint == inputs.fingerprint &&
+        (*itr)->configuration == inputs.configuration) {
+      recent_snapshots.splice(recent_snapshots.begin(), recent_snapshots, itr);
+      metrics::counter("snapshot_cache_hits").add();
+      return recent_snapshots.front();
+    }
+  }
+  metrics::counter("snapshot_cache_misses").add();
+  return nullptr;
+}
+
+SnapshotPtr Project::current_snapshot() const {
+  std::lock_guard lock(snapshot_mutex);
+  return published_snapshot;
+}
+
+SnapshotPtr Project::snapshot(const CancellationToken &cancellation) {
+  if (auto current = current_snapshot()) {
+    return current;
+  }
+
+  auto result = build_snapshot(capture_compile_inputs(), cancellation);
+  if (!result.has_value()) {
+    spdlog::error("Failed to compile project: {}", result.error());
+    return nullptr;
+  }
+
+  publish(result.value());
+  return result.value();
+}
+
+void Project::invalidate_sources() {
+  syntax_tree_cache->invalidate_all();
+}
+
+void Project::invalidate_source(const fs::path &path) {
+  syntax_tree_cache->invalidate(path);
+  scan_cache->invalidate(path);
 }
 
 std::vector<Diagnostic> Project::find_diagnostics() {
+  return find_diagnostics(CancellationToken()).value();
+}
+
+std::optional<std::vector<Diagnostic>> Project::find_diagnostics(
+    const CancellationToken &cancellation) {
   auto last = std::chrono::high_resolution_clock::now();
 
-  cached_compilation = std::nullopt;  // Clear the cached compilation
-  auto maybe_compilation = compile();
+  if (!reserve_snapshot()) {
+    return std::nullopt;
+  }
 
-  if (!maybe_compilation.has_value()) {
-    spdlog::error("Compilation failed: {}", maybe_compilation.error());
-    return {};
+  // Always recompile; the published snapshot keeps serving lookups until this one replaces it.
+  auto result = build_snapshot(capture_compile_inputs(), cancellation);
+
+  if (cancellation.is_cancelled()) {
+    return std::nullopt;
+  }
+
+  if (!result.has_value()) {
+    spdlog::error("Compilation failed: {}", result.error());
+    return std::vector<Diagnostic>{};
   }
 
-  const auto compilation = maybe_compilation.value();
+  publish(result.value());
 
   spdlog::info("Compilation took: {}ms",
       std::chrono::duration_cast<std::chrono::milliseconds>(
           std::chrono::high_resolution_clock::now() - last)
           .count());
-  last = std::chrono::high_resolution_clock::now();
+
+  return result.value()->diagnostics;
+}
+
+std::optional<std::vector<Diagnostic>> Project::find_parse_diagnostics(
+    const CompileInputs &inputs, const fs::path &path, const CancellationToken &cancellation) {
+  const auto buffer = std::find_if(inputs.buffers.begin(), inputs.buffers.end(),
+      [&path](const auto &item) {
+        return item.first == path;
+      });
+  if (!inputs.syntax_trees || buffer == inputs.buffers.end()) {
+    return std::nullopt;
+  }
+
+  const auto tree = inputs.syntax_trees->parse_edited(path, buffer->second);
+  if (!tree) {
+    return std::nullopt;
+  }
+
+  // A compilation of the one tree, which is never elaborated.
+  slang::Bag bag;
+  const auto compilation = std::make_shared<slang::ast::Compilation>(bag);
+  compilation->addSyntaxTree(tree);
+  return collect_diagnostics(compilation, inputs.filter, cancellation, /* parse_only */ true);
+}
+
+std::optional<std::vector<Diagnostic>> Project::collect_diagnostics(
+    const std::shared_ptr<slang::ast::Compilation> &compilation,
+    const DiagnosticFilter &filter,
+    const CancellationToken &cancellation,
+    bool parse_only) {
+  auto last = std::chrono::high_resolution_clock::now();
 
   const auto sm = compilation->getSourceManager();
   slang::DiagnosticEngine diag_engine(*sm);
@@ -210,40 +818,25 @@ std::vector<Diagnostic> Project::find_diagnostics() {
   diag_engine.addClient(client);
 
   std::vector<Diagnostic> lsp_diagnostics;
-  std::set<fs::path> diagnostics_files;
-
-  using DiagCodeLinePath = std::tuple<size_t, size_t, fs::path>;
-  using DiagCodePath = std::tuple<size_t, fs::path>;
 
-  std::map<DiagCodeLinePath, slang::Diagnostic> line_suppressed_diagnostics;
-  std::map<DiagCodePath, slang::Diagnostic> file_suppressed_diagnostics;
+  SuppressionMatcher suppressions(filter.suppressions.get(), *sm);
 
   for (auto &diag : compilation->getLineSuppressedDiagnostics()) {
-    const size_t line = sm->getLineNumber(diag.location);
-    const size_t column = sm->getColumnNumber(diag.location);
-    const auto path = sm->getFullPath(diag.location.buffer());
-
-    line_suppressed_diagnostics[std::make_tuple(line, diag.code.getCode(), path)] = diag;
-
+    suppressions.suppress_line(diag);
     spdlog::debug("Line-wide suppressed diagnostic (code: {}) : {}:{}:{}",
         slang::toString(diag.code),
-        path.string(),
-        line,
-        column);
+        suppressions.path(suppressions.file_id(diag.location.buffer())).string(),
+        sm->getLineNumber(diag.location),
+        sm->getColumnNumber(diag.location));
   }
 
   for (auto &diag : compilation->getFileSuppressedDiagnostics()) {
-    const size_t line = sm->getLineNumber(diag.location);
-    const size_t column = sm->getColumnNumber(diag.location);
-    const auto path = sm->getFullPath(diag.location.buffer());
-
-    file_suppressed_diagnostics[std::make_tuple(diag.code.getCode(), path)] = diag;
-
+    suppressions.suppress_file(diag);
     spdlog::debug("File-wide suppressed diagnostic (code: {}) : {}:{}:{}",
         slang::toString(diag.code),
-        path.string(),
-        line,
-        column);
+        suppressions.path(suppressions.file_id(diag.location.buffer())).string(),
+        sm->getLineNumber(diag.location),
+        sm->getColumnNumber(diag.location));
   }
 
   spdlog::info("Fetching suppressions took: {}ms",
@@ -252,52 +845,81 @@ std::vector<Diagnostic> Project::find_diagnostics() {
           .count());
   last = std::chrono::high_resolution_clock::now();
 
+  // Elaboration happens in getAllDiagnostics, so give up before it if the edit is already stale.
+  if (cancellation.is_cancelled()) {
+    return std::nullopt;
+  }
+
+  // Each diagnostic goes through the stages in order and the cheap ones come first, so that only
+  // the diagnostics that get published are formatted.
+  DiagnosticPipeline pipeline;
+  // The text report is only ever logged, so diagnostics are only issued to it when that shows.
+  const bool report = spdlog::should_log(spdlog::level::debug);
+
+  // Whether each file is excluded, by id.
+  std::unordered_map<SuppressionMatcher::FileId, bool> excluded_files;
+
   size_t empty_path_diagnostics = 0;
-  for (auto &diag : compilation->getAllDiagnostics()) {
-    // Skip if there is a suppresssed diagnostic on the same line that has the same code
+  const auto &diagnostics =
+      parse_only ? compilation->getParseDiagnostics() : compilation->getAllDiagnostics();
+  for (auto &diag : diagnostics) {
+    if (cancellation.is_cancelled()) {
+      return std::nullopt;
+    }
+
+    // Resolve the location.
+    pipeline.begin();
     if (diag.location == slang::SourceLocation::NoLocation) {
       spdlog::warn("No location for diagnostic retrieved from compilation!");
     }
     const size_t line = sm->getLineNumber(diag.location);
-    const auto &filepath = sm->getFullPath(diag.location.buffer());
+    const auto file = suppressions.file_id(diag.location.buffer());
+    const auto &filepath = suppressions.path(file);
 
     if (filepath == "") {
       empty_path_diagnostics++;
+      pipeline.drop(DiagnosticStage::Resolve);
       continue;
     }
-
-    if (is_resource_excluded(filepath)) {
+    if (SyntaxTreeCache::inherited_copy(filepath)) {
+      pipeline.drop(DiagnosticStage::Resolve);
       continue;
     }
+    pipeline.pass(DiagnosticStage::Resolve);
 
-    diag_engine.issue(diag);
-
-    Diagnostic lsp_diag;
-    lsp_diag.message = diag_engine.formatMessage(diag);
-    lsp_diag.name = slang::toString(diag.code);
-
-    spdlog::debug("Diagnostic is {} fp: {}", lsp_diag.message, filepath.string());
-
+    // Drop those of excluded paths and, as their lint is not ours to report, of the non-principal
+    // root units.
+    const auto [excluded, first_of_file] = excluded_files.try_emplace(file, false);
+    if (first_of_file) {
+      excluded->second = utils::is_path_excluded(filepath, filter.excluded_paths);
 #ifndef IGNORE_ALL_DIAGNOSTIC_FILTERS
-    if (line_suppressed_diagnostics.find(std::make_tuple(line, diag.code.getCode(), filepath)) !=
-        line_suppressed_diagnostics.end()) {
-      continue;
+      const auto unit = std::find_if(filter.root_units.begin(),
+          filter.root_units.end(),
+          [&filepath](const auto &u) {
+            return utils::is_path_part_of_path(filepath, u.first);
+          });
+      if (unit != filter.root_units.end() && !unit->second) {
+        excluded->second = true;
+      }
+#endif
     }
-
-    if (file_suppressed_diagnostics.find(std::make_tuple(diag.code.getCode(), filepath)) !=
-        file_suppressed_diagnostics.end()) {
+    if (excluded->second) {
+      pipeline.drop(DiagnosticStage::Exclude);
       continue;
     }
+    pipeline.pass(DiagnosticStage::Exclude);
 
-    // Search project-wise suppressions only looking at names.
-    if (std::find_if(suppressed_diagnostics.begin(),
-            suppressed_diagnostics.end(),
-            [&diag](const Diagnostic &d) {
-              return d.name == slang::toString(diag.code);
-            }) != suppressed_diagnostics.end()) {
+#ifndef IGNORE_ALL_DIAGNOSTIC_FILTERS
+    // Skip if its code is suppressed on the same line, in the whole file or by the project.
+    if (suppressions.suppressed(diag, file, line)) {
+      pipeline.drop(DiagnosticStage::Suppress);
       continue;
     }
 #endif
+    pipeline.pass(DiagnosticStage::Suppress);
+
+    Diagnostic lsp_diag;
+    lsp_diag.filepath = filepath;
 
     size_t column = sm->getColumnNumber(diag.location);
 
@@ -305,35 +927,12 @@ std::vector<Diagnostic> Project::find_diagnostics() {
       column = 1;
     }
 
-    // Check if    // Convert to full path by combining with the project path
-    lsp_diag.filepath = filepath;
-
-#ifndef IGNORE_ALL_DIAGNOSTIC_FILTERS
-    // Check if the file is in any of the non-principal root units, in which case we should ignore
-    // it linting errors from it.
-    bool ignore = false;
-    auto unit = get_unit_via_path(lsp_diag.filepath);
-    if (unit.has_value() && !unit.value()->principal()) {
-      if (utils::is_path_part_of_path(lsp_diag.filepath, unit.value()->path())) {
-        ignore = true;
-      }
-    }
-
-    if (ignore) {
-      continue;
-    }
-#endif
-
-    diagnostics_files.insert(lsp_diag.filepath);
-
     lsp_diag.range.start.line = line - 1;
     lsp_diag.range.start.character = column - 1;
     lsp_diag.range.end.line = line - 1;
     lsp_diag.range.end.character = column - 1;
 
-    const auto severity = slang::getDefaultSeverity(diag.code);
-
-    switch (severity) {
+    switch (slang::getDefaultSeverity(diag.code)) {
       case slang::DiagnosticSeverity::Error:
         lsp_diag.severity = DiagnosticSeverity::Error;
         break;
@@ -351,26 +950,75 @@ std::vector<Diagnostic> Project::find_diagnostics() {
         break;
     }
 
-    lsp_diagnostics.push_back(lsp_diag);
+    switch (diag.code.getSubsystem()) {
+      case slang::DiagSubsystem::Lexer:
+      case slang::DiagSubsystem::Preprocessor:
+      case slang::DiagSubsystem::Parser:
+        lsp_diag.syntax = true;
+        break;
+      default:
+        break;
+    }
+    pipeline.pass(DiagnosticStage::Severity);
+
+    // Format, now that it is known to be published.
+    if (report) {
+      diag_engine.issue(diag);
+    }
+    lsp_diag.message = diag_engine.formatMessage(diag);
+    lsp_diag.name = slang::toString(diag.code);
+    spdlog::debug("Diagnostic is {} fp: {}", lsp_diag.message, filepath.string());
+    pipeline.pass(DiagnosticStage::Format);
+
+    lsp_diagnostics.push_back(std::move(lsp_diag));
   }
 
   if (empty_path_diagnostics > 0) {
     spdlog::warn("Diagnostics with empty paths skipped: {}", empty_path_diagnostics);
   }
 
-  spdlog::info("Fetching diagnostics took: {}ms",
+  spdlog::info("Fetching diagnostics took: {}ms ({})",
       std::chrono::duration_cast<std::chrono::milliseconds>(
           std::chrono::high_resolution_clock::now() - last)
-          .count());
-  last = std::chrono::high_resolution_clock::now();
+          .count(),
+      pipeline.summary());
+  pipeline.record();
 
-  const std::string report = client->getString();
-  spdlog::debug(" -> Diagnostics: {}", report);
+  if (report) {
+    spdlog::debug(" -> Diagnostics: {}", client->getString());
+  }
   spdlog::info(" LSP diagnostics: {}", lsp_diagnostics.size());
 
   return lsp_diagnostics;
 }
 
+// Grows the closure with what the open documents need now. Other files are read from disk.
+void Project::update_dependency_closure() {
+  if (const auto update = capture_closure_update())
+    update_dependency_closure(update.value());
+}
+
+std::optional<Project::ClosureUpdate> Project::capture_closure_update() const {
+  if (!partial_compilation)
+    return std::nullopt;
+  ClosureUpdate update{dependency_closure, {}, declared_name_to_paths, include_name_to_paths};
+  for (const auto &[path, root_unit] : root_units) {
+    for (const auto &[fp, buff] : root_unit->file_buffers())
+      update.buffers.emplace_back(fp, buff);
+  }
+  return update;
+}
+
+void Project::update_dependency_closure(const ClosureUpdate &update) {
+  const size_t added = update.closure->update(
+      update.buffers, update.declared_name_to_paths, update.include_name_to_paths);
+  if (added > 0) {
+    spdlog::info("Partial compilation: {} files added, {} in total",
+        added,
+        update.closure->size());
+  }
+}
+
 // This determines what files are passed to the compiler and caches
 // inlined files for lookup.
 void Project::scan_files() {
@@ -386,7 +1034,7 @@ void Project::scan_files() {
 
     auto last = std::chrono::high_resolution_clock::now();
 
-    root_unit->scan_files(excluded_paths);
+    root_unit->scan_files(excluded_paths, scan_cache.get());
 
     spdlog::debug("Unit time to detect scan files (path: {}): {}ms",
         path.string(),
@@ -398,6 +1046,21 @@ void Project::scan_files() {
       std::chrono::duration_cast<std::chrono::milliseconds>(
           std::chrono::high_resolution_clock::now() - last_all)
           .count());
+
+  scan_cache->save();
+
+  auto declared_names = std::make_shared<NameToPaths>();
+  auto include_names = std::make_shared<NameToPaths>();
+  for (const auto &[path, root_unit] : root_units) {
+    for (const auto &[name, paths] : root_unit->declared_name_to_paths())
+      (*declared_names)[name].insert(paths.begin(), paths.end());
+    for (const auto &[name, paths] : root_unit->include_name_to_paths())
+      (*include_names)[name].insert(paths.begin(), paths.end());
+    for (const auto &header : root_unit->header_files())
+      add_include_names(header, *include_names);
+  }
+  declared_name_to_paths = std::move(declared_names);
+  include_name_to_paths = std::move(include_names);
 }
 
 // TODO: make this atomic as there can be concurrent readers.
@@ -416,8 +1079,8 @@ bool Project::write_dotfile() {
   }
   dotfile["imports"] = non_principal_root_unit_paths;
   dotfile["projectSuppressions"] = nlohmann::json::array();
-  for (const auto &suppression : suppressed_diagnostics) {
-    dotfile["projectSuppressions"].push_back(suppression.name);
+  for (const auto &suppression : suppressions) {
+    dotfile["projectSuppressions"].push_back(suppression.to_json());
   }
 
   std::vector<std::string> paths;
@@ -425,6 +1088,10 @@ bool Project::write_dotfile() {
     paths.push_back(exclusion.string());
   }
   dotfile["excludePaths"] = paths;
+  if (partial_compilation)
+    dotfile["partialCompilation"] = true;
+  if (incremental_diagnostics)
+    dotfile["incrementalDiagnostics"] = true;
 
   dotfile["macros"] = nlohmann::json::array();
   for (const auto &macro : defines) {
@@ -454,6 +1121,11 @@ bool Project::load_dotfile(bool scan_files_flag) {
   const auto &principal_root_unit_path = principal_root_unit->path();
   spdlog::debug("Loading dotfile for project: {}", principal_root_unit_path.string());
 
+  // Reloading is how users pick up files changed outside the editor. The partial reloads before
+  // the dotfile is rewritten (e.g. by set_macros) keep the loaded text.
+  if (scan_files_flag)
+    invalidate_sources();
+
   const auto dot_file_path = principal_root_unit_path / DOT_FILENAME;
 
   if (!fs::exists(dot_file_path)) {
@@ -521,21 +1193,34 @@ bool Project::load_dotfile(bool scan_files_flag) {
   }
 
   if (dotfile.contains("projectSuppressions")) {
-    suppressed_diagnostics.clear();
-    for (const auto &suppression : dotfile["projectSuppressions"]) {
-      Diagnostic diag;
-      diag.name = suppression.get<std::string>();
-      suppressed_diagnostics.push_back(diag);
+    suppressions.clear();
+    for (const auto &json : dotfile["projectSuppressions"]) {
+      if (auto suppression = Suppression::from_json(json)) {
+        suppressions.push_back(std::move(suppression.value()));
+      } else {
+        spdlog::warn("Ignoring invalid suppression: {}", json.dump());
+      }
     }
   }
+  suppression_index =
+      std::make_shared<const SuppressionIndex>(suppressions, principal_root_unit->path());
 
   if (dotfile.contains("excludePaths")) {
     excluded_paths.clear();
     exclude_rel_paths(dotfile["excludePaths"]);
   }
 
-  if (scan_files_flag)
+  partial_compilation = dotfile.contains("partialCompilation") &&
+                        dotfile["partialCompilation"].is_boolean() &&
+                        dotfile["partialCompilation"].get<bool>();
+  incremental_diagnostics = dotfile.contains("incrementalDiagnostics") &&
+                            dotfile["incrementalDiagnostics"].is_boolean() &&
+                            dotfile["incrementalDiagnostics"].get<bool>();
+
+  if (scan_files_flag) {
+    dependency_closure->reset();
     scan_files();
+  }
 
   return true;
 }
@@ -573,10 +1258,12 @@ bool Project::get_text_from_file_loc(
   }
 
   if (unit.value()->file_buffers().find(path) != unit.value()->file_buffers().end()) {
-    std::istringstream iss(unit.value()->file_buffers().at(path));
-    std::string line;
+    std::string_view text = unit.value()->file_buffers().at(path);
+    std::string_view line;
     for (int i = 0; i <= line_idx; i++) {
-      std::getline(iss, line);
+      if (!utils::next_line(text, line)) {
+        line = {};
+      }
     }
     output_buffer = line;
     return true;
@@ -586,7 +1273,7 @@ bool Project::get_text_from_file_loc(
   return false;
 }
 
-void Project::update_file_buffer(const fs::path &filepath, const std::string &buff) {
+void Project::update_file_buffer(const fs::path &filepath, std::string buff) {
   auto unit = get_unit_via_path(filepath);
   if (!unit.has_value()) {
     spdlog::error("Unit not found for path: {}", filepath.string());
@@ -595,26 +1282,27 @@ void Project::update_file_buffer(const fs::path &filepath, const std::string &bu
 
   bool rescan = false;
   unit.value()->set_stale(true);
-  auto prev_contents = unit.value()->get_file_contents(filepath);
+  syntax_tree_cache->invalidate_buffer(filepath);
+  const std::string &prev_contents = unit.value()->get_file_contents(filepath);
   std::set<std::string> added_inlined_files;
   std::set<std::string> deleted_inlined_files;
 
   if (prev_contents != buff) {
     bool prev_file_read_complete = false;
     bool file_read_complete = false;
-    std::istringstream prev_iss(prev_contents);
-    std::istringstream iss(buff);
+    std::string_view prev_text = prev_contents;
+    std::string_view text = buff;
     do {
       // This loop would be more efficient if diff-match-patch returned the line
       // numbers along with the changes, Then we would not have to read
       // the entire file line by line.
-      std::string prev_line;
-      if (!prev_file_read_complete && !std::getline(prev_iss, prev_line)) {
+      std::string_view prev_line;
+      if (!prev_file_read_complete && !utils::next_line(prev_text, prev_line)) {
         prev_file_read_complete = true;
       }
 
-      std::string line;
-      if (!file_read_complete && !std::getline(iss, line)) {
+      std::string_view line;
+      if (!file_read_complete && !utils::next_line(text, line)) {
         file_read_complete = true;
       }
 
@@ -632,22 +1320,22 @@ void Project::update_file_buffer(const fs::path &filepath, const std::string &bu
           // without checking the other files via a rescan.
           spdlog::debug("found prev_line {} line {}", prev_line, line);
           if (has_include_statement(prev_line)) {
-            unit.value()->get_inlined_files(prev_line, deleted_inlined_files);
+            unit.value()->get_inlined_files(std::string(prev_line), deleted_inlined_files);
           }
           if (has_include_statement(line)) {
-            unit.value()->get_inlined_files(line, added_inlined_files);
+            unit.value()->get_inlined_files(std::string(line), added_inlined_files);
           }
         }
       }
 
       if (prev_file_read_complete && !file_read_complete) {
         if (has_include_statement(line)) {  // This assumes there is only one include per line.
-          unit.value()->get_inlined_files(line, added_inlined_files);
+          unit.value()->get_inlined_files(std::string(line), added_inlined_files);
         }
       }
       if (!prev_file_read_complete && file_read_complete) {
         if (has_include_statement(prev_line)) {  // This assumes there is only one include per line.
-          unit.value()->get_inlined_files(prev_line, deleted_inlined_files);
+          unit.value()->get_inlined_files(std::string(prev_line), deleted_inlined_files);
         }
       }
     } while (!prev_file_read_complete || !file_read_complete);
@@ -687,7 +1375,7 @@ void Project::update_file_buffer(const fs::path &filepath, const std::string &bu
     }
   }
 
-  unit.value()->store_file_contents(filepath, buff);
+  unit.value()->store_file_contents(filepath, std::move(buff));
   // We are ok with this failing as there may be no cache.
   if (!unit.value()->add_file_to_cache(filepath)) {
     spdlog::warn("Failed to add file to cache: {}", filepath.string());
@@ -700,7 +1388,7 @@ void Project::update_file_buffer(const fs::path &filepath, const std::string &bu
 }
 
 bool Project::add_file(
-    const fs::path &path, const std::string &buff) {  // returns false if file already exists
+    const fs::path &path, std::string buff) {  // returns false if file already exists
   auto unit = get_unit_via_path(path);
   if (!unit.has_value()) {
     spdlog::error("Unit not found for path: {}", path.string());
@@ -708,8 +1396,9 @@ bool Project::add_file(
   }
 
   unit.value()->set_stale(true);
+  syntax_tree_cache->invalidate(path);
   if (!buff.empty()) {
-    unit.value()->store_file_contents(path, buff);
+    unit.value()->store_file_contents(path, std::move(buff));
   }
   return unit.value()->add_file_to_cache(path);
 }
@@ -722,12 +1411,27 @@ void Project::remove_file_if_no_ent(const fs::path &path) {
   }
 
   unit.value()->set_stale(true);
+  syntax_tree_cache->invalidate(path);
   unit.value()->clear_file_contents(path);
   if (!unit.value()->remove_file_from_cache(path)) {
     spdlog::error("Failed to remove file from cache: {}", path.string());
   }
 }
 
+void Project::clear_file_buffers() {
+  for (const auto &[_, unit] : root_units) {
+    std::vector<fs::path> buffered;
+    for (const auto &[fp, _] : unit->file_buffers()) {
+      buffered.push_back(fp);
+    }
+    for (const auto &fp : buffered) {
+      unit->clear_file_contents(fp);
+      syntax_tree_cache->invalidate(fp);
+    }
+    unit->set_stale(true);
+  }
+}
+
 bool Project::exclude_resource(const fs::path &path) {
   auto unit = get_unit_via_path(path);
 
@@ -910,6 +1614,10 @@ nonstd::expected<std::shared_ptr<Project>, std::string_view> Project::create(con
 
   spdlog::info("Creating project for path: {}", path.string());
 
+  if (const auto location = ScanCache::default_location(path); location.has_value()) {
+    project->scan_cache = std::make_unique<ScanCache>(location.value());
+  }
+
   if (!project->load_dotfile()) {
     return nonstd::make_unexpected("Failed to load dotfile"sv);
   }
@@ -917,6 +1625,10 @@ nonstd::expected<std::shared_ptr<Project>, std::string_view> Project::create(con
   return project;
 }
 
+const fs::path &Project::path() const {
+  return principal_root_unit->path();
+}
+
 void Project::print_root_unit_paths() {
   for (const auto &[path, root_unit] : root_units) {
     spdlog::info("  - Root unit path: {}", path.string());
@@ -924,15 +1636,10 @@ void Project::print_root_unit_paths() {
 }
 
 // Hacky way to get the default (right-hand-side) value in an assignment.
-std::optional<std::string> Project::extract_assigned_value(slang::SourceRange range) {
-  if (!source_manager) {
-    spdlog::error("Source manager not available");
-    return std::nullopt;
-  }
-
-  // TODO: Is there any way the source code could change while we are extracting the value?
+std::optional<std::string> Project::extract_assigned_value(
+    const slang::SourceManager &sm, slang::SourceRange range) {
   if (range.start().buffer() == range.end().buffer()) {
-    const auto txt = source_manager->getSourceText(range.start().buffer());
+    const auto txt = sm.getSourceText(range.start().buffer());
 
     if (txt.size() < range.end().offset()) {
       spdlog::error("Source text is smaller than the end offset");
@@ -977,10 +1684,13 @@ void Project::get_ranges_for_syntax_kinds(slang::syntax::SyntaxNode *node,
 }
 
 bool Project::can_define_module(const fs::path &filepath, int line_idx, int col_idx) {
-  if (!source_manager) {
+  const auto snapshot = current_snapshot();
+  if (!snapshot) {
     spdlog::error("Source manager not available");
     return false;
   }
+  auto &source_manager = snapshot->compile.source_manager;
+  auto &source_library = snapshot->compile.source_library;
 
   const int line = line_idx + 1;
   const int col = col_idx + 1;
@@ -1021,18 +1731,27 @@ bool Project::can_define_module(const fs::path &filepath, int line_idx, int col_
   return true;
 }
 
-std::vector<ModuleDeclaration> Project::get_modules() {
-  const auto compilation = compile();
-  std::vector<ModuleDeclaration> res;
-
-  if (!compilation.has_value()) {
-    spdlog::error("Failed to compile project");
-    return res;
+std::vector<ModuleDeclaration> Project::get_modules(const CancellationToken &cancellation) {
+  const auto current = snapshot(cancellation);
+  if (!current) {
+    return {};
   }
+  return current->modules;
+}
 
-  auto defs = compilation.value()->getDefinitions();
+// Creates default instances, so this may only run while the snapshot is being built.
+std::optional<std::vector<ModuleDeclaration>> Project::collect_modules(
+    slang::ast::Compilation &compilation, const CancellationToken &cancellation) {
+  std::vector<ModuleDeclaration> res;
+  const auto &sm = *compilation.getSourceManager();
+
+  auto defs = compilation.getDefinitions();
 
   for (const auto &def : defs) {
+    if (cancellation.is_cancelled()) {
+      return std::nullopt;
+    }
+
     if (def->kind == slang::ast::SymbolKind::Definition) {
       auto &defsymbol = def->as<slang::ast::DefinitionSymbol>();
 
@@ -1040,7 +1759,7 @@ std::vector<ModuleDeclaration> Project::get_modules() {
         continue;
 
       // TODO: get rid of this artificial instance, just use the definition
-      auto &inst = slang::ast::InstanceSymbol::createDefault(*compilation.value().get(), defsymbol);
+      auto &inst = slang::ast::InstanceSymbol::createDefault(compilation, defsymbol);
 
       const auto &body = inst.as<slang::ast::InstanceSymbol>().body;
       const std::span<const slang::ast::Symbol *const> port_names = body.getPortList();
@@ -1071,7 +1790,7 @@ std::vector<ModuleDeclaration> Project::get_modules() {
             spdlog::debug("Type param: {}", decl->name.valueText());
 
             m.parameters.push_back({std::string(decl->name.valueText()),
-                decl->assignment ? extract_assigned_value(decl->assignment->sourceRange())
+                decl->assignment ? extract_assigned_value(sm, decl->assignment->sourceRange())
                                  : std::nullopt});
           }
         } else if (param.isPortParam) {
@@ -1083,7 +1802,7 @@ std::vector<ModuleDeclaration> Project::get_modules() {
               continue;  // Skip if parameter name exists
 
             m.parameters.push_back({std::string(decl->name.valueText()),
-                decl->initializer ? extract_assigned_value(decl->initializer->sourceRange())
+                decl->initializer ? extract_assigned_value(sm, decl->initializer->sourceRange())
                                   : std::nullopt});
           }
         } else {
@@ -1110,29 +1829,30 @@ void Project::register_warning(std::string_view msg) {
   }
 }
 
-std::vector<Location> Project::lookup(const fs::path &path, size_t row, size_t col) {
+std::vector<Location> Project::lookup(
+    const fs::path &path, size_t row, size_t col, const CancellationToken &cancellation) {
   // 0. Get root unit for path.
   // 1. Get symbol name first.
   // 2. Lookup symbol in AST.
   spdlog::info("Looking up symbol at: {}:{}:{}", path.string(), row, col);
 
   std::vector<Location> res;
-  auto maybe_compilation = compile();
-  if (!maybe_compilation.has_value()) {
-    spdlog::error("Failed to compile project");
+  const auto current = snapshot(cancellation);
+  if (!current) {
     return res;
   }
-
-  // TODO: cache this.
-  const auto syntax_trees = maybe_compilation.value()->getSyntaxTrees();
-  LookupCacheVisitor visitor(maybe_compilation.value());
-  for (const auto &tree : syntax_trees) {
-    tree->root().visit(visitor);
-  }
-
-  // Find construct we are looking up.
-  auto maybe_construct = visitor.lookup(
-      path, row, col, {ConstructType::HIERARCHY_INSTANTIATION, ConstructType::INCLUDE_DIRECTIVE});
+  // Files that were not compiled for a recheck are found in its base, unchanged since.
+  const auto find_construct = [&](const LookupCacheVisitor &index) {
+    return index.lookup(
+        path, row, col, {ConstructType::HIERARCHY_INSTANTIATION, ConstructType::INCLUDE_DIRECTIVE});
+  };
+  auto maybe_construct = find_construct(*current->lookup_index);
+  const LookupCacheVisitor *index = current->lookup_index.get();
+  if (!maybe_construct.has_value() && current->base) {
+    index = current->base->lookup_index.get();
+    maybe_construct = find_construct(*index);
+  }
+  const LookupCacheVisitor &visitor = *index;
 
   if (maybe_construct.has_value()) {
     const auto [construct_type, construct_name] = maybe_construct.value();
@@ -3,13 +3,24 @@
 #include "slang/text/SourceManager.h"
 #include "slang/ast/Compilation.h"
 
+#include <atomic>
 #include <filesystem>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "cancellation.hpp"
+#include "dependencyclosure.hpp"
 #include "rootunit.hpp"
+#include "scancache.hpp"
+#include "suppressions.hpp"
+#include "syntaxtreecache.hpp"
 
 #include "shared.hpp"
 
@@ -30,6 +41,104 @@ namespace metalware {
     WARNING_EXCEEDS_MAX_FILE_COUNT
   };
 
+  // Define sets whose last snapshot is kept, so that switching back to one needs no compilation.
+  static constexpr size_t MAX_CACHED_CONFIGURATIONS = 3;
+  // Snapshots of a project alive at once: the cached ones plus the one being built. Superseded
+  // snapshots that requests still read count too. See Project::reserve_snapshot.
+  static constexpr size_t MAX_LIVE_SNAPSHOTS = MAX_CACHED_CONFIGURATIONS + 1;
+
+  class LookupCacheVisitor; // forward declaration
+
+  struct CompilationSnapshot;
+  using SnapshotPtr = std::shared_ptr<const CompilationSnapshot>;
+
+  // The project state that diagnostics are filtered against, captured with the compile inputs.
+  struct DiagnosticFilter {
+    std::shared_ptr<const SuppressionIndex> suppressions;  // of the project, null for none
+    std::vector<fs::path> excluded_paths;
+    std::vector<std::pair<fs::path, bool /*principal*/>> root_units;  // as in Project::root_units
+  };
+
+  using NameToPaths = std::map<std::string, std::set<fs::path>>;
+
+  // Counts the snapshots of a project that are alive, whoever holds them. Shared with the
+  // snapshots, which may outlive their project.
+  struct SnapshotAccount {
+    std::atomic<size_t> alive = 0;
+  };
+
+  // Everything a compilation reads from the project, copied out so that the (slow) build can run
+  // while the project keeps changing. See Project::capture_compile_inputs.
+  struct CompileInputs {
+    std::vector<std::pair<fs::path, std::string>> buffers;  // unsaved editor buffers
+    std::vector<fs::path> include_dirs;
+    std::vector<std::string> target_files;  // non-inlined sources, in compilation order
+    std::vector<LibraryInputs> libraries;   // the non-principal root units, first in target_files
+    std::vector<std::string> defines;
+    DiagnosticFilter filter;
+    std::shared_ptr<SyntaxTreeCache> syntax_trees;  // trees of earlier compilations
+    std::shared_ptr<SnapshotAccount> snapshots;     // of the project, to count the one built
+
+    std::string configuration;  // the defines, normalized
+    size_t structure = 0;       // of everything else but the buffer texts
+    size_t fingerprint = 0;     // of the structure and the buffer texts
+    std::map<fs::path, size_t> buffer_hashes;
+
+    // The last compilation of all files, if "incrementalDiagnostics" is set in the dotfile, and
+    // what Project::plan_recheck needs besides to find the files an edit since may affect.
+    SnapshotPtr recheck_base;
+    std::shared_ptr<const NameToPaths> declared_name_to_paths;
+    std::shared_ptr<const NameToPaths> include_name_to_paths;
+
+    // Set by Project::plan_recheck when only some of the files need checking again: target_files
+    // is cut down to them and what they depend on, and `base`, a snapshot of all files, provides
+    // the diagnostics of the others.
+    SnapshotPtr base;
+    std::set<fs::path> rechecked;
+    std::unordered_set<std::string> changed_names;  // declared by the edited files, before and now
+  };
+
+  struct CompileResult {
+    std::shared_ptr<slang::SourceManager> source_manager;
+    std::shared_ptr<slang::SourceLibrary> source_library;
+    std::shared_ptr<slang::ast::Compilation> compilation;
+    std::vector<std::string> target_files;  // paths handed to the parser
+    std::vector<std::string_view> texts;    // as in ParsedSources
+  };
+
+  // A finished compilation together with everything requests read from it. Once published it is
+  // never modified, so it can be read from any thread without the project lock; the compilation
+  // itself is only touched while the snapshot is being built.
+  struct CompilationSnapshot {
+    explicit CompilationSnapshot(std::shared_ptr<SnapshotAccount> account);
+    ~CompilationSnapshot();
+    CompilationSnapshot(const CompilationSnapshot &) = delete;
+    CompilationSnapshot &operator=(const CompilationSnapshot &) = delete;
+
+    CompileResult compile;
+    std::vector<ModuleDeclaration> modules;
+    std::shared_ptr<const LookupCacheVisitor> lookup_index;
+    std::vector<Diagnostic> diagnostics;
+
+    std::string configuration;  // as in the CompileInputs it was built from
+    size_t structure = 0;
+    size_t fingerprint = 0;
+    std::map<fs::path, size_t> buffer_hashes;
+
+    // Null if all files were checked. Otherwise the diagnostics of the files that were not, and
+    // lookups outside of the files compiled, come from the base; it never has a base itself.
+    SnapshotPtr base;
+    // The declarations and references of the principal files, for the snapshots built on this one.
+    // Null unless all files were checked.
+    std::shared_ptr<const ReferenceIndex> references;
+    // How much the heap of the whole process grew while it was built (see utils::heap_bytes),
+    // which includes the trees it parsed first. Only reported: other threads allocate meanwhile,
+    // and the trees it shares with other snapshots count for whichever parsed them.
+    size_t heap_growth = 0;
+
+    std::shared_ptr<SnapshotAccount> account;
+  };
+
   class Project {
     Project(const fs::path &path) : principal_root_unit(RootUnit::create(path, true)) {
       root_units[path] = principal_root_unit;
@@ -41,7 +150,8 @@ namespace metalware {
     Project& operator=(Project&&) = delete;
 
 
-    std::vector<Diagnostic> suppressed_diagnostics;  // project-wide suppressions
+    std::vector<Suppression> suppressions;  // project-wide, as in the dotfile
+    std::shared_ptr<const SuppressionIndex> suppression_index;  // compiled on each dotfile load
     std::map<fs::path, RootUnitPtr> root_units;
     RootUnitPtr principal_root_unit;
 
@@ -49,24 +159,45 @@ namespace metalware {
 
     std::vector<fs::path> excluded_paths = {}; // paths that should be excluded
 
-    std::vector<std::string> non_inlined_fp_string_cache = {};
     std::unordered_map<fs::path, int> fp_ranks = {};
 
-    // Should these really be members?
-    std::shared_ptr<slang::SourceManager> source_manager = nullptr;
-    std::shared_ptr<slang::SourceLibrary> source_library = nullptr;
-
-    std::optional<std::shared_ptr<slang::ast::Compilation>> cached_compilation = std::nullopt;
+    // Compiles only what the open documents depend on, for projects too large to compile whole.
+    // Set by "partialCompilation" in the dotfile.
+    bool partial_compilation = false;
+    // After an edit, checks only the files it may affect again. Set by "incrementalDiagnostics" in
+    // the dotfile, as the references it goes by are lexical and may miss some.
+    bool incremental_diagnostics = false;
+    std::shared_ptr<DependencyClosure> dependency_closure = std::make_shared<DependencyClosure>();
+    // Of all root units, replaced rather than changed so that compile inputs can share them.
+    std::shared_ptr<const NameToPaths> declared_name_to_paths = std::make_shared<NameToPaths>();
+    std::shared_ptr<const NameToPaths> include_name_to_paths = std::make_shared<NameToPaths>();
+
+    std::shared_ptr<SyntaxTreeCache> syntax_tree_cache = std::make_shared<SyntaxTreeCache>();
+    std::unique_ptr<ScanCache> scan_cache = std::make_unique<ScanCache>();
+
+    std::shared_ptr<SnapshotAccount> snapshot_account = std::make_shared<SnapshotAccount>();
+    mutable std::mutex snapshot_mutex;
+    SnapshotPtr published_snapshot = nullptr;  // guarded by snapshot_mutex
+    // The last snapshot of each recently used define set, most recent first. Guarded by
+    // snapshot_mutex. They are compiled from the same text, so publishing one compiled after an
+    // edit drops the others: going back to another define set compiles it once more. Keeping them
+    // would need the edited files compiled again under each define set anyway.
+    std::list<SnapshotPtr> recent_snapshots;
 
     // Methods
-    [[nodiscard]] std::optional<std::string> extract_assigned_value(slang::SourceRange range);
-    [[nodiscard]] nonstd::expected<std::shared_ptr<slang::ast::Compilation>, std::string> compile();
-    [[nodiscard]] bool add_target_files_to_compilation(const std::vector<fs::path> &target_file_paths,
-        const std::shared_ptr<slang::ast::Compilation>& compilation);
+    [[nodiscard]] static std::optional<std::string> extract_assigned_value(
+        const slang::SourceManager &sm, slang::SourceRange range);
+    [[nodiscard]] static std::optional<std::vector<ModuleDeclaration>> collect_modules(
+        slang::ast::Compilation &compilation, const CancellationToken &cancellation);
 
     [[nodiscard]] std::optional<RootUnitPtr> get_unit_via_path(const fs::path &path) const;
 
     void scan_files();
+    void update_dependency_closure();
+    // Narrows `inputs` down to the files an edit since the last full compilation may affect, if
+    // few enough of them to pay off. See CompileInputs::base. Reads files, so it runs as part of
+    // build_snapshot rather than with the project locked.
+    static void plan_recheck(CompileInputs &inputs);
 
     [[nodiscard]] bool can_define_module (const fs::path& filepath, int line, int col);
 
@@ -82,17 +213,78 @@ public:
     static nonstd::expected<std::shared_ptr<Project>, std::string_view> create(const fs::path &path);
 
     void print_root_unit_paths();
+    [[nodiscard]] const fs::path &path() const;
 
     [[nodiscard]] std::vector<Diagnostic> find_diagnostics();
-    [[nodiscard]] std::vector<ModuleDeclaration> get_modules();
+    // Returns nullopt if cancelled before all diagnostics were collected, or skipped because
+    // requests still read too many snapshots (see reserve_snapshot).
+    [[nodiscard]] std::optional<std::vector<Diagnostic>> find_diagnostics(
+        const CancellationToken &cancellation);
+
+    // A compilation in three steps, so that only the first and last need exclusive access to the
+    // project: capture its inputs, build a snapshot from them anywhere, then publish it as the
+    // snapshot that lookups and completions are served from.
+    [[nodiscard]] CompileInputs capture_compile_inputs();
+    // The same for the dependency closure of partial compilations, which capture_compile_inputs
+    // grows too: growing it ahead with the project unlocked leaves it little to do.
+    struct ClosureUpdate {
+      std::shared_ptr<DependencyClosure> closure;
+      std::vector<std::pair<fs::path, std::string>> buffers;  // of all root units
+      std::shared_ptr<const NameToPaths> declared_name_to_paths;
+      std::shared_ptr<const NameToPaths> include_name_to_paths;
+    };
+    // Nullopt unless compiling partially.
+    [[nodiscard]] std::optional<ClosureUpdate> capture_closure_update() const;
+    static void update_dependency_closure(const ClosureUpdate &update);
+    [[nodiscard]] static nonstd::expected<CompileResult, std::string> build(
+        CompileInputs inputs, const CancellationToken &cancellation);
+    [[nodiscard]] static nonstd::expected<SnapshotPtr, std::string> build_snapshot(
+        CompileInputs inputs, const CancellationToken &cancellation);
+    // With `parse_only`, only the diagnostics of parsing, which need no elaboration.
+    [[nodiscard]] static std::optional<std::vector<Diagnostic>> collect_diagnostics(
+        const std::shared_ptr<slang::ast::Compilation> &compilation,
+        const DiagnosticFilter &filter,
+        const CancellationToken &cancellation,
+        bool parse_only = false);
+    // The parse diagnostics of one edited buffer in `inputs`, found without compiling the rest of
+    // the project. Nullopt if the file has not been compiled before.
+    [[nodiscard]] static std::optional<std::vector<Diagnostic>> find_parse_diagnostics(
+        const CompileInputs &inputs, const fs::path &path, const CancellationToken &cancellation);
+
+    // Returns the snapshots it supersedes, so that the caller chooses where their (possibly slow)
+    // destruction happens. Dropping the result releases them unless requests still read them.
+    std::vector<SnapshotPtr> publish(SnapshotPtr snapshot);
+    // Makes room for one more snapshot under MAX_LIVE_SNAPSHOTS by evicting the least recently
+    // used define sets, counting the bases they keep alive. False if requests still read too many
+    // superseded snapshots: the pass is then skipped rather than waiting for them.
+    [[nodiscard]] bool reserve_snapshot();
+    // Of this project, whoever holds them.
+    [[nodiscard]] size_t live_snapshots() const {
+      return snapshot_account->alive.load();
+    }
+    // A snapshot built from the same inputs before, e.g. under the defines that were in effect
+    // before the last setMacros. Null if there is none, or if anything else changed since.
+    [[nodiscard]] SnapshotPtr find_snapshot(const CompileInputs &inputs);
+    // The last published snapshot, or null if there is none yet.
+    [[nodiscard]] SnapshotPtr current_snapshot() const;
+    // Like current_snapshot, but compiles and publishes one if there is none yet. Null on failure.
+    [[nodiscard]] SnapshotPtr snapshot(const CancellationToken &cancellation = {});
+
+    [[nodiscard]] std::vector<ModuleDeclaration> get_modules(
+        const CancellationToken &cancellation = {});
     [[nodiscard]] bool load_dotfile(bool detect_noninlined_files = true);
     [[nodiscard]] bool write_dotfile();
     [[nodiscard]] bool get_text_from_file_loc(
         const fs::path& path, int line, int col, std::string &text) const;
-    void update_file_buffer(const fs::path& filepath, const std::string &buff);
+    void update_file_buffer(const fs::path& filepath, std::string buff);
+    // Makes the next compilation read every file again instead of reusing the text it has loaded.
+    void invalidate_sources();
+    // Like invalidate_sources, for a single file, e.g. once the editor saved it.
+    void invalidate_source(const fs::path &path);
 
-    bool add_file(const fs::path &path, const std::string &buff);
+    bool add_file(const fs::path &path, std::string buff);
     void remove_file_if_no_ent(const fs::path &path);
+    void clear_file_buffers();
 
     [[nodiscard]] bool is_resource_excluded(const fs::path &path);
     [[nodiscard]] bool exclude_resource(const fs::path &path);
@@ -102,9 +294,12 @@ public:
     [[nodiscard]] std::optional<std::string_view> /*error*/ add_root_unit(const fs::path &path);
     [[nodiscard]] std::optional<std::string_view> /*error*/ remove_root_unit(const fs::path &path);
 
-    std::vector<Location> lookup(const fs::path &path, size_t row, size_t col);
+    std::vector<Location> lookup(const fs::path &path, size_t row, size_t col,
+        const CancellationToken &cancellation = {});
 
     std::map<fs::path, std::vector<Diagnostic>> prev_files_with_diagnostics;
+    // Of the diagnostics last sent for each file that has any in the client.
+    std::map<fs::path, size_t> published_diagnostics_fingerprints;
     std::map</*msg*/ std::string_view, /*ack*/ bool> compiler_warnings;
 
     void set_fp_rank(const fs::path& p, int rank);
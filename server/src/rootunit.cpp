@@ -1,10 +1,14 @@
 #include "rootunit.hpp"
 
 #include <array>
+#include <atomic>
 #include <fstream>
+#include <iterator>
 #include <regex>
 #include <unordered_set>
 
+#include "dependencyclosure.hpp"
+#include "scancache.hpp"
 #include "spdlog/spdlog.h"
 #include "utils.hpp"
 
@@ -35,6 +39,13 @@ static_assert(supported_header_exts.size() == SUPPORTED_HEADER_EXTS_SIZE);
 static const std::regex all_include_regex(REGEX_ALL_INCLUDE_PATTERN.data());
 static const std::regex non_header_include_regex(REGEX_NON_HEADER_INCLUDE_PATTERN.data());
 
+// Generations are unique to the process, so that a unit created again for the same path (e.g. when
+// the dot file is reloaded) never matches a snapshot taken of the old one.
+static uint64_t next_generation() {
+  static std::atomic<uint64_t> generations = 0;
+  return ++generations;
+}
+
 struct PathHash {
   std::size_t operator()(const fs::path& path) const {
     return std::hash<std::string>{}(path.string());
@@ -82,18 +93,62 @@ void find_inlined_file(const std::string& line,
  * - API gets called when file is deleted: didClose
  */
 
+// The text of the file at `path`, or empty if it cannot be read.
+std::string read_text(const fs::path& path) {
+  std::ifstream file(path);
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// The names of the files `include(d) by `text`, and of what it declares.
+metalware::SourceSummary read_source_summary(std::string_view text) {
+  metalware::SourceSummary summary;
+  std::string_view line;
+  while (next_line(text, line)) {
+    std::match_results<std::string_view::const_iterator> match;
+    if (std::regex_search(line.begin(), line.end(), match, all_include_regex) &&
+        match.size() > 1) {
+      summary.include_names.push_back(match[1].str());
+    }
+    metalware::find_declared_names(line, summary.declared_names);
+  }
+  return summary;
+}
+
+// `includers` maps each included source file to the files including it.
 void find_inlined_files(const std::set<fs::path>& source_files,
     const std::map<std::string, std::set<std::filesystem::path>>& name_to_paths,
-    std::set<fs::path>& included_files) {
+    std::set<fs::path>& included_files,
+    std::map<fs::path, std::set<fs::path>>& includers,
+    std::map<fs::path, std::vector<std::string>>& declared_names,
+    metalware::ScanCache* scan_cache) {
   size_t files_not_found_in_map = 0;
+  size_t files_scanned = 0;
   for (const auto& file_path : source_files) {
-    std::ifstream file(file_path);
-    std::string line;
+    const std::string text = read_text(file_path);
+    metalware::SourceSummary read;
+    const metalware::SourceSummary* summary =
+        scan_cache ? scan_cache->find(file_path, text) : nullptr;
+    if (summary == nullptr) {
+      files_scanned++;
+      read = read_source_summary(text);
+      summary = scan_cache ? &scan_cache->store(file_path, text, std::move(read)) : &read;
+    }
+
+    if (!summary->declared_names.empty())
+      declared_names[file_path] = summary->declared_names;
 
-    while (std::getline(file, line)) {
-      find_inlined_file(line, name_to_paths, included_files, files_not_found_in_map);
+    for (const auto& name : summary->include_names) {
+      const auto& include_paths = name_to_paths.find(name);
+      if (include_paths != name_to_paths.end()) {
+        included_files.insert(include_paths->second.begin(), include_paths->second.end());
+        for (const auto& include_path : include_paths->second)
+          includers[include_path].insert(file_path);
+      } else {
+        files_not_found_in_map++;
+      }
     }
   }
+  spdlog::info("Scanned {} of {} files to find includes", files_scanned, source_files.size());
 
   if (files_not_found_in_map > 0) {
     spdlog::warn("Found {} files not in the map", files_not_found_in_map);
@@ -190,11 +245,13 @@ bool find_source_and_header_files(const fs::path& path,
 std::tuple</*non-inlined source files*/ std::vector<fs::path>,
     /*inlined files*/ std::set<fs::path>,
     /*include name to paths (source files only) */ std::map<std::string, std::set<fs::path>>,
+    /*declared name to non-inlined paths */ std::map<std::string, std::set<fs::path>>,
     /*exceeded max file count*/ bool>
 find_files(const fs::path& path,
     const std::vector<fs::path>& exclude_paths,
     std::set<fs::path>& sv_files,
-    std::set<fs::path>& svh_files) {
+    std::set<fs::path>& svh_files,
+    metalware::ScanCache* scan_cache) {
   // A non-inlined source file is a file not `include(d) by any other source or header file.
   // For example,UVM lib is a package with a series of definitions included via `include,
   // but it provide no top definition. This function is useful in identifying what sources to push
@@ -210,16 +267,17 @@ find_files(const fs::path& path,
   // Step 2. Cache the possible include names of the inlined source files.
   std::map<std::string, std::set<fs::path>> include_name_to_paths;
 
-  auto add_file_possible_include_paths = [&](const fs::path& file) {
+  auto add_file_possible_include_paths = [&](const fs::path& file,
+      std::map<std::string, std::set<fs::path>>& names) {
     // Add every form of the path from absolute to filename.
     // /this/is/a/path/file.sv -> [file.sv, path/file.sv, a/path/file.sv, is/a/path/file.sv,
     // this/is/a/path/file.sv]
     fs::path p = file;
     std::string suff;
     while (!p.empty()) {
-      include_name_to_paths[p.filename().string() + suff].insert(file);
+      names[p.filename().string() + suff].insert(file);
 
-      if (include_name_to_paths.at(p.filename().string() + suff).size() > 1) {
+      if (names.at(p.filename().string() + suff).size() > 1) {
         spdlog::debug("Duplicate include name found: {}", p.filename().string());
       }
 
@@ -233,15 +291,26 @@ find_files(const fs::path& path,
   };
 
   for (const auto& source_file : sv_files) {
-    add_file_possible_include_paths(source_file);
+    add_file_possible_include_paths(source_file, include_name_to_paths);
   }
 
   std::set<fs::path> inlined_files;
   for (const auto& file : svh_files)
     inlined_files.insert(file);  // All header files are inlined.
 
-  // Step 3. Find which source files are included by other source files.
-  find_inlined_files(sv_files, include_name_to_paths, inlined_files);
+  // Step 3. Find which source files are included by other source or header files. Headers are
+  // scanned too, so that what they declare (macros, packages, ...) maps to the files that compile
+  // them in step 5.
+  std::map<std::string, std::set<fs::path>> file_name_to_paths = include_name_to_paths;
+  for (const auto& header_file : svh_files)
+    add_file_possible_include_paths(header_file, file_name_to_paths);
+  std::set<fs::path> scanned_files = sv_files;
+  scanned_files.insert(svh_files.begin(), svh_files.end());
+
+  std::map<fs::path, std::set<fs::path>> includers;
+  std::map<fs::path, std::vector<std::string>> declared_names;
+  find_inlined_files(
+      scanned_files, file_name_to_paths, inlined_files, includers, declared_names, scan_cache);
 
   // Step 4. Identify the non-included source files.
   std::vector<fs::path> non_inlined_files;
@@ -251,7 +320,35 @@ find_files(const fs::path& path,
     }
   }
 
-  return {non_inlined_files, inlined_files, include_name_to_paths, exceeded_max_file_count};
+  // Step 5. Map what each source file declares to the non-inlined files that compile it.
+  std::map<std::string, std::set<fs::path>> declared_name_to_paths;
+  for (const auto& [file, names] : declared_names) {
+    std::set<fs::path> compiled_by;
+    std::vector<fs::path> queue = {file};
+    std::set<fs::path> seen = {file};
+    while (!queue.empty()) {
+      const fs::path current = queue.back();
+      queue.pop_back();
+      if (!inlined_files.contains(current)) {
+        compiled_by.insert(current);
+        continue;
+      }
+      if (const auto itr = includers.find(current); itr != includers.end()) {
+        for (const auto& includer : itr->second) {
+          if (seen.insert(includer).second)
+            queue.push_back(includer);
+        }
+      }
+    }
+    for (const auto& name : names)
+      declared_name_to_paths[name].insert(compiled_by.begin(), compiled_by.end());
+  }
+
+  return {non_inlined_files,
+      inlined_files,
+      include_name_to_paths,
+      declared_name_to_paths,
+      exceeded_max_file_count};
 }
 }  // namespace
 
@@ -261,8 +358,8 @@ class RootUnit::impl {
  public:
   impl(const fs::path& path, bool principal) : path(path), principal(principal) {}
 
-  void store_file_contents(const fs::path& filepath, const std::string& contents) {
-    file_buffers[filepath] = contents;
+  void store_file_contents(const fs::path& filepath, std::string contents) {
+    file_buffers[filepath] = std::move(contents);
   }
 
   void clear_file_contents(const fs::path& filepath) {
@@ -272,12 +369,13 @@ class RootUnit::impl {
     }
   }
 
-  std::string get_file_contents(const fs::path& filepath) {
+  const std::string& get_file_contents(const fs::path& filepath) {
+    static const std::string empty;
     auto itr = file_buffers.find(filepath);
     if (itr != file_buffers.end()) {
       return itr->second;
     }
-    return std::string();
+    return empty;
   }
 
   bool add_inlined_file(const std::string& text, const std::vector<fs::path>& excluded_paths) {
@@ -362,13 +460,18 @@ class RootUnit::impl {
     cache.header_files.clear();
   }
 
-  ScanResult scan_files(const std::vector<fs::path>& excluded_paths) {
+  ScanResult scan_files(const std::vector<fs::path>& excluded_paths, ScanCache* scan_cache) {
     non_inlined_files.clear();
     inlined_files.clear();
     include_name_to_paths.clear();
+    declared_name_to_paths.clear();
 
-    const auto [non_inlined_paths, inlined_paths, include_name_to_paths_map, exceeded_max_files] =
-        find_files(path, excluded_paths, cache.source_files, cache.header_files);
+    const auto [non_inlined_paths,
+        inlined_paths,
+        include_name_to_paths_map,
+        declared_name_to_paths_map,
+        exceeded_max_files] =
+        find_files(path, excluded_paths, cache.source_files, cache.header_files, scan_cache);
 
     spdlog::info("Found {} non-inlined files (path: {})", non_inlined_paths.size(), path.string());
     for (const auto& path : non_inlined_paths)
@@ -384,6 +487,11 @@ class RootUnit::impl {
       for (const auto& path : paths)
         include_name_to_paths[name].insert(path);
 
+    for (const auto& [name, paths] : declared_name_to_paths_map)
+      for (const auto& path : paths)
+        if (!is_path_excluded(path, excluded_paths))
+          declared_name_to_paths[name].insert(path);
+
     return (exceeded_max_files ? ScanResult::ExceedsMaxFiles : ScanResult::Success);
   }
 
@@ -407,6 +515,10 @@ class RootUnit::impl {
     return include_name_to_paths;
   }
 
+  const std::map<std::string, std::set<fs::path>>& declared_name_to_paths_() const {
+    return declared_name_to_paths;
+  }
+
   const std::set<fs::path>& header_files_() const {
     return cache.header_files;
   }
@@ -417,6 +529,12 @@ class RootUnit::impl {
 
   void set_stale(bool stale) {
     this->stale = stale;
+    if (stale)
+      generation = next_generation();
+  }
+
+  uint64_t generation_() const {
+    return generation;
   }
 
   bool principal_() const {
@@ -430,9 +548,11 @@ class RootUnit::impl {
   std::vector<fs::path> non_inlined_files = {};
   std::vector<fs::path> inlined_files = {};
   std::map<std::string, std::set<fs::path>> include_name_to_paths = {};  // non-header files only
+  std::map<std::string, std::set<fs::path>> declared_name_to_paths = {};  // to non-inlined files
 
   bool stale = true;       // whether this needs a rescan
   bool principal = false;  // whether it contains the dot file
+  uint64_t generation = next_generation();  // see next_generation
                            //
   SourceFilesCache cache = {};
 };
@@ -444,16 +564,17 @@ RootUnitPtr RootUnit::create(const fs::path& path, bool principal) {
 RootUnit::RootUnit(const fs::path& path, bool principal)
     : p_impl(std::make_unique<impl>(path, principal)) {}
 
-ScanResult RootUnit::scan_files(const std::vector<fs::path>& excluded_paths) {
-  return p_impl->scan_files(excluded_paths);
+ScanResult RootUnit::scan_files(const std::vector<fs::path>& excluded_paths,
+    ScanCache* scan_cache) {
+  return p_impl->scan_files(excluded_paths, scan_cache);
 }
 
-std::string RootUnit::get_file_contents(const fs::path& filepath) {
+const std::string& RootUnit::get_file_contents(const fs::path& filepath) {
   return p_impl->get_file_contents(filepath);
 }
 
-void RootUnit::store_file_contents(const fs::path& filepath, const std::string& contents) {
-  p_impl->store_file_contents(filepath, contents);
+void RootUnit::store_file_contents(const fs::path& filepath, std::string contents) {
+  p_impl->store_file_contents(filepath, std::move(contents));
 }
 
 void RootUnit::clear_file_contents(const fs::path& filepath) {
@@ -489,6 +610,10 @@ const fs::path& RootUnit::path() const {
   return p_impl->path_();
 }
 
+const std::map<std::string, std::set<fs::path>>& RootUnit::declared_name_to_paths() const {
+  return p_impl->declared_name_to_paths_();
+}
+
 const std::set<fs::path>& RootUnit::header_files() const {
   return p_impl->header_files_();
 }
@@ -517,6 +642,10 @@ void RootUnit::set_stale(bool stale) {
   p_impl->set_stale(stale);
 }
 
+uint64_t RootUnit::generation() const {
+  return p_impl->generation_();
+}
+
 bool RootUnit::principal() const {
   return p_impl->principal_();
 }
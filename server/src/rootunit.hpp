@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 #include <map>
 #include <memory>
@@ -21,6 +22,8 @@ struct SourceFilesCache {
   std::set<fs::path> source_files = {};
 };
 
+class ScanCache;  // forward declaration
+
 class RootUnit;
 using RootUnitPtr = std::shared_ptr<RootUnit>;
 
@@ -40,15 +43,21 @@ class RootUnit {
   const std::vector<fs::path>& non_inlined_files() const;
   const std::vector<fs::path>& inlined_files() const;
   const std::map<std::string, std::set<fs::path>>& include_name_to_paths() const;
+  // The units and macros declared by its source files, to the non-inlined files compiling them.
+  const std::map<std::string, std::set<fs::path>>& declared_name_to_paths() const;
   const std::set<fs::path>& header_files() const;
   bool stale() const;
   bool principal() const;
   void set_stale(bool stale);
+  // Changes every time the unit is marked stale. Never the same for two units, even of one path.
+  uint64_t generation() const;
 
-  ScanResult scan_files(const std::vector<fs::path>& excluded_paths);
+  // `scan_cache`, if given, saves reading the files that did not change since the last scan.
+  ScanResult scan_files(
+      const std::vector<fs::path>& excluded_paths, ScanCache* scan_cache = nullptr);
 
-  std::string get_file_contents(const fs::path& filepath);
-  void store_file_contents(const fs::path& filepath, const std::string& contents);
+  const std::string& get_file_contents(const fs::path& filepath);
+  void store_file_contents(const fs::path& filepath, std::string contents);
   void clear_file_contents(const fs::path& filepath);
 
   bool add_inlined_file(const std::string& text, const std::vector<fs::path>& excluded_paths);
@@ -0,0 +1,142 @@
+#include "scancache.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <system_error>
+
+#include "nlohmann/json.hpp"
+#include "spdlog/spdlog.h"
+#include "utils.hpp"
+
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <unistd.h>  // for getpid()
+#endif
+
+namespace metalware {
+
+std::optional<FileStat> stat_file(const fs::path &path) {
+  std::error_code ec;
+  const auto mtime = fs::last_write_time(path, ec);
+  if (ec)
+    return std::nullopt;
+  const auto size = fs::file_size(path, ec);
+  if (ec)
+    return std::nullopt;
+  return FileStat{static_cast<int64_t>(mtime.time_since_epoch().count()), size};
+}
+
+ScanCache::ScanCache(fs::path file) : file_(std::move(file)) {
+  std::ifstream ifs(file_.value());
+  if (!ifs)
+    return;
+
+  try {
+    const auto cache = nlohmann::json::parse(ifs);
+    if (cache.value("version", 0) != VERSION) {
+      spdlog::info("Ignoring scan cache of another version: {}", file_->string());
+      return;
+    }
+
+    for (const auto &[path, entry] : cache.at("files").items()) {
+      entries_[path] = Entry{entry.at("mtime").get<int64_t>(),
+          entry.at("size").get<uintmax_t>(),
+          entry.at("hash").get<size_t>(),
+          {entry.at("includes").get<std::vector<std::string>>(),
+              entry.at("declares").get<std::vector<std::string>>()}};
+    }
+    spdlog::info("Loaded scan cache with {} files: {}", entries_.size(), file_->string());
+  } catch (const nlohmann::json::exception &e) {
+    spdlog::warn("Ignoring unreadable scan cache {}: {}", file_->string(), e.what());
+    entries_.clear();
+  }
+}
+
+std::optional<fs::path> ScanCache::default_location(const fs::path &root) {
+  fs::path dir;
+  if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg != '\0') {
+    dir = xdg;
+  } else if (const char *home = std::getenv("HOME"); home != nullptr && *home != '\0') {
+    dir = fs::path(home) / ".cache";
+  } else {
+    return std::nullopt;
+  }
+
+  const auto name = fmt::format("scan-{:016x}.json", std::hash<std::string>{}(root.string()));
+  return dir / "hdl-copilot" / name;
+}
+
+void ScanCache::invalidate(const fs::path &path) {
+  if (entries_.erase(path.string()) > 0)
+    dirty_ = true;
+}
+
+const SourceSummary *ScanCache::find(const fs::path &path, std::string_view text) {
+  const auto itr = entries_.find(path.string());
+  if (itr == entries_.end())
+    return nullptr;
+
+  // The modification time may not change with the text, e.g. within its resolution.
+  const auto stat = stat_file(path);
+  if (!stat.has_value() || stat->mtime != itr->second.mtime || stat->size != itr->second.size ||
+      utils::hash_text(text) != itr->second.hash)
+    return nullptr;
+
+  itr->second.used = true;
+  return &itr->second.summary;
+}
+
+const SourceSummary &ScanCache::store(
+    const fs::path &path, std::string_view text, SourceSummary summary) {
+  auto &entry = entries_[path.string()];
+  const auto stat = stat_file(path);
+  entry.mtime = stat.has_value() ? stat->mtime : -1;  // never matches, so it is read next time
+  entry.size = stat.has_value() ? stat->size : 0;
+  entry.hash = utils::hash_text(text);
+  entry.summary = std::move(summary);
+  entry.used = true;
+  dirty_ = true;
+  return entry.summary;
+}
+
+bool ScanCache::save() {
+  if (!file_.has_value() || !dirty_)
+    return true;
+
+  nlohmann::json files = nlohmann::json::object();
+  for (const auto &[path, entry] : entries_) {
+    if (!entry.used)
+      continue;  // files that were deleted or left the project
+    files[path] = {{"mtime", entry.mtime},
+        {"size", entry.size},
+        {"hash", entry.hash},
+        {"includes", entry.summary.include_names},
+        {"declares", entry.summary.declared_names}};
+  }
+
+  // Write to a temporary file first, so that a crash never leaves a truncated cache behind.
+  std::error_code ec;
+  fs::create_directories(file_->parent_path(), ec);
+  // Other servers may save the same cache at the same time.
+  const fs::path tmp = fmt::format(
+      "{}.{}-{:08x}.tmp", file_.value().string(), getpid(), std::random_device{}());
+  {
+    std::ofstream ofs(tmp);
+    if (!ofs) {
+      spdlog::warn("Failed to write scan cache: {}", tmp.string());
+      return false;
+    }
+    ofs << nlohmann::json{{"version", VERSION}, {"files", std::move(files)}}.dump();
+  }
+  fs::rename(tmp, file_.value(), ec);
+  if (ec) {
+    spdlog::warn("Failed to write scan cache {}: {}", file_->string(), ec.message());
+    return false;
+  }
+
+  dirty_ = false;
+  return true;
+}
+}  // namespace metalware
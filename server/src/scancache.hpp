@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace metalware {
+// What a scan finds out about a source file without parsing it. It is lexical and does not evaluate
+// `ifdef, so it does not depend on the defines.
+struct SourceSummary {
+  std::vector<std::string> include_names;   // of the files it `includes
+  std::vector<std::string> declared_names;  // see find_declared_names
+};
+
+// The modification time and size of a file, which ScanCache keys its entries on.
+struct FileStat {
+  int64_t mtime = 0;
+  uintmax_t size = 0;
+
+  bool operator==(const FileStat &) const = default;
+};
+
+// Null if the file is gone or cannot be read.
+[[nodiscard]] std::optional<FileStat> stat_file(const fs::path &path);
+
+// Remembers the summary of each source file, keyed by path, modification time, size and a hash of
+// the text, so that a rescan only scans the files that changed. It is kept as JSON under the user's
+// cache directory, so a restarted server does not have to scan them again either.
+class ScanCache {
+ public:
+  ScanCache() = default;  // in memory only
+
+  // Loads `file` if it exists and was written by this version of the cache.
+  explicit ScanCache(fs::path file);
+
+  // $XDG_CACHE_HOME/hdl-copilot (or ~/.cache/hdl-copilot) plus a name derived from `root`, or
+  // nullopt if there is no cache directory.
+  [[nodiscard]] static std::optional<fs::path> default_location(const fs::path &root);
+
+  // The summary stored for `path`, whose text is now `text`, or null if the file changed (or
+  // vanished) since.
+  [[nodiscard]] const SourceSummary *find(const fs::path &path, std::string_view text);
+  const SourceSummary &store(const fs::path &path, std::string_view text, SourceSummary summary);
+  // Drops the summary of `path`, e.g. once the editor saved it, as a save can keep the size and
+  // the modification time (within its resolution).
+  void invalidate(const fs::path &path);
+
+  // Writes the entries used in this session back to the file, if any changed.
+  bool save();
+
+  [[nodiscard]] size_t size() const {
+    return entries_.size();
+  }
+
+  static constexpr int VERSION = 2;
+
+ private:
+  struct Entry {
+    int64_t mtime = 0;
+    uintmax_t size = 0;
+    size_t hash = 0;  // of the text
+    SourceSummary summary;
+    bool used = false;  // looked up or stored in this session
+  };
+
+  std::optional<fs::path> file_;
+  std::unordered_map<std::string, Entry> entries_;
+  bool dirty_ = false;
+};
+}  // namespace metalware
@@ -5,6 +5,7 @@
 #include <vector>
 #include <filesystem>
 
+#include "jsonwriter.hpp"
 #include "nlohmann/json.hpp"
 #include "utils.hpp"
 
@@ -35,6 +36,10 @@ struct Position {
   [[nodiscard]] nlohmann::json to_json() const {
     return nlohmann::json{{"line", line}, {"character", character}};
   }
+
+  void write_json(JsonWriter &writer) const {
+    writer.begin_object().key("line").value(line).key("character").value(character).end_object();
+  }
 };
 
 struct Range {
@@ -44,6 +49,14 @@ struct Range {
   [[nodiscard]] nlohmann::json to_json() const {
     return nlohmann::json{{"start", start.to_json()}, {"end", end.to_json()}};
   }
+
+  void write_json(JsonWriter &writer) const {
+    writer.begin_object().key("start");
+    start.write_json(writer);
+    writer.key("end");
+    end.write_json(writer);
+    writer.end_object();
+  }
 };
 
 struct Location {
@@ -63,6 +76,7 @@ struct Diagnostic {
   DiagnosticSeverity severity = DiagnosticSeverity::Information;
   Range range;
   std::string name;
+  bool syntax = false;  // reported while parsing, so known before elaboration
 };
 
 }  // namespace metalware
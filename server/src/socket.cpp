@@ -0,0 +1,174 @@
+#include "socket.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "spdlog/spdlog.h"
+
+namespace metalware {
+
+namespace {
+constexpr std::string_view UNIX_PREFIX = "unix:";
+constexpr std::string_view TCP_PREFIX = "tcp:";
+constexpr int LISTEN_BACKLOG = 8;
+}  // namespace
+
+#if defined(_WIN32)
+bool wait_for_fd(int, bool) {
+  return false;
+}
+
+bool set_non_blocking(int) {
+  return false;
+}
+
+std::optional<SocketListener> SocketListener::create(std::string_view endpoint) {
+  spdlog::error("Listen mode is not supported on Windows: {}", endpoint);
+  return std::nullopt;
+}
+
+std::optional<int> SocketListener::accept_client() const {
+  return std::nullopt;
+}
+
+SocketListener::~SocketListener() = default;
+#else
+bool wait_for_fd(int fd, bool for_write) {
+  pollfd pfd{.fd = fd, .events = static_cast<short>(for_write ? POLLOUT : POLLIN), .revents = 0};
+  while (true) {
+    const int n = ::poll(&pfd, 1, -1);
+    if (n > 0) {
+      return true;
+    }
+    if (n < 0 && errno != EINTR) {
+      spdlog::error("Failed to poll descriptor {}: {}", fd, std::strerror(errno));
+      return false;
+    }
+  }
+}
+
+bool set_non_blocking(int fd) {
+  const int flags = ::fcntl(fd, F_GETFL, 0);
+  return flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+std::optional<SocketListener> SocketListener::create(std::string_view endpoint) {
+  int fd = -1;
+  std::string unix_path;
+
+  if (endpoint.starts_with(UNIX_PREFIX)) {
+    unix_path = std::string(endpoint.substr(UNIX_PREFIX.size()));
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (unix_path.empty() || unix_path.size() >= sizeof(addr.sun_path)) {
+      spdlog::error("Invalid unix socket path: {}", unix_path);
+      return std::nullopt;
+    }
+    std::memcpy(addr.sun_path, unix_path.c_str(), unix_path.size() + 1);
+
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(unix_path.c_str());  // Remove a stale socket left by a previous server.
+    if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+      spdlog::error("Failed to bind unix socket {}: {}", unix_path, std::strerror(errno));
+      if (fd >= 0)
+        ::close(fd);
+      return std::nullopt;
+    }
+  } else if (endpoint.starts_with(TCP_PREFIX)) {
+    const auto port_str = endpoint.substr(TCP_PREFIX.size());
+    uint16_t port = 0;
+    if (const auto [ptr, ec] =
+            std::from_chars(port_str.data(), port_str.data() + port_str.size(), port);
+        ec != std::errc() || ptr != port_str.data() + port_str.size()) {
+      spdlog::error("Invalid tcp port: {}", port_str);
+      return std::nullopt;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  // Never expose the server beyond this host.
+
+    fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    const int reuse = 1;
+    if (fd < 0 || ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        ::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+      spdlog::error("Failed to bind 127.0.0.1:{}: {}", port, std::strerror(errno));
+      if (fd >= 0)
+        ::close(fd);
+      return std::nullopt;
+    }
+  } else {
+    spdlog::error("Unknown listen endpoint (expected unix:<path> or tcp:<port>): {}", endpoint);
+    return std::nullopt;
+  }
+
+  if (::listen(fd, LISTEN_BACKLOG) != 0 || !set_non_blocking(fd)) {
+    spdlog::error("Failed to listen on {}: {}", endpoint, std::strerror(errno));
+    ::close(fd);
+    return std::nullopt;
+  }
+
+  spdlog::info("Listening on {}", endpoint);
+  return SocketListener(fd, std::string(endpoint), unix_path);
+}
+
+std::optional<int> SocketListener::accept_client() const {
+  while (true) {
+    const int client = ::accept(fd_, nullptr, nullptr);
+    if (client >= 0) {
+      if (!set_non_blocking(client)) {
+        spdlog::error("Failed to make client socket non-blocking: {}", std::strerror(errno));
+        ::close(client);
+        return std::nullopt;
+      }
+      return client;
+    }
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+      if (!wait_for_fd(fd_, /* for_write */ false)) {
+        return std::nullopt;
+      }
+      continue;
+    }
+
+    spdlog::error("Failed to accept client on {}: {}", endpoint_, std::strerror(errno));
+    return std::nullopt;
+  }
+}
+
+SocketListener::~SocketListener() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+    if (!unix_path_.empty()) {
+      ::unlink(unix_path_.c_str());
+    }
+  }
+}
+#endif
+
+SocketListener::SocketListener(int fd, std::string endpoint, std::string unix_path)
+    : fd_(fd), endpoint_(std::move(endpoint)), unix_path_(std::move(unix_path)) {}
+
+SocketListener::SocketListener(SocketListener &&other) noexcept
+    : fd_(other.fd_),
+      endpoint_(std::move(other.endpoint_)),
+      unix_path_(std::move(other.unix_path_)) {
+  other.fd_ = -1;
+}
+
+const std::string &SocketListener::endpoint() const {
+  return endpoint_;
+}
+}  // namespace metalware
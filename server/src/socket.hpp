@@ -0,0 +1,38 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace metalware {
+// Blocks until fd is readable (or writable). Used by the frame reader and output writer when a
+// non-blocking descriptor returns EAGAIN.
+bool wait_for_fd(int fd, bool for_write);
+
+bool set_non_blocking(int fd);
+
+// A listening socket for `--listen` mode. Endpoints are either "unix:<path>" for a Unix domain
+// socket or "tcp:<port>" for a socket bound to the loopback interface.
+class SocketListener {
+ public:
+  static std::optional<SocketListener> create(std::string_view endpoint);
+
+  SocketListener(SocketListener&& other) noexcept;
+  SocketListener& operator=(SocketListener&&) = delete;
+  SocketListener(SocketListener const&) = delete;
+  SocketListener& operator=(SocketListener const&) = delete;
+  ~SocketListener();
+
+  // Waits for the next client and returns its (non-blocking) descriptor.
+  [[nodiscard]] std::optional<int> accept_client() const;
+
+  [[nodiscard]] const std::string& endpoint() const;
+
+ private:
+  SocketListener(int fd, std::string endpoint, std::string unix_path);
+
+  int fd_;
+  std::string endpoint_;
+  std::string unix_path_;  // removed on destruction
+};
+}  // namespace metalware
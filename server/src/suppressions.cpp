@@ -0,0 +1,193 @@
+#include "suppressions.hpp"
+
+#include <limits>
+#include <type_traits>
+
+#include "syntaxtreecache.hpp"
+#include "utils.hpp"
+
+namespace metalware {
+
+std::optional<Suppression> Suppression::from_json(const nlohmann::json &json) {
+  if (json.is_string()) {
+    return Suppression{json.get<std::string>(), Scope::Project, {}};
+  }
+  if (!json.is_object() || !json.contains("name") || !json["name"].is_string()) {
+    return std::nullopt;
+  }
+
+  Suppression suppression{json["name"].get<std::string>(), Scope::Project, {}};
+  if (json.contains("path") && json["path"].is_string()) {
+    suppression.scope = Scope::Path;
+    suppression.pattern = json["path"].get<std::string>();
+  } else if (json.contains("glob") && json["glob"].is_string()) {
+    suppression.scope = Scope::Glob;
+    suppression.pattern = json["glob"].get<std::string>();
+  }
+  return suppression;
+}
+
+nlohmann::json Suppression::to_json() const {
+  switch (scope) {
+    case Scope::Path:
+      return {{"name", name}, {"path", pattern}};
+    case Scope::Glob:
+      return {{"name", name}, {"glob", pattern}};
+    default:
+      return name;
+  }
+}
+
+bool glob_match(std::string_view glob, std::string_view path) {
+  while (!glob.empty()) {
+    if (glob.starts_with("**")) {
+      glob.remove_prefix(2);
+      // "**/" also matches no directory at all.
+      if (glob.starts_with('/') && glob_match(glob.substr(1), path)) {
+        return true;
+      }
+      for (size_t i = 0; i <= path.size(); i++) {
+        if (glob_match(glob, path.substr(i))) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    if (glob.front() == '*') {
+      glob.remove_prefix(1);
+      for (size_t i = 0; i <= path.size(); i++) {
+        if (glob_match(glob, path.substr(i))) {
+          return true;
+        }
+        if (i < path.size() && path[i] == '/') {
+          break;
+        }
+      }
+      return false;
+    }
+
+    const bool matches =
+        !path.empty() && (glob.front() == '?' ? path.front() != '/' : glob.front() == path.front());
+    if (!matches) {
+      return false;
+    }
+    glob.remove_prefix(1);
+    path.remove_prefix(1);
+  }
+  return path.empty();
+}
+
+SuppressionIndex::SuppressionIndex(const std::vector<Suppression> &suppressions,
+    const fs::path &root)
+    : root_(root) {
+  for (const auto &suppression : suppressions) {
+    fingerprint_ = utils::hash_combine(fingerprint_, utils::hash_text(suppression.name));
+    fingerprint_ = utils::hash_combine(fingerprint_, static_cast<size_t>(suppression.scope));
+    fingerprint_ = utils::hash_combine(fingerprint_, utils::hash_text(suppression.pattern));
+
+    Scope scope{suppression.scope, {}, suppression.pattern};
+    if (scope.kind == Suppression::Scope::Path) {
+      scope.path = (root / suppression.pattern).lexically_normal();
+      if (!scope.path.has_filename())  // a trailing separator
+        scope.path = scope.path.parent_path();
+    }
+    scopes_by_name_[suppression.name].push_back(std::move(scope));
+  }
+}
+
+bool SuppressionIndex::suppresses(std::string_view name, const fs::path &path) const {
+  const auto itr = scopes_by_name_.find(std::string(name));
+  if (itr == scopes_by_name_.end()) {
+    return false;
+  }
+
+  for (const auto &scope : itr->second) {
+    switch (scope.kind) {
+      case Suppression::Scope::Project:
+        return true;
+      case Suppression::Scope::Path:
+        if (utils::is_path_part_of_path(path, scope.path)) {
+          return true;
+        }
+        break;
+      case Suppression::Scope::Glob: {
+        // Relative to the project, unless the file is outside of it.
+        const auto relative = path.lexically_relative(root_);
+        const bool inside = !relative.empty() && *relative.begin() != "..";
+        if (glob_match(scope.pattern, (inside ? relative : path).generic_string())) {
+          return true;
+        }
+        break;
+      }
+    }
+  }
+  return false;
+}
+
+SuppressionMatcher::SuppressionMatcher(const SuppressionIndex *index,
+    const slang::SourceManager &sm)
+    : index_(index), sm_(sm) {}
+
+SuppressionMatcher::FileId SuppressionMatcher::file_id(slang::BufferID buffer) {
+  const auto [itr, inserted] = file_ids_.try_emplace(buffer.getId(), 0);
+  if (!inserted) {
+    return itr->second;
+  }
+
+  auto path = SyntaxTreeCache::source_path(sm_, buffer);
+  const auto [interned, added] =
+      interned_.try_emplace(path.string(), static_cast<FileId>(paths_.size()));
+  if (added) {
+    paths_.push_back(std::move(path));
+  }
+  itr->second = interned->second;
+  return itr->second;
+}
+
+void SuppressionMatcher::suppress_line(const slang::Diagnostic &diag) {
+  lines_.insert(
+      {code_key(diag.code), file_id(diag.location.buffer()), sm_.getLineNumber(diag.location)});
+}
+
+void SuppressionMatcher::suppress_file(const slang::Diagnostic &diag) {
+  files_.insert(file_key(code_key(diag.code), file_id(diag.location.buffer())));
+}
+
+bool SuppressionMatcher::suppressed(const slang::Diagnostic &diag, FileId file, size_t line) {
+  const CodeKey code = code_key(diag.code);
+  if (lines_.contains({code, file, line})) {
+    return true;
+  }
+
+  const uint64_t key = file_key(code, file);
+  if (files_.contains(key)) {
+    return true;
+  }
+
+  if (index_ == nullptr) {
+    return false;
+  }
+  const auto [itr, inserted] = project_verdicts_.try_emplace(key, false);
+  if (inserted) {
+    itr->second = index_->suppresses(slang::toString(diag.code), paths_[file]);
+  }
+  return itr->second;
+}
+
+size_t SuppressionMatcher::LineKeyHash::operator()(const LineKey &key) const {
+  return utils::hash_combine(file_key(key.code, key.file), key.line);
+}
+
+SuppressionMatcher::CodeKey SuppressionMatcher::code_key(slang::DiagCode code) {
+  // The subsystem above the code, each as wide as slang makes it.
+  using Subsystem = std::underlying_type_t<slang::DiagSubsystem>;
+  using Code = decltype(code.getCode());
+  constexpr int CODE_BITS = std::numeric_limits<Code>::digits;
+  static_assert(std::is_unsigned_v<Subsystem> && std::is_unsigned_v<Code> &&
+                    std::numeric_limits<Subsystem>::digits + CODE_BITS <=
+                        std::numeric_limits<CodeKey>::digits,
+      "a DiagCode no longer fits into a CodeKey");
+  return static_cast<CodeKey>(code.getSubsystem()) << CODE_BITS | code.getCode();
+}
+}  // namespace metalware
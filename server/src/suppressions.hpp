@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+#include "slang/diagnostics/Diagnostics.h"
+#include "slang/text/SourceManager.h"
+
+namespace fs = std::filesystem;
+
+namespace metalware {
+// A project suppression from the dotfile's "projectSuppressions": a diagnostic name, either on its
+// own for the whole project or as {"name": ..., "path": ...} for a directory or file, or
+// {"name": ..., "glob": ...} for the files matching a pattern. Both are relative to the project.
+struct Suppression {
+  enum class Scope { Project, Path, Glob };
+
+  std::string name;
+  Scope scope = Scope::Project;
+  std::string pattern;  // the path or glob
+
+  [[nodiscard]] static std::optional<Suppression> from_json(const nlohmann::json &json);
+  [[nodiscard]] nlohmann::json to_json() const;
+};
+
+// Whether `path` (with '/' separators) matches `glob`, where `*` and `?` match within a path
+// component and `**` across components.
+[[nodiscard]] bool glob_match(std::string_view glob, std::string_view path);
+
+// The project suppressions, compiled once per dotfile load. It is immutable, so compilations on
+// any thread share it; SuppressionMatcher does the lookups of one pass.
+class SuppressionIndex {
+ public:
+  SuppressionIndex(const std::vector<Suppression> &suppressions, const fs::path &root);
+
+  // The slow path, taken once per pass for each diagnostic name and file.
+  [[nodiscard]] bool suppresses(std::string_view name, const fs::path &path) const;
+
+  [[nodiscard]] size_t fingerprint() const {
+    return fingerprint_;
+  }
+
+ private:
+  struct Scope {
+    Suppression::Scope kind;
+    fs::path path;        // absolute, for Path
+    std::string pattern;  // for Glob
+  };
+
+  fs::path root_;
+  std::unordered_map<std::string, std::vector<Scope>> scopes_by_name_;
+  size_t fingerprint_ = 0;
+};
+
+// The suppressions in effect for one pass over the diagnostics of a compilation: those of the
+// project and those of suppression comments in the sources. Everything is keyed by integers, so
+// that filtering a diagnostic costs a few hash probes: its code, the id of its file (interned per
+// buffer) and its line.
+class SuppressionMatcher {
+ public:
+  // `index` may be null, for no project suppressions.
+  SuppressionMatcher(const SuppressionIndex *index, const slang::SourceManager &sm);
+
+  using FileId = uint32_t;
+
+  // Interns the file of `buffer`, see SyntaxTreeCache::source_path.
+  [[nodiscard]] FileId file_id(slang::BufferID buffer);
+  [[nodiscard]] const fs::path &path(FileId file) const {
+    return paths_[file];
+  }
+
+  // Suppresses the code of `diag` on its line, or in its whole file.
+  void suppress_line(const slang::Diagnostic &diag);
+  void suppress_file(const slang::Diagnostic &diag);
+
+  [[nodiscard]] bool suppressed(const slang::Diagnostic &diag, FileId file, size_t line);
+
+ private:
+  using CodeKey = uint32_t;
+
+  struct LineKey {
+    CodeKey code;
+    FileId file;
+    size_t line;
+
+    bool operator==(const LineKey &) const = default;
+  };
+
+  struct LineKeyHash {
+    size_t operator()(const LineKey &key) const;
+  };
+
+  static CodeKey code_key(slang::DiagCode code);
+  static uint64_t file_key(CodeKey code, FileId file) {
+    return static_cast<uint64_t>(code) << 32 | file;
+  }
+
+  const SuppressionIndex *index_;
+  const slang::SourceManager &sm_;
+
+  std::unordered_map<uint32_t, FileId> file_ids_;  // by buffer id
+  std::unordered_map<std::string, FileId> interned_;
+  std::vector<fs::path> paths_;
+
+  std::unordered_set<LineKey, LineKeyHash> lines_;
+  std::unordered_set<uint64_t> files_;                 // file_key of suppression comments
+  std::unordered_map<uint64_t, bool> project_verdicts_;  // by file_key
+};
+}  // namespace metalware
@@ -0,0 +1,892 @@
+#include "syntaxtreecache.hpp"
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <unordered_set>
+
+#include "metrics.hpp"
+#include "slang/parsing/Token.h"
+#include "slang/syntax/SyntaxPrinter.h"
+#include "slang/util/Bag.h"
+#include "spdlog/spdlog.h"
+#include "utils.hpp"
+
+namespace metalware {
+
+namespace {
+// Appended to the path of an edited target file, followed by its version number.
+constexpr std::string_view VERSION_SEPARATOR = "#hdl-version-";
+constexpr std::string_view DEFINES_PREFIX = "<hdl-defines-";
+constexpr std::string_view INHERITED_PREFIX = "<hdl-inherited-";
+
+using utils::hash_combine;
+using utils::hash_text;
+
+size_t hash_include_dirs(const std::vector<fs::path> &include_dirs) {
+  size_t seed = include_dirs.size();
+  for (const auto &dir : include_dirs)
+    seed = hash_combine(seed, hash_text(dir.string()));
+  return seed;
+}
+
+// Adds the identifiers and macro names in `node` to `names`. For a directive this is a superset of
+// the macros it tests or expands: the directive keyword and macro arguments come along.
+void collect_names(const slang::syntax::SyntaxNode &node, std::unordered_set<std::string> &names) {
+  using slang::parsing::TokenKind;
+  for (size_t i = 0; i < node.getChildCount(); i++) {
+    if (const auto *child = node.childNode(i)) {
+      collect_names(*child, names);
+      continue;
+    }
+    const auto token = node.childToken(i);
+    if (token.kind == TokenKind::Identifier) {
+      names.emplace(token.valueText());
+    } else if (token.kind == TokenKind::Directive && token.rawText().starts_with('`')) {
+      names.emplace(token.rawText().substr(1));
+    }
+  }
+}
+
+void collect_directive_names(const slang::syntax::SyntaxNode &node,
+    slang::BufferID prefix,
+    std::unordered_set<std::string> &names) {
+  for (size_t i = 0; i < node.getChildCount(); i++) {
+    if (const auto *child = node.childNode(i)) {
+      collect_directive_names(*child, prefix, names);
+      continue;
+    }
+    for (const auto &trivia : node.childToken(i).trivia()) {
+      if (trivia.kind == slang::parsing::TriviaKind::Directive && trivia.syntax() &&
+          trivia.syntax()->sourceRange().start().buffer() != prefix) {
+        collect_names(*trivia.syntax(), names);
+      }
+    }
+  }
+}
+
+// The macros a tree tests, expands or defines, in its own text or in the files it includes, and the
+// other directives it has. Macros used only by the bodies of other macros are not listed; see
+// SyntaxTreeCache::apply_defines. `prefix` is what the tree inherited.
+std::vector<std::string> collect_macro_names(
+    const slang::syntax::SyntaxTree &tree, slang::BufferID prefix) {
+  std::unordered_set<std::string> names;
+  collect_directive_names(tree.root(), prefix, names);
+  std::vector<std::string> sorted(names.begin(), names.end());
+  std::sort(sorted.begin(), sorted.end());
+  return sorted;
+}
+
+// The names whose definition differs between two define lists; the last definition counts.
+std::unordered_set<std::string> changed_macros(
+    const std::vector<std::string> &before, const std::vector<std::string> &after) {
+  const auto by_name = [](const std::vector<std::string> &defines) {
+    std::unordered_map<std::string_view, std::string_view> result;
+    for (std::string_view define : defines)
+      result[define.substr(0, define.find('='))] = define;
+    return result;
+  };
+  const auto old_defines = by_name(before);
+  const auto new_defines = by_name(after);
+
+  std::unordered_set<std::string> changed;
+  for (const auto &[name, define] : old_defines) {
+    const auto itr = new_defines.find(name);
+    if (itr == new_defines.end() || itr->second != define)
+      changed.emplace(name);
+  }
+  for (const auto &[name, define] : new_defines) {
+    if (!old_defines.contains(name))
+      changed.emplace(name);
+  }
+  return changed;
+}
+
+template <typename Names>
+bool uses_any(const Names &names, const std::unordered_set<std::string> &macros) {
+  return std::any_of(names.begin(), names.end(), [&macros](const std::string &name) {
+    return macros.contains(name);
+  });
+}
+
+// Whether parsing `text` may change what later files inherit: the macro table or the directives
+// (see find_directives). Included files may change them too. Only a guess, so that such files are
+// parsed before the files after them; whether they did is checked after the parse.
+bool may_change_inherited(std::string_view text) {
+  return text.find("`define") != std::string_view::npos ||
+         text.find("`undef") != std::string_view::npos ||
+         text.find("`include") != std::string_view::npos ||
+         text.find("`timescale") != std::string_view::npos ||
+         text.find("`default_nettype") != std::string_view::npos ||
+         text.find("`resetall") != std::string_view::npos;
+}
+
+// The text of a directive, rebuilt from its tokens without the comments around them.
+void directive_text(const slang::syntax::SyntaxNode &node, std::string &text) {
+  for (size_t i = 0; i < node.getChildCount(); i++) {
+    if (const auto *child = node.childNode(i)) {
+      directive_text(*child, text);
+      continue;
+    }
+    const auto raw = node.childToken(i).rawText();
+    if (!raw.empty())
+      text += text.empty() ? std::string(raw) : " " + std::string(raw);
+  }
+}
+
+struct Directives {
+  std::string timescale;
+  std::string default_nettype;
+};
+
+void find_directives(const slang::syntax::SyntaxNode &node, Directives &directives) {
+  for (size_t i = 0; i < node.getChildCount(); i++) {
+    if (const auto *child = node.childNode(i)) {
+      find_directives(*child, directives);
+      continue;
+    }
+    for (const auto &trivia : node.childToken(i).trivia()) {
+      if (trivia.kind != slang::parsing::TriviaKind::Directive || !trivia.syntax())
+        continue;
+      std::string text;
+      directive_text(*trivia.syntax(), text);
+      if (text.starts_with("`timescale")) {
+        directives.timescale = std::move(text);
+      } else if (text.starts_with("`default_nettype")) {
+        directives.default_nettype = std::move(text);
+      } else if (text.starts_with("`resetall")) {
+        directives = {};
+      }
+    }
+  }
+}
+
+// The `timescale and `default_nettype in effect at the end of `tree`, as the text of the
+// directives that set them. A tree parsed after its prefix starts from what it inherited.
+std::string find_directives(const slang::syntax::SyntaxTree &tree) {
+  Directives directives;
+  find_directives(tree.root(), directives);
+  std::string text;
+  for (const auto *directive : {&directives.timescale, &directives.default_nettype}) {
+    if (!directive->empty())
+      text += *directive + '\n';
+  }
+  return text;
+}
+
+// Whether a member belongs to $unit. Bind directives name nothing that other files could use.
+bool in_unit(const slang::syntax::SyntaxNode &member) {
+  using slang::syntax::SyntaxKind;
+  switch (member.kind) {
+    case SyntaxKind::ModuleDeclaration:
+    case SyntaxKind::InterfaceDeclaration:
+    case SyntaxKind::ProgramDeclaration:
+    case SyntaxKind::PackageDeclaration:
+    case SyntaxKind::UdpDeclaration:
+    case SyntaxKind::ConfigDeclaration:
+    case SyntaxKind::EmptyMember:
+    case SyntaxKind::BindDirective:
+      return false;
+    default:
+      return true;
+  }
+}
+
+// The members of `tree` in $unit, other than those it inherited in `prefix`.
+std::vector<const slang::syntax::SyntaxNode *> unit_members(
+    const slang::syntax::SyntaxTree &tree, slang::BufferID prefix) {
+  std::vector<const slang::syntax::SyntaxNode *> result;
+  const auto *members = tree.root().childNode(0);
+  if (!members)
+    return result;
+  for (size_t i = 0; i < members->getChildCount(); i++) {
+    const auto *member = members->childNode(i);
+    if (member && in_unit(*member) && member->sourceRange().start().buffer() != prefix)
+      result.push_back(member);
+  }
+  return result;
+}
+
+// The $unit declarations of `tree` as text that parses the same without the macros and includes
+// they came from.
+std::string unit_text(const slang::syntax::SyntaxTree &tree, slang::BufferID prefix) {
+  std::string text;
+  for (const auto *member : unit_members(tree, prefix)) {
+    text += slang::syntax::SyntaxPrinter()
+                .setIncludeDirectives(false)
+                .setIncludeComments(false)
+                .setIncludeSkipped(false)
+                .setIncludePreprocessed(true)
+                .print(*member)
+                .str();
+    text += '\n';
+  }
+  return text;
+}
+
+// Whether a file parsed with `macros` may pass on something else than it inherited. Cheap enough
+// for every file; SyntaxTreeCache::pass_on tells for sure.
+bool may_pass_on_changes(const slang::syntax::SyntaxTree &tree,
+    slang::BufferID prefix,
+    const std::vector<const slang::syntax::DefineDirectiveSyntax *> &macros,
+    const std::vector<std::string> &macro_names) {
+  for (const char *directive : {"timescale", "default_nettype", "resetall"}) {
+    if (std::binary_search(macro_names.begin(), macro_names.end(), directive))
+      return true;
+  }
+  if (!unit_members(tree, prefix).empty())
+    return true;
+  // The macros come out of a hash map; see SyntaxTreeCache::inherit for the order of `macros`.
+  auto defined = tree.getDefinedMacros();
+  if (defined.size() != macros.size())
+    return true;
+  std::sort(defined.begin(), defined.end());
+  return !std::equal(defined.begin(), defined.end(), macros.begin());
+}
+
+// Parses `buffer` after `prefix`, what it inherited, if there is one.
+std::shared_ptr<slang::syntax::SyntaxTree> parse_buffer(const slang::SourceBuffer &prefix,
+    const slang::SourceBuffer &buffer,
+    slang::SourceManager &sm,
+    const slang::Bag &bag,
+    slang::syntax::MacroList macros) {
+  if (!prefix)
+    return slang::syntax::SyntaxTree::fromBuffer(buffer, sm, bag, macros);
+  const std::array<slang::SourceBuffer, 2> buffers = {prefix, buffer};
+  return slang::syntax::SyntaxTree::fromBuffers(buffers, sm, bag, macros);
+}
+
+std::optional<std::string> read_file(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return std::nullopt;
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+}  // namespace
+
+nonstd::expected<ParsedSources, std::string> SyntaxTreeCache::parse(
+    const std::vector<std::pair<fs::path, std::string>> &buffers,
+    const std::vector<fs::path> &include_dirs,
+    const std::vector<std::string> &target_files,
+    const std::vector<LibraryInputs> &libraries,
+    const std::vector<std::string> &defines,
+    const CancellationToken &cancellation,
+    bool subset) {
+  if (target_files.empty()) {
+    spdlog::error("No target files found for compilation");
+    return nonstd::make_unexpected("No target files found for compilation");
+  }
+
+  std::lock_guard lock(mutex_);
+
+  std::unordered_map<std::string, std::string_view> open_buffers;
+  for (const auto &[fp, buff] : buffers)
+    open_buffers.emplace(fp.string(), buff);
+
+  std::unordered_set<std::string> invalidated;
+  bool all_invalidated = false;
+  {
+    std::lock_guard invalidated_lock(invalidated_mutex_);
+    invalidated.swap(invalidated_);
+    std::swap(all_invalidated, all_invalidated_);
+  }
+  const auto is_invalidated = [&](const std::string &path) {
+    return all_invalidated || invalidated.contains(path);
+  };
+  // Unless the parse completes, the invalidations apply to the next one too.
+  const auto restore_invalidated = [&] {
+    std::lock_guard invalidated_lock(invalidated_mutex_);
+    invalidated_.merge(invalidated);
+    all_invalidated_ = all_invalidated_ || all_invalidated;
+  };
+
+  const size_t include_dirs_hash = hash_include_dirs(include_dirs);
+  if (!source_manager_ || include_dirs_hash != include_dirs_hash_ ||
+      superseded_bytes_ > MAX_SUPERSEDED_BYTES ||
+      headers_changed(open_buffers, invalidated, all_invalidated)) {
+    reset(include_dirs_hash, include_dirs);
+  }
+  if (!defines_tree_ || defines != defines_)
+    apply_defines(defines);
+
+  // Other open buffers are only read through `include, which looks them up by path, so they must
+  // be in place before anything is parsed.
+  const std::unordered_set<std::string_view> targets(target_files.begin(), target_files.end());
+  for (const auto &[path, text] : open_buffers) {
+    if (targets.contains(path) || source_manager_->isCached(path))
+      continue;
+    spdlog::debug("Caching buffered file to source manager: {}", path);
+    const auto _ = source_manager_->assignText(path, text, {}, source_library_.get());
+    headers_[path] = hash_text(text);
+  }
+
+  const slang::Bag bag;
+
+  // A parse of a file that passed on what it inherited last time, or has new text that does not
+  // look like it changes it (see may_change_inherited).
+  struct Job {
+    Entry *entry;
+    InheritedPtr inherited;
+    const MacroTable *macros;
+    bool changes_inherited = false;  // see may_pass_on_changes
+  };
+
+  // Libraries whose snapshot could not be reused, to be snapshotted once their jobs are done.
+  struct LibraryParse {
+    const LibraryInputs *library;
+    size_t begin;
+    InheritedPtr inherited;
+    InheritedPtr passes_on;
+  };
+
+  // Files that change what later files inherit are parsed here, one after the other, since each
+  // inherits from the ones before. Files that do not, which is most of them, are parsed in parallel
+  // afterwards. A file found to change it after all is parsed again along with the files after it.
+  std::vector<const std::shared_ptr<slang::syntax::SyntaxTree> *> ordered;
+  std::vector<std::string_view> texts;
+  std::vector<Job> jobs;
+  std::deque<MacroTable> macro_tables;  // stable addresses for the jobs
+  std::deque<std::shared_ptr<slang::syntax::SyntaxTree>> subset_trees;  // and for `ordered`
+  std::vector<LibraryParse> library_parses;
+  // Edits to a frozen library apply once its root unit goes stale.
+  std::unordered_set<std::string> deferred;
+  std::unordered_set<const Entry *> parsed_entries;
+  std::unordered_set<std::string> loaded;  // by an earlier round of this parse
+  int64_t reads = 0;
+  size_t parsed_in_parallel = 0;
+
+  InheritedPtr inherited;
+  const MacroTable *macros = nullptr;
+  const auto inherited_macros = [&]() -> const MacroTable * {
+    if (!macros)
+      macros = &macro_tables.emplace_back(inherit(*inherited));
+    return macros;
+  };
+  const auto set_inherited = [&](const InheritedPtr &next) {
+    if (next != inherited) {
+      inherited = next;
+      macros = nullptr;
+    }
+  };
+
+  // Returns an error message on failure.
+  const auto parse_file = [&](const std::string &path) -> std::optional<std::string> {
+    if (cancellation.is_cancelled()) {
+      return "Compilation cancelled";
+    }
+
+    auto &entry = entries_[path];
+    ordered.push_back(&entry.tree);
+    std::optional<std::string> disk_text;
+    std::string_view text;
+    if (entry.buffer && (!is_invalidated(path) || loaded.contains(path))) {
+      text = entry.buffer.data;
+    } else if (const auto itr = open_buffers.find(path); itr != open_buffers.end()) {
+      text = itr->second;
+    } else if (disk_text = read_file(path); disk_text.has_value()) {
+      reads++;
+      text = disk_text.value();
+    } else {
+      spdlog::error("Failed to read target file: {}", path);
+      return "Failed to add syntax tree for target files";
+    }
+    loaded.insert(path);
+
+    if (!entry.buffer || entry.buffer.data != text) {
+      entry.buffer = assign(path, text, entry);
+      entry.changes_inherited = entry.changes_inherited || may_change_inherited(text);
+      entry.tree = nullptr;
+    }
+    texts.push_back(entry.buffer.data);
+
+    if (entry.tree && same(entry.inherited, inherited)) {
+      // Reused.
+    } else if (subset && entry.tree) {
+      // The files left out may change what this one inherits. The tree the full parses reuse is
+      // kept, and this one only lives as long as the compilation.
+      const auto &table = *inherited_macros();
+      auto &tree = subset_trees.emplace_back(
+          parse_buffer(inherited->prefix, entry.buffer, *source_manager_, bag, table));
+      ordered.back() = &tree;
+      parsed_entries.insert(&entry);
+      record_includes(*tree);
+      set_inherited(pass_on(tree, inherited, table, nullptr));
+      return std::nullopt;
+    } else if (entry.changes_inherited) {
+      parse_entry(entry, inherited, *inherited_macros(), bag);
+      parsed_entries.insert(&entry);
+    } else {
+      entry.tree = nullptr;  // so that a cancelled job is not mistaken for a hit later
+      jobs.push_back({&entry, inherited, inherited_macros()});
+    }
+
+    if (entry.tree && entry.changes_inherited)
+      set_inherited(entry.passes_on);
+    return std::nullopt;
+  };
+
+  const auto parse_job = [&](size_t i) {
+    if (cancellation.is_cancelled())
+      return;
+    auto &job = jobs[i];
+    auto tree = parse_buffer(
+        job.inherited->prefix, job.entry->buffer, *source_manager_, bag, *job.macros);
+    job.entry->macro_names = collect_macro_names(*tree, job.inherited->prefix.id);
+    job.changes_inherited =
+        may_pass_on_changes(*tree, job.inherited->prefix.id, *job.macros, job.entry->macro_names);
+    job.entry->inherited = job.inherited;
+    job.entry->passes_on = job.inherited;
+    job.entry->tree = std::move(tree);
+  };
+
+  for (bool again = true; again;) {
+    again = false;
+    ordered.clear();
+    ordered.reserve(target_files.size());
+    texts.clear();
+    texts.reserve(target_files.size());
+    jobs.clear();
+    subset_trees.clear();
+    library_parses.clear();
+    set_inherited(root_);
+
+    size_t begin = 0;
+    for (const auto &library : libraries) {
+      // After invalidate_all(), the files may have changed outside the editor, libraries included.
+      const auto snapshot = libraries_.find(library.root.string());
+      if (!all_invalidated && snapshot != libraries_.end() &&
+          snapshot->second.generation == library.generation &&
+          same(snapshot->second.inherited, inherited) &&
+          snapshot->second.trees.size() == library.file_count) {
+        for (const auto &tree : snapshot->second.trees)
+          ordered.push_back(&tree);
+        texts.resize(texts.size() + library.file_count);
+        for (size_t i = begin; i < begin + library.file_count; i++) {
+          if (invalidated.contains(target_files[i]))
+            deferred.insert(target_files[i]);
+        }
+        set_inherited(snapshot->second.passes_on);
+      } else {
+        LibraryParse parse{&library, begin, inherited, nullptr};
+        for (size_t i = begin; i < begin + library.file_count; i++) {
+          if (auto error = parse_file(target_files[i]); error.has_value()) {
+            restore_invalidated();
+            return nonstd::make_unexpected(std::move(error.value()));
+          }
+        }
+        parse.passes_on = inherited;
+        library_parses.push_back(std::move(parse));
+      }
+      begin += library.file_count;
+    }
+
+    for (size_t i = begin; i < target_files.size(); i++) {
+      if (auto error = parse_file(target_files[i]); error.has_value()) {
+        restore_invalidated();
+        return nonstd::make_unexpected(std::move(error.value()));
+      }
+    }
+
+    // The trees of jobs that did not finish stay null, so they are parsed again next time.
+    try {
+      workers_.run(jobs.size(), parse_job);
+    } catch (const std::exception &e) {
+      spdlog::error("Failed to parse target files: {}", e.what());
+      restore_invalidated();
+      return nonstd::make_unexpected(std::string("Failed to parse target files: ") + e.what());
+    }
+
+    if (cancellation.is_cancelled()) {
+      restore_invalidated();
+      return nonstd::make_unexpected("Compilation cancelled");
+    }
+
+    parsed_in_parallel += jobs.size();
+    for (auto &job : jobs) {
+      auto &entry = *job.entry;
+      parsed_entries.insert(&entry);
+      record_includes(*entry.tree);
+      if (!job.changes_inherited)
+        continue;
+      entry.passes_on = pass_on(entry.tree, job.inherited, *job.macros, nullptr);
+      entry.changes_inherited = entry.passes_on != job.inherited;
+      // The files after it were parsed with what it inherited instead.
+      again = again || entry.changes_inherited;
+    }
+    if (again)
+      metrics::counter("syntax_tree_cache_reparses").add();
+  }
+
+  ParsedSources parsed{source_manager_, source_library_, {}, std::move(texts)};
+  parsed.trees.reserve(ordered.size());
+  for (const auto *tree : ordered)
+    parsed.trees.push_back(*tree);
+
+  for (auto &parse : library_parses) {
+    auto &snapshot = libraries_[parse.library->root.string()];
+    snapshot.generation = parse.library->generation;
+    snapshot.inherited = std::move(parse.inherited);
+    snapshot.trees.assign(parsed.trees.begin() + static_cast<ptrdiff_t>(parse.begin),
+        parsed.trees.begin() + static_cast<ptrdiff_t>(parse.begin + parse.library->file_count));
+    snapshot.passes_on = std::move(parse.passes_on);
+    snapshot.macro_names.clear();
+    for (size_t i = parse.begin; i < parse.begin + parse.library->file_count; i++) {
+      const auto &names = entries_[target_files[i]].macro_names;
+      snapshot.macro_names.insert(names.begin(), names.end());
+    }
+  }
+  metrics::counter("library_snapshot_hits").add(
+      static_cast<int64_t>(libraries.size() - library_parses.size()));
+  metrics::counter("library_snapshot_misses").add(static_cast<int64_t>(library_parses.size()));
+
+  if (!deferred.empty()) {
+    std::lock_guard invalidated_lock(invalidated_mutex_);
+    invalidated_.merge(deferred);
+  }
+  if (subset) {
+    // The files left out still have to see the invalidations when they are parsed next.
+    std::lock_guard invalidated_lock(invalidated_mutex_);
+    for (const auto &path : invalidated) {
+      if (!targets.contains(path))
+        invalidated_.insert(path);
+    }
+    all_invalidated_ = all_invalidated_ || all_invalidated;
+  } else {
+    std::erase_if(libraries_, [&libraries](const auto &item) {
+      return std::none_of(libraries.begin(), libraries.end(), [&item](const auto &library) {
+        return library.root.string() == item.first;
+      });
+    });
+
+    // Forget files that are no longer compiled.
+    std::erase_if(entries_, [&targets](const auto &item) {
+      return !targets.contains(item.first);
+    });
+  }
+
+  const auto misses = static_cast<int64_t>(parsed_entries.size());
+  const auto hits = static_cast<int64_t>(target_files.size()) - misses;
+  metrics::counter("syntax_tree_cache_hits").add(hits);
+  metrics::counter("syntax_tree_cache_misses").add(misses);
+  metrics::counter("source_file_reads").add(reads);
+  spdlog::info("Syntax tree cache: {} reused, {} parsed ({} in parallel)",
+      hits,
+      misses,
+      parsed_in_parallel);
+  return parsed;
+}
+
+std::shared_ptr<slang::syntax::SyntaxTree> SyntaxTreeCache::parse_edited(
+    const fs::path &path, std::string_view text) {
+  std::lock_guard lock(mutex_);
+  const auto itr = entries_.find(path.string());
+  if (itr == entries_.end() || !itr->second.tree)
+    return nullptr;
+
+  auto &entry = itr->second;
+  if (entry.buffer.data == text)
+    return entry.tree;
+
+  entry.buffer = assign(itr->first, text, entry);
+  const auto inherited = entry.inherited;
+  parse_entry(entry, inherited, inherit(*inherited), {});
+  return entry.tree;
+}
+
+// Parses a file with what it inherits and tells what it passes on.
+void SyntaxTreeCache::parse_entry(Entry &entry,
+    const InheritedPtr &inherited,
+    const MacroTable &macros,
+    const slang::Bag &bag) {
+  auto tree = parse_buffer(inherited->prefix, entry.buffer, *source_manager_, bag, macros);
+  entry.macro_names = collect_macro_names(*tree, inherited->prefix.id);
+  entry.passes_on = pass_on(tree, inherited, macros, entry.passes_on);
+  entry.changes_inherited = entry.passes_on != inherited;
+  entry.inherited = inherited;
+  record_includes(*tree);
+  entry.tree = std::move(tree);
+}
+
+fs::path SyntaxTreeCache::source_path(const slang::SourceManager &sm, slang::BufferID buffer) {
+  const fs::path &full_path = sm.getFullPath(buffer);
+  const std::string name = full_path.string();
+  const size_t pos = name.rfind(VERSION_SEPARATOR);
+  if (pos == std::string::npos)
+    return full_path;
+  return name.substr(0, pos);
+}
+
+bool SyntaxTreeCache::inherited_copy(const fs::path &path) {
+  return path.string().starts_with(INHERITED_PREFIX);
+}
+
+void SyntaxTreeCache::reset(size_t include_dirs_hash, const std::vector<fs::path> &include_dirs) {
+  if (source_manager_)
+    spdlog::info("Syntax tree cache: starting over with a new source manager");
+
+  source_manager_ = std::make_shared<slang::SourceManager>();
+  source_library_ = std::make_shared<slang::SourceLibrary>();
+  source_library_->isDefault = true;
+  source_library_->includeDirs = include_dirs;
+  include_dirs_hash_ = include_dirs_hash;
+  defines_.clear();
+  defines_buffer_ = {};
+  defines_tree_ = nullptr;
+  predefined_macros_.clear();
+  defines_buffers_ = 0;
+
+  entries_.clear();
+  libraries_.clear();
+  headers_.clear();
+  versions_.clear();
+  prefix_buffers_.clear();
+  root_ = nullptr;
+  superseded_bytes_ = 0;
+  metrics::counter("syntax_tree_cache_resets").add();
+}
+
+// Parses the defines, like slang's predefines, and drops the trees that used a changed one.
+void SyntaxTreeCache::apply_defines(const std::vector<std::string> &defines) {
+  std::string text;
+  for (const auto &define : defines) {
+    std::string line = "`define " + define;
+    if (const size_t eq = line.find('='); eq != std::string::npos)
+      line[eq] = ' ';
+    text += line + '\n';
+  }
+  const bool first = !defines_tree_;
+  superseded_bytes_ += defines_buffer_.data.size();
+
+  const auto name = fmt::format("{}{}>", DEFINES_PREFIX, defines_buffers_++);
+  defines_buffer_ = source_manager_->assignText(name, text, {}, source_library_.get());
+  defines_tree_ = slang::syntax::SyntaxTree::fromBuffer(defines_buffer_, *source_manager_);
+  predefined_macros_ = defines_tree_->getDefinedMacros();
+  // The defines are not passed on (see predefined), so what the first file inherits stays the same.
+  auto root = std::make_shared<Inherited>();
+  root->macros_from = defines_tree_;
+  root_ = std::move(root);
+
+  auto changed = changed_macros(defines_, defines);
+  defines_ = defines;
+  if (first || changed.empty())
+    return;
+
+  // A macro whose body uses a changed macro changes too, e.g. `define BUS [`WIDTH-1:0].
+  std::unordered_set<const slang::syntax::DefineDirectiveSyntax *> macros;
+  const auto add_macros = [&macros](const slang::syntax::SyntaxTree *tree) {
+    if (!tree)
+      return;
+    for (const auto *macro : tree->getDefinedMacros())
+      macros.insert(macro);
+  };
+  for (const auto &[path, entry] : entries_) {
+    if (entry.changes_inherited)
+      add_macros(entry.tree.get());
+  }
+  for (const auto &[root, snapshot] : libraries_)
+    add_macros(snapshot.passes_on->macros_from.get());
+
+  std::vector<std::pair<std::string, std::unordered_set<std::string>>> bodies;
+  for (const auto *macro : macros) {
+    std::unordered_set<std::string> names;
+    collect_names(*macro, names);
+    bodies.emplace_back(macro->name.valueText(), std::move(names));
+  }
+  for (bool grew = true; grew;) {
+    grew = false;
+    for (const auto &[name, names] : bodies) {
+      if (!changed.contains(name) && uses_any(names, changed)) {
+        changed.insert(name);
+        grew = true;
+      }
+    }
+  }
+
+  size_t dropped = 0;
+  for (auto &[path, entry] : entries_) {
+    if (entry.tree && uses_any(entry.macro_names, changed)) {
+      entry.tree = nullptr;
+      dropped++;
+    }
+  }
+  std::erase_if(libraries_, [&changed](const auto &item) {
+    return uses_any(item.second.macro_names, changed);
+  });
+  spdlog::info("Syntax tree cache: {} macros changed, used by {} files", changed.size(), dropped);
+}
+
+// Whether a macro came from the defines, current or older ones, by the name of its buffer.
+bool SyntaxTreeCache::predefined(const slang::syntax::DefineDirectiveSyntax &macro) const {
+  const auto buffer = macro.sourceRange().start().buffer();
+  return source_manager_->getFullPath(buffer).string().starts_with(DEFINES_PREFIX);
+}
+
+// The macros a file starts with: the defines that no file before it undefined, then the macros
+// passed on by the files before it. Those include the defines that were in effect when they were
+// parsed, which are left out. Sorted by address, with one macro per name, so that
+// may_pass_on_changes can compare them.
+SyntaxTreeCache::MacroTable SyntaxTreeCache::inherit(const Inherited &inherited) const {
+  MacroTable macros;
+  std::unordered_set<std::string_view> names;
+  if (inherited.macros_from) {
+    for (const auto *macro : inherited.macros_from->getDefinedMacros()) {
+      if (!predefined(*macro) && names.insert(macro->name.valueText()).second)
+        macros.push_back(macro);
+    }
+  }
+  const auto &undefined = inherited.undefined;
+  for (const auto *macro : predefined_macros_) {
+    const auto name = macro->name.valueText();
+    if (!names.contains(name) && !std::binary_search(undefined.begin(), undefined.end(), name))
+      macros.push_back(macro);
+  }
+  std::sort(macros.begin(), macros.end());
+  return macros;
+}
+
+bool SyntaxTreeCache::same(const InheritedPtr &a, const InheritedPtr &b) {
+  if (a == b)
+    return true;
+  return a && b && a->hash == b->hash && a->macros == b->macros &&
+         a->directives == b->directives && a->unit == b->unit;
+}
+
+// What the files after a tree inherit: `inherited` itself unless the tree changed it. `last`, what
+// the file passed on before, is kept if it is the same, so that the files after it keep their trees
+// without comparing it again.
+SyntaxTreeCache::InheritedPtr SyntaxTreeCache::pass_on(
+    const std::shared_ptr<slang::syntax::SyntaxTree> &tree,
+    const InheritedPtr &inherited,
+    const MacroTable &macros,
+    const InheritedPtr &last) {
+  auto defined = tree->getDefinedMacros();
+  std::sort(defined.begin(), defined.end());
+  const bool macros_changed = defined != macros;
+  auto directives = find_directives(*tree);
+  const auto unit = unit_text(*tree, inherited->prefix.id);
+  if (!macros_changed && directives == inherited->directives && unit.empty())
+    return inherited;
+
+  auto passed = std::make_shared<Inherited>();
+  passed->macros_from = macros_changed ? tree : inherited->macros_from;
+  passed->previous = inherited;
+  if (macros_changed) {
+    // The tree lacks the defines that were undefined, before it or in it.
+    std::unordered_set<std::string_view> names;
+    for (const auto *macro : defined)
+      names.insert(macro->name.valueText());
+    for (const auto *macro : predefined_macros_) {
+      if (!names.contains(macro->name.valueText()))
+        passed->undefined.emplace_back(macro->name.valueText());
+    }
+    std::sort(passed->undefined.begin(), passed->undefined.end());
+    passed->macros = macros_text(*tree, passed->undefined);
+  } else {
+    passed->undefined = inherited->undefined;
+    passed->macros = inherited->macros;
+  }
+  passed->directives = std::move(directives);
+  passed->unit = inherited->unit + unit;
+  passed->hash = hash_combine(
+      hash_combine(hash_text(passed->macros), hash_text(passed->directives)),
+      hash_text(passed->unit));
+  passed->prefix = prefix_buffer(passed->directives + passed->unit);
+  if (same(last, passed))
+    return last;
+  return passed;
+}
+
+// The macro table comes out of a hash map, so sort the macros by their text.
+std::string SyntaxTreeCache::macros_text(
+    const slang::syntax::SyntaxTree &tree, const std::vector<std::string> &undefined) const {
+  std::vector<std::string> texts;
+  for (const auto *macro : tree.getDefinedMacros()) {
+    if (!predefined(*macro))
+      texts.push_back(macro->toString());
+  }
+  std::sort(texts.begin(), texts.end());
+  std::string text;
+  for (const auto &macro : texts)
+    text += macro + '\n';
+  for (const auto &name : undefined)
+    text += "`undef " + name + '\n';
+  return text;
+}
+
+slang::SourceBuffer SyntaxTreeCache::prefix_buffer(const std::string &text) {
+  if (text.empty())
+    return {};
+  const auto [itr, added] = prefix_buffers_.try_emplace(text);
+  if (added) {
+    const auto name = fmt::format("{}{}>", INHERITED_PREFIX, prefix_buffers_.size());
+    itr->second = source_manager_->assignText(name, text, {}, source_library_.get());
+  }
+  return itr->second;
+}
+
+void SyntaxTreeCache::invalidate(const fs::path &path) {
+  std::lock_guard lock(invalidated_mutex_);
+  invalidated_.insert(path.string());
+  invalidations_++;
+}
+
+void SyntaxTreeCache::invalidate_buffer(const fs::path &path) {
+  std::lock_guard lock(invalidated_mutex_);
+  invalidated_.insert(path.string());
+}
+
+void SyntaxTreeCache::invalidate_all() {
+  std::lock_guard lock(invalidated_mutex_);
+  all_invalidated_ = true;
+  invalidations_++;
+}
+
+// Included files are read by the preprocessor, which always gets the first text loaded for a path,
+// so any change to them needs a new source manager.
+bool SyntaxTreeCache::headers_changed(
+    const std::unordered_map<std::string, std::string_view> &open_buffers,
+    const std::unordered_set<std::string> &invalidated,
+    bool all_invalidated) const {
+  for (const auto &[path, text_hash] : headers_) {
+    if (!all_invalidated && !invalidated.contains(path))
+      continue;
+
+    if (const auto itr = open_buffers.find(path); itr != open_buffers.end()) {
+      if (hash_text(itr->second) != text_hash)
+        return true;
+      continue;
+    }
+
+    const auto text = read_file(path);
+    if (!text.has_value() || hash_text(text.value()) != text_hash) {
+      spdlog::info("Syntax tree cache: included file changed: {}", path);
+      return true;
+    }
+  }
+  return false;
+}
+
+slang::SourceBuffer SyntaxTreeCache::assign(
+    const std::string &path, std::string_view text, const Entry &previous) {
+  if (!source_manager_->isCached(path))
+    return source_manager_->assignText(path, text, {}, source_library_.get());
+
+  if (previous.buffer)
+    superseded_bytes_ += previous.buffer.data.size();
+
+  const auto name = path + std::string(VERSION_SEPARATOR) + std::to_string(++versions_[path]);
+  return source_manager_->assignText(name, text, {}, source_library_.get());
+}
+
+void SyntaxTreeCache::record_includes(const slang::syntax::SyntaxTree &tree) {
+  for (const auto &include : tree.getIncludeDirectives()) {
+    if (!include.buffer)
+      continue;
+    headers_.try_emplace(
+        source_path(*source_manager_, include.buffer.id).string(), hash_text(include.buffer.data));
+  }
+}
+}  // namespace metalware
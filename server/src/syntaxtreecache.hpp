@@ -0,0 +1,189 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "cancellation.hpp"
+#include "slang/syntax/SyntaxTree.h"
+#include "slang/text/SourceManager.h"
+#include "slang/util/Bag.h"
+#include "workerpool.hpp"
+
+namespace fs = std::filesystem;
+
+namespace metalware {
+struct ParsedSources {
+  std::shared_ptr<slang::SourceManager> source_manager;
+  std::shared_ptr<slang::SourceLibrary> source_library;
+  // In order, one per target file.
+  std::vector<std::shared_ptr<slang::syntax::SyntaxTree>> trees;
+  // The text of each tree, owned by the source manager. Empty for the files of reused libraries.
+  std::vector<std::string_view> texts;
+};
+
+// The target files of a non-principal root unit, typically a vendor library like UVM that does not
+// change during a session. Libraries come first in the target files, in order.
+struct LibraryInputs {
+  fs::path root;
+  uint64_t generation = 0;  // RootUnit::generation
+  size_t file_count = 0;
+};
+
+// Keeps the syntax tree of every target file between compilations and reparses only the files
+// whose text or inherited state changed. Each file inherits from the files before it in compilation
+// order: their macros, so that a `define still reaches later files, the `timescale and
+// `default_nettype in effect after them, and their declarations outside of design units, which
+// belong to $unit. Files that change none of it are parsed in parallel.
+//
+// The trees stay one per file: the directives and $unit declarations a file inherits are parsed
+// ahead of its text, as a copy (see inherited_copy). So unpacked structs, unions and classes
+// declared in $unit are a distinct type in each file after them.
+//
+// All trees of a compilation must share a SourceManager, so the cache owns one. A SourceManager
+// cannot replace the text of a buffer: an edited target file is assigned again under a versioned
+// name (see source_path). The cache starts over with a fresh SourceManager when an included file or
+// the include dirs change, or when too much superseded text has piled up. A change to the defines
+// only reparses the files that test, expand or define one of the changed macros.
+//
+// The loaded text (and the line tables the SourceManager builds for it) is kept too: a file is only
+// read again from disk, or its text compared again, once it has been invalidated. Libraries are
+// frozen further: until their root unit is marked stale, what they inherit changes or
+// invalidate_all() is called, their trees are reused as a whole without looking at their files.
+class SyntaxTreeCache {
+ public:
+  // Marks the text of a file as changed, e.g. when its editor buffer changes or is closed.
+  void invalidate(const fs::path &path);
+  // Like invalidate, for an edit to an open buffer. Callers compare the buffer texts themselves, so
+  // it does not count as an invalidation.
+  void invalidate_buffer(const fs::path &path);
+  // Re-reads every file on the next parse, e.g. after the files changed outside the editor.
+  void invalidate_all();
+  // Grows with every invalidation, so that callers can tell whether any text may have changed.
+  [[nodiscard]] uint64_t invalidations() const {
+    return invalidations_.load();
+  }
+
+  // `buffers` (unsaved editor buffers) take precedence over the files on disk. With `subset`, the
+  // target files are only part of the usual ones: the trees of the others are kept for later, and
+  // so are the trees of unchanged files that inherit something else without them.
+  [[nodiscard]] nonstd::expected<ParsedSources, std::string> parse(
+      const std::vector<std::pair<fs::path, std::string>> &buffers,
+      const std::vector<fs::path> &include_dirs,
+      const std::vector<std::string> &target_files,
+      const std::vector<LibraryInputs> &libraries,
+      const std::vector<std::string> &defines,
+      const CancellationToken &cancellation,
+      bool subset = false);
+
+  // Parses an edited target file ahead of the next parse, with the macros it inherited last time,
+  // so that its syntax errors can be reported at once. The next parse reuses the tree unless the
+  // files before it changed too. Null if the file was not parsed before.
+  [[nodiscard]] std::shared_ptr<slang::syntax::SyntaxTree> parse_edited(
+      const fs::path &path, std::string_view text);
+
+  // The file a buffer was read from, i.e. its full path without the version of an edited file.
+  [[nodiscard]] static fs::path source_path(
+      const slang::SourceManager &sm, slang::BufferID buffer);
+  // Whether a buffer holds what a file inherited from the files before it. Its declarations are
+  // diagnosed where they were written, so diagnostics in it repeat those.
+  [[nodiscard]] static bool inherited_copy(const fs::path &path);
+
+  static constexpr size_t MAX_SUPERSEDED_BYTES = 64 * 1024 * 1024;
+
+ private:
+  // What a file inherits from the files before it. Files that pass it on unchanged share it, and
+  // it is compared by content once a file before them was parsed again.
+  struct Inherited {
+    std::shared_ptr<slang::syntax::SyntaxTree> macros_from;  // see inherit
+    std::shared_ptr<const Inherited> previous;  // owns the macros that macros_from inherited
+    std::vector<std::string> undefined;  // defines that the files before `undef'd, sorted
+    std::string macros;  // the text of the macros passed on and of `undefined`, to compare by
+    std::string directives;  // see find_directives
+    std::string unit;  // the $unit declarations, after preprocessing
+    size_t hash = 0;
+    slang::SourceBuffer prefix;  // the directives and the unit, parsed ahead of a file
+  };
+  using InheritedPtr = std::shared_ptr<const Inherited>;
+
+  struct Entry {
+    slang::SourceBuffer buffer;  // the text, compared on reuse
+    std::shared_ptr<slang::syntax::SyntaxTree> tree;
+    InheritedPtr inherited;
+    InheritedPtr passes_on;  // `inherited`, unless the file changed it
+    // As of its last parse; for new text, whether it may (see may_change_inherited).
+    bool changes_inherited = false;
+    std::vector<std::string> macro_names;  // see collect_macro_names
+  };
+
+  struct LibrarySnapshot {
+    uint64_t generation = 0;
+    InheritedPtr inherited;
+    std::vector<std::shared_ptr<slang::syntax::SyntaxTree>> trees;
+    InheritedPtr passes_on;
+    std::unordered_set<std::string> macro_names;  // of all its files
+  };
+
+  using MacroTable = std::vector<const slang::syntax::DefineDirectiveSyntax *>;
+
+  void reset(size_t include_dirs_hash, const std::vector<fs::path> &include_dirs);
+  void apply_defines(const std::vector<std::string> &defines);
+  [[nodiscard]] bool predefined(const slang::syntax::DefineDirectiveSyntax &macro) const;
+  [[nodiscard]] MacroTable inherit(const Inherited &inherited) const;
+  [[nodiscard]] static bool same(const InheritedPtr &a, const InheritedPtr &b);
+  [[nodiscard]] InheritedPtr pass_on(const std::shared_ptr<slang::syntax::SyntaxTree> &tree,
+      const InheritedPtr &inherited,
+      const MacroTable &macros,
+      const InheritedPtr &last);
+  [[nodiscard]] std::string macros_text(
+      const slang::syntax::SyntaxTree &tree, const std::vector<std::string> &undefined) const;
+  [[nodiscard]] slang::SourceBuffer prefix_buffer(const std::string &text);
+  void parse_entry(Entry &entry,
+      const InheritedPtr &inherited,
+      const MacroTable &macros,
+      const slang::Bag &bag);
+  [[nodiscard]] bool headers_changed(
+      const std::unordered_map<std::string, std::string_view> &open_buffers,
+      const std::unordered_set<std::string> &invalidated,
+      bool all_invalidated) const;
+  [[nodiscard]] slang::SourceBuffer assign(
+      const std::string &path, std::string_view text, const Entry &previous);
+  void record_includes(const slang::syntax::SyntaxTree &tree);
+
+  std::mutex mutex_;  // parse() runs on the diagnostics worker and on request threads
+  std::shared_ptr<slang::SourceManager> source_manager_;
+  std::shared_ptr<slang::SourceLibrary> source_library_;
+  size_t include_dirs_hash_ = 0;
+  std::vector<std::string> defines_;
+  // The defines are parsed into a tree of their own, and every file starts from its macros. Macros
+  // that came from the defines are not passed on, so that files that do not use a changed define
+  // can keep their trees. Trees parsed with older defines keep those alive through `inherited`.
+  slang::SourceBuffer defines_buffer_;
+  std::shared_ptr<slang::syntax::SyntaxTree> defines_tree_;
+  MacroTable predefined_macros_;
+  InheritedPtr root_;  // what the first file inherits
+  size_t defines_buffers_ = 0;  // assigned so far, for their names
+  std::unordered_map<std::string, Entry> entries_;              // by target file path
+  std::unordered_map<std::string, LibrarySnapshot> libraries_;  // by root unit path
+  std::unordered_map<std::string, size_t> headers_;   // other buffers, to their text hash
+  std::unordered_map<std::string, size_t> versions_;  // times a path was reassigned
+  // The prefix buffers of Inherited, by their text.
+  std::unordered_map<std::string, slang::SourceBuffer> prefix_buffers_;
+  size_t superseded_bytes_ = 0;
+  WorkerPool workers_;  // for the files parsed in parallel
+
+  // Separate from mutex_, so that edits never wait for a parse.
+  std::mutex invalidated_mutex_;
+  std::unordered_set<std::string> invalidated_;
+  bool all_invalidated_ = false;
+  std::atomic<uint64_t> invalidations_ = 0;
+};
+}  // namespace metalware
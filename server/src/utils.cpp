@@ -10,6 +10,19 @@
 #include <string_view>
 #include <unordered_set>
 
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+// windows.h first
+#include <psapi.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
 #include "spdlog/spdlog.h"
 
 namespace metalware::utils {
@@ -72,6 +85,30 @@ std::string percent_encode(const std::string& input) {
 }
 #endif
 
+std::optional<size_t> heap_bytes() {
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS_EX counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(),
+          reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters),
+          sizeof(counters)))
+    return std::nullopt;
+  return counters.PrivateUsage;
+#elif defined(__APPLE__)
+  malloc_statistics_t stats;
+  malloc_zone_statistics(nullptr, &stats);
+  return stats.size_in_use;
+#elif defined(__GLIBC__)
+#if __GLIBC_PREREQ(2, 33)
+  const struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  return std::nullopt;
+#endif
+#else
+  return std::nullopt;
+#endif
+}
+
 std::string path_to_uri(const fs::path& p) {
   std::string path_str = p.string();
 #if defined(_WIN32)
@@ -3,7 +3,10 @@
 #include <set>
 #include <vector>
 #include <map>
+#include <optional>
 #include <algorithm>
+#include <string>
+#include <string_view>
 
 namespace fs = std::filesystem;
 namespace metalware::utils {
@@ -39,6 +42,30 @@ inline void trim(std::string &s) {
     inplace_rtrim(s);
 }
 
+// Splits the next line off the front of `text` without copying, with std::getline semantics:
+// returns false once text is exhausted and does not yield an empty line after a trailing '\n'.
+inline bool next_line(std::string_view& text, std::string_view& line) {
+  if (text.empty()) {
+    return false;
+  }
+  const size_t end = text.find('\n');
+  line = text.substr(0, end);
+  text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+  return true;
+}
+
+inline size_t hash_combine(size_t seed, size_t value) {
+  return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+inline size_t hash_text(std::string_view text) {
+  return std::hash<std::string_view>{}(text);
+}
+
+// The bytes the allocator has handed out and not yet taken back, or nullopt where unknown.
+// On Windows, the private bytes of the process.
+std::optional<size_t> heap_bytes();
+
 fs::path uri_to_path(const std::string& uri);
 std::string path_to_uri(const fs::path& p);
 void normalize_path(std::string& p);
@@ -0,0 +1,91 @@
+#include "workerpool.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace metalware {
+
+WorkerPool::WorkerPool(size_t threads) : threads_count_(std::max<size_t>(threads, 1) - 1) {}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+void WorkerPool::run(size_t count, const std::function<void(size_t)>& fn) {
+  if (count <= 1 || threads_count_ == 0) {
+    for (size_t i = 0; i < count; i++) {
+      fn(i);
+    }
+    return;
+  }
+
+  std::lock_guard run_lock(run_mutex_);
+  while (threads_.size() < threads_count_) {
+    threads_.emplace_back([this] {
+      loop();
+    });
+  }
+
+  {
+    std::lock_guard lock(mutex_);
+    fn_ = &fn;
+    count_ = count;
+    next_ = 0;
+    busy_ = threads_.size();
+    loops_++;
+  }
+  wake_.notify_all();
+  work();
+
+  std::unique_lock lock(mutex_);
+  done_.wait(lock, [this] {
+    return busy_ == 0;
+  });
+  fn_ = nullptr;
+  if (error_) {
+    std::rethrow_exception(std::exchange(error_, nullptr));
+  }
+}
+
+void WorkerPool::loop() {
+  uint64_t seen = 0;
+  std::unique_lock lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [&] {
+      return stopping_ || loops_ != seen;
+    });
+    if (stopping_) {
+      return;
+    }
+    seen = loops_;
+
+    lock.unlock();
+    work();
+    lock.lock();
+    if (--busy_ == 0) {
+      done_.notify_one();
+    }
+  }
+}
+
+void WorkerPool::work() {
+  for (size_t i = next_++; i < count_; i = next_++) {
+    try {
+      (*fn_)(i);
+    } catch (...) {
+      std::lock_guard lock(mutex_);
+      if (!error_) {
+        error_ = std::current_exception();
+      }
+      next_ = count_;
+    }
+  }
+}
+}  // namespace metalware
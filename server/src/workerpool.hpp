@@ -0,0 +1,49 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace metalware {
+// Long-lived threads that run the iterations of a loop together with the thread that asks for it,
+// so that a parse does not pay for starting threads. The threads are started on first use. An
+// exception thrown by an iteration stops the ones not started yet and is rethrown to the caller.
+class WorkerPool {
+ public:
+  // By default one thread per core, the calling thread included.
+  explicit WorkerPool(size_t threads = std::max(1U, std::thread::hardware_concurrency()));
+  ~WorkerPool();
+
+  WorkerPool(WorkerPool const&) = delete;
+  WorkerPool& operator=(WorkerPool const&) = delete;
+
+  // Runs fn(0), ..., fn(count - 1) and returns once all of them are done. One loop at a time.
+  void run(size_t count, const std::function<void(size_t)>& fn);
+
+ private:
+  void loop();
+  void work();
+
+  const size_t threads_count_;
+  std::mutex run_mutex_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  const std::function<void(size_t)>* fn_ = nullptr;
+  size_t count_ = 0;
+  std::atomic<size_t> next_ = 0;
+  uint64_t loops_ = 0;  // tells the threads that a new loop started
+  size_t busy_ = 0;     // threads still in the current loop
+  std::exception_ptr error_;
+  bool stopping_ = false;
+
+  std::vector<std::thread> threads_;
+};
+}  // namespace metalware
@@ -0,0 +1,577 @@
+#include <algorithm>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#endif
+
+#include "boundedqueue.hpp"
+#include "cancellation.hpp"
+#include "framereader.hpp"
+#include "jsonwriter.hpp"
+#include "languageclient.hpp"
+#include "lspmessage.hpp"
+#include "metrics.hpp"
+#include "outputwriter.hpp"
+#include "packethandler.hpp"
+#include "socket.hpp"
+#include "utils.hpp"
+
+using namespace metalware;
+
+namespace {
+struct Pipe {
+  int fds[2] = {-1, -1};
+
+  Pipe() {
+#if defined(_WIN32)
+    REQUIRE(_pipe(fds, 1 << 20, _O_BINARY) == 0);
+#else
+    REQUIRE(pipe(fds) == 0);
+#endif
+  }
+
+  ~Pipe() {
+    close_write();
+    close(fds[0]);
+  }
+
+  void write_all(const std::string& data) const {
+    size_t written = 0;
+    while (written < data.size()) {
+      const auto n = write(fds[1], data.data() + written, data.size() - written);
+      REQUIRE(n > 0);
+      written += n;
+    }
+  }
+
+  void close_write() {
+    if (fds[1] != -1) {
+      close(fds[1]);
+      fds[1] = -1;
+    }
+  }
+};
+
+std::string frame(const std::string& body, const std::string& terminator = "\r\n\r\n") {
+  return "Content-Length: " + std::to_string(body.size()) + terminator + body;
+}
+
+// A packet handler whose messages to the client are read back from a pipe.
+class Server {
+ public:
+  Server()
+      : client_(std::make_shared<LanguageClient>(input_.fds[0], output_.fds[1], ServerOptions{})),
+        handler_(client_, ServerOptions{}),
+        reader_(output_.fds[0]) {}
+
+  ~Server() {
+    handler_.stop();
+  }
+
+  void send(const nlohmann::json& message) {
+    REQUIRE(handler_.handle_message(parse_incoming_message(message.dump())));
+  }
+
+  // The next response to request `id`.
+  nlohmann::json receive_response(int id) {
+    return receive_if([id](const nlohmann::json& message) {
+      return !message.contains("method") && message.value("id", -1) == id;
+    });
+  }
+
+  // The next notification or request with `method`.
+  nlohmann::json receive(std::string_view method) {
+    return receive_if([method](const nlohmann::json& message) {
+      return message.value("method", "") == method;
+    });
+  }
+
+  // Whether a message with `method` was passed over while waiting for another one.
+  [[nodiscard]] bool skipped(std::string_view method) const {
+    return std::any_of(skipped_.begin(), skipped_.end(), [method](const auto& message) {
+      return message.value("method", "") == method;
+    });
+  }
+
+ private:
+  template <typename Pred>
+  nlohmann::json receive_if(Pred pred) {
+    while (true) {
+      const auto body = reader_.next_frame();
+      REQUIRE(body.has_value());
+      auto message = nlohmann::json::parse(body.value());
+      if (pred(message))
+        return message;
+      skipped_.push_back(std::move(message));
+    }
+  }
+
+  Pipe input_;
+  Pipe output_;
+  std::shared_ptr<LanguageClient> client_;
+  PacketHandler handler_;
+  FrameReader reader_;
+  std::vector<nlohmann::json> skipped_;
+};
+
+// A project of `files` in a fresh directory under the temp dir.
+fs::path create_project(const std::string& name, const std::map<std::string, std::string>& files) {
+  const fs::path root = fs::temp_directory_path() / name;
+  fs::remove_all(root);
+  fs::create_directories(root);
+  for (const auto& [file, text] : files)
+    std::ofstream(root / file) << text;
+  std::ofstream(root / DOT_FILENAME) << "{}";
+  return root;
+}
+
+nlohmann::json did_change(const fs::path& path, const std::string& text) {
+  return {{"jsonrpc", "2.0"},
+      {"method", "textDocument/didChange"},
+      {"params",
+          {{"textDocument", {{"uri", utils::path_to_uri(path)}, {"version", 1}}},
+              {"contentChanges", {{{"text", text}}}}}}};
+}
+
+nlohmann::json set_project_path(const fs::path& root) {
+  return {{"jsonrpc", "2.0"}, {"method", "setProjectPath"}, {"params", {{"path", root.string()}}}};
+}
+
+nlohmann::json initialize(const nlohmann::json& capabilities) {
+  return {{"jsonrpc", "2.0"},
+      {"id", 0},
+      {"method", "initialize"},
+      {"params", {{"capabilities", capabilities}}}};
+}
+
+bool wait_until(const std::function<bool()>& pred) {
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+  while (!pred()) {
+    if (std::chrono::steady_clock::now() > deadline)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return true;
+}
+}  // namespace
+
+TEST_CASE("Frame Reader", "[frame_reader],[transport]") {
+  Pipe p;
+
+  SECTION("Multiple Frames In One Read") {
+    p.write_all(frame(R"({"id":1})") + frame(R"({"id":22})"));
+    p.close_write();
+
+    FrameReader reader(p.fds[0]);
+    REQUIRE(reader.next_frame() == R"({"id":1})");
+    REQUIRE(reader.next_frame() == R"({"id":22})");
+    REQUIRE_FALSE(reader.next_frame().has_value());
+  }
+  SECTION("Extra Headers And Bare Newlines") {
+    p.write_all("Content-Length: 2\r\nContent-Type: application/vscode-jsonrpc\r\n\r\n{}");
+    p.write_all(frame("[]", "\n\n"));
+    p.close_write();
+
+    FrameReader reader(p.fds[0]);
+    REQUIRE(reader.next_frame() == "{}");
+    REQUIRE(reader.next_frame() == "[]");
+  }
+  SECTION("Frame Larger Than Buffer") {
+    const std::string body = "\"" + std::string(10000, 'x') + "\"";
+    p.write_all(frame(body) + frame("{}"));
+    p.close_write();
+
+    FrameReader reader(p.fds[0], 16);
+    REQUIRE(reader.next_frame() == body);
+    REQUIRE(reader.next_frame() == "{}");
+    REQUIRE(reader.capacity() >= body.size());
+  }
+  SECTION("Missing Content Length Is Skipped") {
+    p.write_all("Content-Type: text\r\n\r\n" + frame("{}"));
+    p.close_write();
+
+    FrameReader reader(p.fds[0]);
+    REQUIRE(reader.next_frame() == "{}");
+  }
+  SECTION("Truncated Frame") {
+    p.write_all("Content-Length: 10\r\n\r\n{}");
+    p.close_write();
+
+    FrameReader reader(p.fds[0]);
+    REQUIRE_FALSE(reader.next_frame().has_value());
+  }
+  SECTION("Frame Over The Maximum Is Skipped") {
+    const std::string body = "\"" + std::string(1000, 'x') + "\"";
+    p.write_all(frame(body) + frame("{}"));
+    p.write_all("Content-Length: 18446744073709551615\r\n\r\n{}");
+    p.close_write();
+
+    FrameReader reader(p.fds[0], 16, 64);
+    REQUIRE(reader.next_frame() == "{}");
+    REQUIRE_FALSE(reader.next_frame().has_value());
+    REQUIRE(reader.capacity() < body.size());
+  }
+}
+
+TEST_CASE("Incoming Message Parsing", "[lsp_message],[transport]") {
+  SECTION("Streamed Did Change") {
+    const auto message = parse_incoming_message(
+        R"({"jsonrpc":"2.0","method":"textDocument/didChange","params":{"textDocument":)"
+        R"({"uri":"file:///a.sv","version":3},"contentChanges":[{"text":"module a;\nendmodule"}]}})");
+    REQUIRE(message.streamed());
+    REQUIRE(message.method == "textDocument/didChange");
+    REQUIRE(message.id.is_null());
+    REQUIRE(message.uri == "file:///a.sv");
+    REQUIRE(message.text == "module a;\nendmodule");
+  }
+  SECTION("Streamed Completion") {
+    const auto message = parse_incoming_message(
+        R"({"jsonrpc":"2.0","id":7,"method":"textDocument/completion","params":{"textDocument":)"
+        R"({"uri":"file:///a.sv"},"position":{"line":4,"character":12}}})");
+    REQUIRE(message.streamed());
+    REQUIRE(message.id == 7);
+    REQUIRE(message.line == 4);
+    REQUIRE(message.character == 12);
+    REQUIRE_FALSE(message.text.has_value());
+  }
+  SECTION("Other Methods Keep The Full Message") {
+    const auto message = parse_incoming_message(
+        R"({"jsonrpc":"2.0","id":"x","method":"setMacros","params":{"macros":[]}})");
+    REQUIRE_FALSE(message.streamed());
+    REQUIRE(message.json["params"]["macros"].is_array());
+    REQUIRE(message.id == "x");
+  }
+  SECTION("Other Messages Are Parsed Into The Same DOM") {
+    const std::string body =
+        R"({"jsonrpc":"2.0","id":3,"result":{"items":[{"a":true,"b":null,"c":-1.5,"d":[1,[2]]}]}})";
+    const auto message = parse_incoming_message(body);
+    REQUIRE_FALSE(message.streamed());
+    REQUIRE(message.json == nlohmann::json::parse(body));
+  }
+  SECTION("Streamed Method After Its Params") {
+    const auto message = parse_incoming_message(
+        R"({"params":{"textDocument":{"uri":"file:///a.sv","text":"module a;"}},)"
+        R"("method":"textDocument/didOpen","jsonrpc":"2.0"})");
+    REQUIRE(message.streamed());
+    REQUIRE(message.uri == "file:///a.sv");
+    REQUIRE(message.text == "module a;");
+  }
+  SECTION("Malformed Input") {
+    REQUIRE_THROWS_AS(parse_incoming_message(R"({"method":)"), nlohmann::json::parse_error);
+  }
+}
+
+TEST_CASE("Bounded Queue", "[bounded_queue],[transport]") {
+  BoundedQueue<int> queue(2);
+
+  SECTION("Producer Blocks While Full") {
+    bool all_pushed = true;
+    std::thread producer([&queue, &all_pushed] {
+      for (int i = 0; i < 100; i++) {
+        all_pushed = queue.push(i) && all_pushed;
+      }
+      queue.close();
+    });
+
+    for (int i = 0; i < 100; i++) {
+      REQUIRE(queue.pop() == i);
+    }
+    REQUIRE_FALSE(queue.pop().has_value());
+    producer.join();
+    REQUIRE(all_pushed);
+    REQUIRE(queue.high_watermark() <= 2);
+  }
+  SECTION("Pop If Only Takes A Matching Head") {
+    REQUIRE(queue.push(1));
+    REQUIRE(queue.push(2));
+    const auto is_odd = [](int i) {
+      return i % 2 == 1;
+    };
+    REQUIRE(queue.pop_if(is_odd, std::chrono::steady_clock::now()) == 1);
+    REQUIRE_FALSE(queue.pop_if(is_odd, std::chrono::steady_clock::now()).has_value());
+    REQUIRE(queue.pop() == 2);
+    REQUIRE_FALSE(
+        queue.pop_if(is_odd, std::chrono::steady_clock::now() + std::chrono::milliseconds(5))
+            .has_value());
+  }
+  SECTION("Close Drains Remaining Items") {
+    REQUIRE(queue.push(1));
+    queue.close();
+    REQUIRE_FALSE(queue.push(2));
+    REQUIRE(queue.pop() == 1);
+    REQUIRE_FALSE(queue.pop().has_value());
+  }
+}
+
+TEST_CASE("Cancellation Registry", "[cancellation],[transport]") {
+  CancellationRegistry registry;
+  REQUIRE_FALSE(CancellationToken().is_cancelled());
+
+  const auto first = registry.add(1);
+  const auto second = registry.add("two");
+  REQUIRE(registry.cancel("two"));
+  REQUIRE(second.is_cancelled());
+  REQUIRE_FALSE(first.is_cancelled());
+
+  registry.remove(1);
+  REQUIRE_FALSE(registry.cancel(1));
+  REQUIRE_FALSE(first.is_cancelled());
+}
+
+TEST_CASE("Diagnostics Pass Cancellation", "[cancellation],[transport]") {
+  Pipe input;
+  Pipe output;
+  const auto client =
+      std::make_shared<LanguageClient>(input.fds[0], output.fds[1], ServerOptions{});
+  client->setup();
+  const auto pass = client->begin_diagnostics_pass();
+
+  // Only a change the handler can apply, and that schedules a pass of its own, cancels it.
+  nlohmann::json change = did_change("/tmp/a.sv", "module a; endmodule");
+  change["params"]["contentChanges"] = nlohmann::json::array({{{"range", nullptr}}});
+  input.write_all(frame(change.dump()));
+  SECTION("Without Text") {
+    input.close_write();
+    client->handle_communication();
+    REQUIRE_FALSE(pass.is_cancelled());
+  }
+  SECTION("With Text") {
+    input.write_all(frame(did_change("/tmp/a.sv", "module a; endmodule").dump()));
+    input.close_write();
+    client->handle_communication();
+    REQUIRE(pass.is_cancelled());
+  }
+}
+
+TEST_CASE("Output Writer", "[output_writer],[transport]") {
+  Pipe p;
+
+  {
+    OutputWriter writer(p.fds[1], 64);
+    for (int i = 0; i < 50; i++) {
+      REQUIRE(writer.write(frame(R"({"id":)" + std::to_string(i) + "}")));
+    }
+    writer.close();
+    REQUIRE_FALSE(writer.write(frame("{}")));
+  }
+  p.close_write();
+
+  FrameReader reader(p.fds[0]);
+  for (int i = 0; i < 50; i++) {
+    REQUIRE(reader.next_frame() == R"({"id":)" + std::to_string(i) + "}");
+  }
+  REQUIRE_FALSE(reader.next_frame().has_value());
+}
+
+TEST_CASE("Json Writer", "[json_writer],[transport]") {
+  JsonWriter writer;
+
+  SECTION("Frame Matches The Body") {
+    writer.begin_object()
+        .key("jsonrpc").value("2.0")
+        .key("id").json(nlohmann::json(12))
+        .key("result").begin_array().value(-3).value(size_t{7}).value(true).null().end_array()
+        .key("empty").begin_object().end_object()
+        .end_object();
+    const size_t offset = writer.finish();
+    const std::string_view framed = std::string_view(writer.buffer()).substr(offset);
+
+    const std::string body = R"({"jsonrpc":"2.0","id":12,"result":[-3,7,true,null],"empty":{}})";
+#if defined(_WIN32)
+    REQUIRE(framed == frame(body, "\n\n"));
+#else
+    REQUIRE(framed == frame(body));
+#endif
+  }
+  SECTION("Strings Are Escaped") {
+    const std::string text = "quote\" back\\ tab\t nl\n \x01 caf\xC3\xA9 bad\xC3 \xED\xA0\x80";
+    writer.begin_object().key("text").value(text).end_object();
+    const size_t offset = writer.finish();
+    const std::string_view body = std::string_view(writer.buffer()).substr(offset);
+
+    const auto parsed = nlohmann::json::parse(body.substr(body.find('{')));
+    REQUIRE(parsed["text"] ==
+            "quote\" back\\ tab\t nl\n \x01 caf\xC3\xA9 bad\xEF\xBF\xBD "
+            "\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD");
+  }
+}
+
+TEST_CASE("Output Writer Offsets And Buffer Reuse", "[output_writer],[transport]") {
+  Pipe p;
+
+  {
+    OutputWriter writer(p.fds[1]);
+    for (int i = 0; i < 10; i++) {
+      JsonWriter json(writer.acquire_buffer());
+      json.begin_object().key("id").value(i).end_object();
+      const size_t offset = json.finish();
+      REQUIRE(writer.write(std::move(json.buffer()), offset));
+    }
+    writer.close();
+  }
+  p.close_write();
+
+  FrameReader reader(p.fds[0]);
+  for (int i = 0; i < 10; i++) {
+    REQUIRE(reader.next_frame() == R"({"id":)" + std::to_string(i) + "}");
+  }
+  REQUIRE_FALSE(reader.next_frame().has_value());
+}
+
+TEST_CASE("Pulled Diagnostics", "[diagnostics],[transport]") {
+  const std::string broken = "module a; missing u(); endmodule\n";
+  const auto root = create_project("hdl_copilot_pull", {{"a.sv", broken}});
+  const std::string uri = utils::path_to_uri(root / "a.sv");
+
+  Server server;
+  server.send(initialize({{"textDocument", {{"diagnostic", nlohmann::json::object()}}},
+      {"workspace", {{"diagnostics", {{"refreshSupport", true}}}}}}));
+  REQUIRE(server.receive_response(0)["result"]["capabilities"].contains("diagnosticProvider"));
+
+  // The client is told to pull instead of being pushed the diagnostics.
+  server.send(set_project_path(root));
+  server.receive("workspace/diagnostic/refresh");
+  REQUIRE_FALSE(server.skipped("textDocument/publishDiagnostics"));
+
+  int id = 0;
+  const auto pull = [&](const std::string& previous_result_id) {
+    nlohmann::json params = {{"textDocument", {{"uri", uri}}}};
+    if (!previous_result_id.empty())
+      params["previousResultId"] = previous_result_id;
+    server.send({{"jsonrpc", "2.0"},
+        {"id", ++id},
+        {"method", "textDocument/diagnostic"},
+        {"params", params}});
+    return server.receive_response(id)["result"];
+  };
+
+  const auto full = pull("");
+  REQUIRE(full["kind"] == "full");
+  REQUIRE_FALSE(full["items"].empty());
+  const std::string result_id = full["resultId"];
+
+  SECTION("Unchanged For The Same Result Id") {
+    const auto unchanged = pull(result_id);
+    REQUIRE(unchanged["kind"] == "unchanged");
+    REQUIRE(unchanged["resultId"] == result_id);
+    REQUIRE_FALSE(unchanged.contains("items"));
+  }
+  SECTION("Cleared Files Are Reported Empty") {
+    server.send(did_change(root / "a.sv", "module a; endmodule\n"));
+    server.receive("workspace/diagnostic/refresh");
+
+    const auto cleared = pull(result_id);
+    REQUIRE(cleared["kind"] == "full");
+    REQUIRE(cleared["items"].empty());
+
+    server.send({{"jsonrpc", "2.0"},
+        {"id", ++id},
+        {"method", "workspace/diagnostic"},
+        {"params", {{"previousResultIds", {{{"uri", uri}, {"value", result_id}}}}}}});
+    const auto items = server.receive_response(id)["result"]["items"];
+    REQUIRE(items.size() == 1);
+    REQUIRE(items[0]["uri"] == uri);
+    REQUIRE(items[0]["kind"] == "full");
+    REQUIRE(items[0]["items"].empty());
+  }
+
+  fs::remove_all(root);
+}
+
+TEST_CASE("Pushed Diagnostics", "[diagnostics],[transport]") {
+  const std::string broken = "module a; missing u(); endmodule\n";
+  const auto root =
+      create_project("hdl_copilot_push", {{"a.sv", broken}, {"b.sv", "module b; endmodule\n"}});
+  const auto published = [](const nlohmann::json& message, std::string_view file) {
+    return message["params"]["uri"].get<std::string>().ends_with(file);
+  };
+
+  // Without refreshSupport the server could never tell the client to pull again.
+  Server server;
+  server.send(initialize({{"textDocument", {{"diagnostic", nlohmann::json::object()}}}}));
+  REQUIRE(server.receive_response(0)["result"]["capabilities"].contains("diagnosticProvider"));
+
+  server.send(set_project_path(root));
+  auto message = server.receive("textDocument/publishDiagnostics");
+  REQUIRE(published(message, "/a.sv"));
+  REQUIRE_FALSE(message["params"]["diagnostics"].empty());
+
+  // A pass that leaves the diagnostics of a file as they were does not send them again.
+  auto& skipped = metrics::counter("diagnostics_publishes_skipped");
+  const int64_t before = skipped.get();
+  server.send(did_change(root / "a.sv", broken + "// same diagnostics\n"));
+  REQUIRE(wait_until([&] {
+    return skipped.get() > before;
+  }));
+  REQUIRE(skipped.get() == before + 1);
+
+  // A fixed file is cleared with an empty list, once: the next message is about another file.
+  server.send(did_change(root / "a.sv", "module a; endmodule\n"));
+  message = server.receive("textDocument/publishDiagnostics");
+  REQUIRE(published(message, "/a.sv"));
+  REQUIRE(message["params"]["diagnostics"].empty());
+
+  server.send(did_change(root / "b.sv", "module b; other u(); endmodule\n"));
+  message = server.receive("textDocument/publishDiagnostics");
+  REQUIRE(published(message, "/b.sv"));
+  REQUIRE_FALSE(message["params"]["diagnostics"].empty());
+
+  fs::remove_all(root);
+}
+
+#if !defined(_WIN32)
+TEST_CASE("Socket Listener", "[socket_listener],[transport]") {
+  // A directory of its own, so that parallel runs and leftovers from earlier ones do not collide.
+  std::string directory = (std::filesystem::temp_directory_path() / "hdl-copilot-XXXXXX").string();
+  REQUIRE(mkdtemp(directory.data()) != nullptr);
+  const std::string path = (std::filesystem::path(directory) / "test.sock").string();
+  auto listener = SocketListener::create("unix:" + path);
+  REQUIRE(listener.has_value());
+  REQUIRE_FALSE(SocketListener::create("tcp:notaport").has_value());
+
+  const int client = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::strcpy(addr.sun_path, path.c_str());
+  REQUIRE(connect(client, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+
+  const auto server = listener->accept_client();
+  REQUIRE(server.has_value());
+
+  // Server to client through the writer, client to server through the (non-blocking) reader.
+  {
+    OutputWriter writer(server.value());
+    REQUIRE(writer.write(frame("{}")));
+  }
+  FrameReader client_reader(client);
+  REQUIRE(client_reader.next_frame() == "{}");
+
+  const std::string request = frame(R"({"method":"initialize"})");
+  REQUIRE(write(client, request.data(), request.size()) == static_cast<ssize_t>(request.size()));
+  close(client);
+
+  FrameReader server_reader(server.value());
+  REQUIRE(server_reader.next_frame() == R"({"method":"initialize"})");
+  REQUIRE_FALSE(server_reader.next_frame().has_value());
+  close(server.value());
+  listener.reset();
+  std::filesystem::remove_all(directory);
+}
+#endif
@@ -1,12 +1,20 @@
+#include <atomic>
 #include <catch2/catch_test_macros.hpp>
 #include <fstream>
+#include <set>
+#include <stdexcept>
 #include <vector>
 
+#include "dependencyclosure.hpp"
+#include "metrics.hpp"
 #include "project.hpp"
 #include "rootunit.hpp"
+#include "scancache.hpp"
 #include "shared.hpp"
 #include "spdlog/spdlog.h"
+#include "suppressions.hpp"
 #include "utils.hpp"
+#include "workerpool.hpp"
 
 using namespace metalware;
 
@@ -310,6 +318,170 @@ TEST_CASE("Valid Includes", "[valid_includes],[includes],[diagnostics]") {
   REQUIRE(project->find_diagnostics().empty());
 }
 
+TEST_CASE("Cancelled Diagnostics", "[cancellation],[diagnostics]") {
+  const fs::path root_directory = "tests/projects/redefinitions";
+  write_dotfile({}, root_directory);
+
+  auto maybe_project = Project::create(root_directory);
+  REQUIRE(maybe_project.has_value());
+  const auto project = maybe_project.value();
+
+  const auto cancellation = CancellationToken::create();
+  cancellation.cancel();
+  REQUIRE_FALSE(project->find_diagnostics(cancellation).has_value());
+
+  // The cancelled pass must not leave a half-built compilation behind.
+  REQUIRE(!project->find_diagnostics().empty());
+}
+
+TEST_CASE("Compilation Snapshots", "[cancellation],[diagnostics]") {
+  const fs::path root_directory = "tests/projects/redefinitions";
+  write_dotfile({}, root_directory);
+
+  auto maybe_project = Project::create(root_directory);
+  REQUIRE(maybe_project.has_value());
+  const auto project = maybe_project.value();
+
+  const auto cancellation = CancellationToken::create();
+  cancellation.cancel();
+  REQUIRE_FALSE(
+      Project::build_snapshot(project->capture_compile_inputs(), cancellation).has_value());
+  REQUIRE(project->current_snapshot() == nullptr);
+
+  auto snapshot = Project::build_snapshot(project->capture_compile_inputs(), {});
+  REQUIRE(snapshot.has_value());
+  project->publish(snapshot.value());
+  REQUIRE(project->current_snapshot() == snapshot.value());
+  REQUIRE(project->get_modules().size() == snapshot.value()->modules.size());
+
+  // A new pass replaces the published snapshot; the old one stays valid for its readers.
+  REQUIRE(snapshot.value()->diagnostics.size() == project->find_diagnostics().size());
+  REQUIRE(project->current_snapshot() != snapshot.value());
+  REQUIRE(snapshot.value()->lookup_index != nullptr);
+}
+
+TEST_CASE("Compilation Snapshot Cache", "[diagnostics]") {
+  const fs::path root_directory = "tests/projects/redefinitions";
+  write_dotfile({}, root_directory);
+
+  auto maybe_project = Project::create(root_directory);
+  REQUIRE(maybe_project.has_value());
+  const auto project = maybe_project.value();
+
+  const auto compile = [&] {
+    auto snapshot = Project::build_snapshot(project->capture_compile_inputs(), {});
+    REQUIRE(snapshot.has_value());
+    project->publish(snapshot.value());
+    return snapshot.value();
+  };
+
+  REQUIRE(project->set_macros({{"FPGA", ""}, {"WIDTH", "8"}}));
+  const auto fpga = compile();
+  REQUIRE(project->set_macros({{"ASIC", ""}}));
+  REQUIRE(project->find_snapshot(project->capture_compile_inputs()) == nullptr);
+  const auto asic = compile();
+
+  // Switching back needs no compilation, whatever the order of the defines.
+  REQUIRE(project->set_macros({{"WIDTH", "8"}, {"FPGA", ""}}));
+  REQUIRE(project->find_snapshot(project->capture_compile_inputs()) == fpga);
+  REQUIRE(project->set_macros({{"ASIC", ""}}));
+  REQUIRE(project->find_snapshot(project->capture_compile_inputs()) == asic);
+
+  // Any other change makes them all stale.
+  project->invalidate_sources();
+  REQUIRE(project->find_snapshot(project->capture_compile_inputs()) == nullptr);
+
+  write_dotfile({}, root_directory);
+}
+
+TEST_CASE("Compilation Snapshot Cache Hit Rate", "[diagnostics]") {
+  const fs::path root_directory = "tests/projects/redefinitions";
+  write_dotfile({}, root_directory);
+
+  auto maybe_project = Project::create(root_directory);
+  REQUIRE(maybe_project.has_value());
+  const auto project = maybe_project.value();
+
+  auto &hits = metrics::counter("snapshot_cache_hits");
+  auto &misses = metrics::counter("snapshot_cache_misses");
+  const int64_t hits_before = hits.get();
+  const int64_t misses_before = misses.get();
+  // Switches to `macros`, compiling only if no snapshot of them is left.
+  const auto switch_to = [&](const std::vector<std::pair<std::string, std::string>> &macros) {
+    REQUIRE(project->set_macros(macros));
+    if (project->find_snapshot(project->capture_compile_inputs()) != nullptr)
+      return;
+    auto snapshot = Project::build_snapshot(project->capture_compile_inputs(), {});
+    REQUIRE(snapshot.has_value());
+    project->publish(snapshot.value());
+  };
+
+  switch_to({{"FPGA", ""}});
+  switch_to({{"ASIC", ""}});
+  switch_to({{"FPGA", ""}});
+  switch_to({{"ASIC", ""}});
+  REQUIRE(hits.get() - hits_before == 2);
+  REQUIRE(misses.get() - misses_before == 2);
+
+  // The snapshots of the other define sets hold the text before an edit, so it costs each of them
+  // one compilation more. Switching between edits hits again.
+  project->update_file_buffer(root_directory / "foo1.sv",
+      "module foo (input logic rst, input logic clk);\n  logic x;\nendmodule\n");
+  switch_to({{"ASIC", ""}});
+  switch_to({{"FPGA", ""}});
+  switch_to({{"ASIC", ""}});
+  switch_to({{"FPGA", ""}});
+  REQUIRE(hits.get() - hits_before == 4);
+  REQUIRE(misses.get() - misses_before == 4);
+
+  write_dotfile({}, root_directory);
+}
+
+TEST_CASE("Compilation Snapshot Accounting", "[diagnostics]") {
+  const fs::path root_directory = "tests/projects/redefinitions";
+  write_dotfile({}, root_directory);
+
+  auto maybe_project = Project::create(root_directory);
+  REQUIRE(maybe_project.has_value());
+  const auto project = maybe_project.value();
+  REQUIRE(project->live_snapshots() == 0);
+
+  SnapshotPtr first = Project::build_snapshot(project->capture_compile_inputs(), {}).value();
+  REQUIRE(project->live_snapshots() == 1);
+  REQUIRE(project->publish(first).empty());
+
+  // Superseded snapshots go as soon as their last reader lets go.
+  project->invalidate_sources();
+  REQUIRE(project->reserve_snapshot());
+  const SnapshotPtr second = Project::build_snapshot(project->capture_compile_inputs(), {}).value();
+  auto superseded = project->publish(second);
+  REQUIRE(superseded.size() == 1);
+  REQUIRE(superseded.front() == first);
+  REQUIRE(project->live_snapshots() == 2);
+
+  first.reset();
+  superseded.clear();
+  REQUIRE(project->live_snapshots() == 1);
+
+  // Readers holding on to superseded snapshots make the next pass skip rather than wait.
+  std::vector<SnapshotPtr> read;
+  while (project->live_snapshots() < MAX_LIVE_SNAPSHOTS) {
+    project->invalidate_sources();
+    read.push_back(Project::build_snapshot(project->capture_compile_inputs(), {}).value());
+    project->publish(read.back());
+  }
+  REQUIRE_FALSE(project->reserve_snapshot());
+  REQUIRE_FALSE(project->find_diagnostics(CancellationToken()).has_value());
+  read.erase(read.begin());
+  REQUIRE(project->reserve_snapshot());
+
+  // Other projects count their own.
+  auto other = Project::create(root_directory);
+  REQUIRE(other.has_value());
+  REQUIRE(other.value()->live_snapshots() == 0);
+  REQUIRE(other.value()->reserve_snapshot());
+}
+
 TEST_CASE("File Level Duplicate Definitions",
     "[file_level_duplicate_definitions],[file_level],[diagnostics]") {
   const fs::path root_directory = "tests/projects/redefinitions";
@@ -351,6 +523,76 @@ TEST_CASE("File Level Exclusion", "[file_level_exclusion],[file_level],[diagnost
   }
 }
 
+TEST_CASE("Glob Level Suppression", "[suppressions],[diagnostics]") {
+  const fs::path root_directory = "tests/projects/redefinitions";
+  nlohmann::json dotfile = {
+      {"projectSuppressions", {{{"name", "DuplicateDefinition"}, {"glob", "foo?.sv"}}}}};
+  write_dotfile(dotfile, root_directory);
+
+  auto maybe_project = Project::create(root_directory);
+  REQUIRE(maybe_project.has_value());
+  const auto project = maybe_project.value();
+
+  for (const auto& diag : project->find_diagnostics()) {
+    REQUIRE(diag.name != "DuplicateDefinition");
+  }
+  write_dotfile({}, root_directory);
+}
+
+TEST_CASE("Diagnostic Pipeline", "[suppressions],[diagnostics]") {
+  const fs::path root_directory = fs::temp_directory_path() / "hdl_copilot_pipeline";
+  fs::remove_all(root_directory);
+  fs::create_directories(root_directory / "excluded");
+  std::ofstream(root_directory / "kept.sv") << "module kept; missing_a u(); endmodule\n";
+  std::ofstream(root_directory / "suppressed.sv") << "module sup; missing_b u(); endmodule\n";
+  std::ofstream(root_directory / "excluded" / "ex.sv") << "module ex; missing_c u(); endmodule\n";
+  const nlohmann::json suppression = {{"name", "UnknownModule"}, {"glob", "suppressed.sv"}};
+  write_dotfile(
+      {{"excludePaths", {"excluded"}}, {"projectSuppressions", {suppression}}}, root_directory);
+
+  auto maybe_project = Project::create(root_directory);
+  REQUIRE(maybe_project.has_value());
+  const auto project = maybe_project.value();
+
+  const auto passed = [](std::string_view stage) {
+    return metrics::counter(fmt::format("diagnostics_passed_{}", stage)).get();
+  };
+  const auto dropped = [](std::string_view stage) {
+    return metrics::counter(fmt::format("diagnostics_dropped_{}", stage)).get();
+  };
+  const std::vector<std::string_view> stages = {
+      "resolve", "exclude", "suppress", "severity", "format"};
+  std::vector<int64_t> passed_before;
+  std::vector<int64_t> dropped_before;
+  for (const auto stage : stages) {
+    passed_before.push_back(passed(stage));
+    dropped_before.push_back(dropped(stage));
+  }
+
+  const auto diagnostics = project->find_diagnostics();
+  REQUIRE(!diagnostics.empty());
+  for (const auto &diag : diagnostics)
+    REQUIRE(diag.filepath.filename() == "kept.sv");
+
+  std::vector<int64_t> passes;
+  std::vector<int64_t> drops;
+  for (size_t i = 0; i < stages.size(); i++) {
+    passes.push_back(passed(stages[i]) - passed_before[i]);
+    drops.push_back(dropped(stages[i]) - dropped_before[i]);
+  }
+  // Each stage sees what the one before let through; the excluded file goes before suppressions
+  // are looked up, and the suppressed diagnostic before its severity is mapped.
+  REQUIRE(drops[1] > 0);
+  REQUIRE(drops[2] > 0);
+  for (size_t i = 1; i < stages.size(); i++)
+    REQUIRE(passes[i] + drops[i] == passes[i - 1]);
+  REQUIRE(drops[3] == 0);
+  REQUIRE(drops[4] == 0);
+  REQUIRE(passes[4] == static_cast<int64_t>(diagnostics.size()));
+
+  fs::remove_all(root_directory);
+}
+
 TEST_CASE("Folder Level Exclusion Diagnostics",
     "[folder_level_exclusion_diags],[folder_level],[diagnostics]") {
   const fs::path root_directory = "tests/projects/exclusions";
@@ -382,3 +624,727 @@ TEST_CASE("Folder Level Exclusion No Diagnostics",
   }
   REQUIRE(diagnostics.empty());
 }
+
+TEST_CASE("Syntax Tree Cache", "[syntax_tree_cache]") {
+  SyntaxTreeCache cache;
+  const std::vector<std::string> targets = {
+      "/virtual/macros.sv", "/virtual/top.sv", "/virtual/leaf.sv"};
+  std::vector<std::pair<fs::path, std::string>> buffers = {
+      {targets[0], "`define WIDTH 8\n"},
+      {targets[1], "module top(input logic [`WIDTH-1:0] a); endmodule\n"},
+      {targets[2], "module leaf; endmodule\n"}};
+
+  const auto first = cache.parse(buffers, {}, targets, {}, {}, {});
+  REQUIRE(first.has_value());
+  REQUIRE(first.value().trees.size() == targets.size());
+  // The macro defined in the first file reaches the second.
+  REQUIRE(first.value().trees[1]->diagnostics().empty());
+
+  SECTION("Unchanged files are not reparsed") {
+    const auto second = cache.parse(buffers, {}, targets, {}, {}, {});
+    REQUIRE(second.has_value());
+    REQUIRE(second.value().trees == first.value().trees);
+  }
+
+  SECTION("Only the edited file is reparsed") {
+    buffers[2].second = "module leaf(input logic a); endmodule\n";
+    cache.invalidate(targets[2]);
+    const auto second = cache.parse(buffers, {}, targets, {}, {}, {});
+    REQUIRE(second.has_value());
+    REQUIRE(second.value().trees[0] == first.value().trees[0]);
+    REQUIRE(second.value().trees[1] == first.value().trees[1]);
+    REQUIRE(second.value().trees[2] != first.value().trees[2]);
+
+    // Locations in the new buffer still map to the edited file.
+    const auto buffer = second.value().trees[2]->root().sourceRange().start().buffer();
+    REQUIRE(SyntaxTreeCache::source_path(*second.value().source_manager, buffer) == targets[2]);
+  }
+
+  SECTION("Files after a changed macro are reparsed") {
+    buffers[0].second = "`define WIDTH 16\n";
+    cache.invalidate(targets[0]);
+    const auto second = cache.parse(buffers, {}, targets, {}, {}, {});
+    REQUIRE(second.has_value());
+    REQUIRE(second.value().trees[1] != first.value().trees[1]);
+    REQUIRE(second.value().trees[2] != first.value().trees[2]);
+  }
+
+  SECTION("Changing a define only reparses the files that use it") {
+    const auto second = cache.parse(buffers, {}, targets, {}, {"SIM"}, {});
+    REQUIRE(second.has_value());
+    REQUIRE(second.value().source_manager == first.value().source_manager);
+    REQUIRE(second.value().trees == first.value().trees);
+
+    const auto third = cache.parse(buffers, {}, targets, {}, {"SIM", "WIDTH=4"}, {});
+    REQUIRE(third.has_value());
+    REQUIRE(third.value().trees[0] != first.value().trees[0]);
+    REQUIRE(third.value().trees[1] != first.value().trees[1]);
+    REQUIRE(third.value().trees[2] == first.value().trees[2]);
+  }
+
+  SECTION("Macros that use a changed define count as changed") {
+    buffers[0].second = "`define BUS [`WIDTH_M1:0]\n";
+    buffers[1].second = "module top(input logic `BUS a); endmodule\n";
+    cache.invalidate(targets[0]);
+    cache.invalidate(targets[1]);
+    const auto second = cache.parse(buffers, {}, targets, {}, {"WIDTH_M1=7"}, {});
+    REQUIRE(second.has_value());
+
+    const auto third = cache.parse(buffers, {}, targets, {}, {"WIDTH_M1=15"}, {});
+    REQUIRE(third.has_value());
+    REQUIRE(third.value().trees[1] != second.value().trees[1]);
+    REQUIRE(third.value().trees[2] == second.value().trees[2]);
+  }
+}
+
+TEST_CASE("Syntax Tree Cache Undefined Define", "[syntax_tree_cache]") {
+  const std::vector<std::string> targets = {
+      "/virtual/undef.sv", "/virtual/b.sv", "/virtual/other.sv", "/virtual/d.sv"};
+  std::vector<std::pair<fs::path, std::string>> buffers = {
+      {targets[0], "`undef WIDTH\n"},
+      {targets[1], "module b(input logic [`WIDTH-1:0] a); endmodule\n"},
+      {targets[2], "`define OTHER 1\n"},
+      {targets[3], "module d(input logic [`WIDTH-1:0] a); endmodule\n"}};
+
+  SyntaxTreeCache cache;
+  const auto first = cache.parse(buffers, {}, targets, {}, {"WIDTH=8"}, {});
+  REQUIRE(first.has_value());
+  // The define stays undefined past files that define other macros.
+  REQUIRE_FALSE(first.value().trees[1]->diagnostics().empty());
+  REQUIRE_FALSE(first.value().trees[3]->diagnostics().empty());
+
+  buffers[0].second = "`undef WIDTH\n`define WIDTH 4\n";
+  cache.invalidate(targets[0]);
+  const auto second = cache.parse(buffers, {}, targets, {}, {"WIDTH=8"}, {});
+  REQUIRE(second.has_value());
+  REQUIRE(second.value().trees[1]->diagnostics().empty());
+  REQUIRE(second.value().trees[3]->diagnostics().empty());
+}
+
+TEST_CASE("Syntax Tree Cache Edited File", "[syntax_tree_cache]") {
+  SyntaxTreeCache cache;
+  const std::vector<std::string> targets = {"/virtual/macros.sv", "/virtual/top.sv"};
+  std::vector<std::pair<fs::path, std::string>> buffers = {
+      {targets[0], "`define WIDTH 8\n"},
+      {targets[1], "module top(input logic [`WIDTH-1:0] a); endmodule\n"}};
+
+  REQUIRE(cache.parse_edited(targets[1], buffers[1].second) == nullptr);
+  const auto first = cache.parse(buffers, {}, targets, {}, {}, {});
+  REQUIRE(first.has_value());
+
+  // The edited file sees the macros of the files before it, and the next parse reuses its tree.
+  buffers[1].second = "module top(input logic [`WIDTH-1:0] a) endmodule\n";
+  cache.invalidate(targets[1]);
+  const auto edited = cache.parse_edited(targets[1], buffers[1].second);
+  REQUIRE(edited != nullptr);
+  REQUIRE(edited != first.value().trees[1]);
+  REQUIRE_FALSE(edited->diagnostics().empty());
+
+  const auto second = cache.parse(buffers, {}, targets, {}, {}, {});
+  REQUIRE(second.has_value());
+  REQUIRE(second.value().trees[1] == edited);
+}
+
+TEST_CASE("Syntax Tree Cache Invalidation", "[syntax_tree_cache]") {
+  const fs::path path = fs::temp_directory_path() / "hdl_copilot_invalidation.sv";
+  std::ofstream(path) << "module a; endmodule\n";
+  const std::vector<std::string> targets = {path.string()};
+
+  SyntaxTreeCache cache;
+  const auto first = cache.parse({}, {}, targets, {}, {}, {});
+  REQUIRE(first.has_value());
+
+  // Files on disk are only read again once invalidated.
+  std::ofstream(path) << "module b; endmodule\n";
+  const auto second = cache.parse({}, {}, targets, {}, {}, {});
+  REQUIRE(second.has_value());
+  REQUIRE(second.value().trees[0] == first.value().trees[0]);
+
+  cache.invalidate(path);
+  const auto third = cache.parse({}, {}, targets, {}, {}, {});
+  REQUIRE(third.has_value());
+  REQUIRE(third.value().trees[0] != first.value().trees[0]);
+
+  fs::remove(path);
+}
+
+TEST_CASE("Worker Pool", "[syntax_tree_cache]") {
+  WorkerPool pool(4);
+  for (int round = 0; round < 3; round++) {
+    std::vector<std::atomic<int>> runs(100);
+    pool.run(runs.size(), [&](size_t i) {
+      runs[i]++;
+    });
+    for (const auto &count : runs)
+      REQUIRE(count == 1);
+  }
+
+  // An exception reaches the calling thread, and the pool keeps working afterwards.
+  const auto fail = [](size_t i) {
+    if (i == 42)
+      throw std::runtime_error("failed");
+  };
+  REQUIRE_THROWS_AS(pool.run(100, fail), std::runtime_error);
+  std::atomic<size_t> sum = 0;
+  pool.run(10, [&](size_t i) {
+    sum += i;
+  });
+  REQUIRE(sum == 45);
+}
+
+TEST_CASE("Syntax Tree Cache Parallel Parse", "[syntax_tree_cache]") {
+  std::vector<std::string> targets;
+  std::vector<std::pair<fs::path, std::string>> buffers;
+  for (int i = 0; i < 64; i++) {
+    targets.push_back("/virtual/leaf" + std::to_string(i) + ".sv");
+    if (i == 16) {
+      buffers.emplace_back(targets.back(), "`define W 4\n");
+    } else if (i > 16) {
+      buffers.emplace_back(targets.back(),
+          "module leaf" + std::to_string(i) + "(input logic [`W-1:0] a); endmodule\n");
+    } else {
+      buffers.emplace_back(targets.back(), "module leaf" + std::to_string(i) + "; endmodule\n");
+    }
+  }
+
+  SyntaxTreeCache cache;
+  const auto parsed = cache.parse(buffers, {}, targets, {}, {}, {});
+  REQUIRE(parsed.has_value());
+  REQUIRE(parsed.value().trees.size() == targets.size());
+
+  // Trees come back in compilation order, and files parsed in parallel still see the macro.
+  for (size_t i = 0; i < targets.size(); i++) {
+    const auto &tree = parsed.value().trees[i];
+    const auto buffer = tree->root().sourceRange().start().buffer();
+    REQUIRE(SyntaxTreeCache::source_path(*parsed.value().source_manager, buffer) == targets[i]);
+    REQUIRE(tree->diagnostics().empty());
+  }
+}
+
+TEST_CASE("Syntax Tree Cache Library Snapshots", "[syntax_tree_cache]") {
+  const std::vector<std::string> targets = {"/lib/pkg.sv", "/lib/macros.sv", "/rtl/top.sv"};
+  std::vector<std::pair<fs::path, std::string>> buffers = {
+      {targets[0], "package pkg; endpackage\n"},
+      {targets[1], "`define LIB_WIDTH 8\n"},
+      {targets[2], "module top(input logic [`LIB_WIDTH-1:0] a); endmodule\n"}};
+  std::vector<LibraryInputs> libraries = {{"/lib", 1, 2}};
+
+  SyntaxTreeCache cache;
+  const auto first = cache.parse(buffers, {}, targets, libraries, {}, {});
+  REQUIRE(first.has_value());
+  REQUIRE(first.value().trees[2]->diagnostics().empty());
+
+  // The library is frozen until its root unit goes stale.
+  buffers[0].second = "package pkg; parameter int P = 1; endpackage\n";
+  cache.invalidate(targets[0]);
+  const auto second = cache.parse(buffers, {}, targets, libraries, {}, {});
+  REQUIRE(second.has_value());
+  REQUIRE(second.value().trees[0] == first.value().trees[0]);
+
+  libraries[0].generation++;
+  const auto third = cache.parse(buffers, {}, targets, libraries, {}, {});
+  REQUIRE(third.has_value());
+  REQUIRE(third.value().trees[0] != first.value().trees[0]);
+  REQUIRE(third.value().trees[1] == first.value().trees[1]);
+  REQUIRE(third.value().trees[2] == first.value().trees[2]);
+
+  // Files changed outside the editor reach a frozen library too.
+  buffers[0].second = "package pkg; parameter int P = 2; endpackage\n";
+  cache.invalidate_all();
+  const auto fourth = cache.parse(buffers, {}, targets, libraries, {}, {});
+  REQUIRE(fourth.has_value());
+  REQUIRE(fourth.value().trees[0] != third.value().trees[0]);
+  REQUIRE(fourth.value().trees[1] == third.value().trees[1]);
+
+  // A root unit created again for the same path does not reuse the generations of the old one.
+  const auto unit = RootUnit::create("/lib");
+  const auto generation = unit->generation();
+  unit->set_stale(true);
+  REQUIRE(unit->generation() != generation);
+  REQUIRE(RootUnit::create("/lib")->generation() != unit->generation());
+}
+
+TEST_CASE("Syntax Tree Cache Directives And Unit", "[syntax_tree_cache]") {
+  const std::vector<std::string> targets = {"/virtual/a.sv", "/virtual/b.sv", "/virtual/c.sv"};
+  std::vector<std::pair<fs::path, std::string>> buffers = {
+      {targets[0], "`timescale 1ns/1ps\n`default_nettype none\nmodule a; endmodule\n"},
+      {targets[1], "module b; assign undeclared = 1'b0; endmodule\n"},
+      {targets[2], "module c; endmodule\n"}};
+  const auto diagnostic_names = [](const ParsedSources &parsed) {
+    slang::Bag bag;
+    slang::ast::Compilation compilation(bag, parsed.source_library.get());
+    for (const auto &tree : parsed.trees)
+      compilation.addSyntaxTree(tree);
+    std::set<std::string> names;
+    for (const auto &diag : compilation.getAllDiagnostics())
+      names.emplace(slang::toString(diag.code));
+    return names;
+  };
+
+  SyntaxTreeCache cache;
+  const auto first = cache.parse(buffers, {}, targets, {}, {}, {});
+  REQUIRE(first.has_value());
+  REQUIRE(first.value().trees.size() == targets.size());
+
+  SECTION("The directives of earlier files still apply") {
+    const auto names = diagnostic_names(first.value());
+    REQUIRE_FALSE(names.contains("MissingTimeScale"));
+    REQUIRE(names.contains("UndeclaredIdentifier"));
+
+    // Files that inherit a changed directive are parsed again.
+    buffers[0].second = "`timescale 1ns/1ps\nmodule a; endmodule\n";
+    cache.invalidate(targets[0]);
+    const auto second = cache.parse(buffers, {}, targets, {}, {}, {});
+    REQUIRE(second.has_value());
+    REQUIRE(second.value().trees[1] != first.value().trees[1]);
+    REQUIRE_FALSE(diagnostic_names(second.value()).contains("UndeclaredIdentifier"));
+  }
+
+  SECTION("Declarations in $unit reach later files") {
+    buffers[1].second = "typedef logic [3:0] nibble_t;\nmodule b; endmodule\n";
+    buffers[2].second = "module c; nibble_t n; endmodule\n";
+    cache.invalidate(targets[1]);
+    cache.invalidate(targets[2]);
+    const auto second = cache.parse(buffers, {}, targets, {}, {}, {});
+    REQUIRE(second.has_value());
+    REQUIRE(second.value().trees.size() == targets.size());
+    REQUIRE(second.value().trees[0] == first.value().trees[0]);
+    REQUIRE_FALSE(diagnostic_names(second.value()).contains("UndeclaredIdentifier"));
+
+    const auto third = cache.parse(buffers, {}, targets, {}, {}, {});
+    REQUIRE(third.has_value());
+    REQUIRE(third.value().trees == second.value().trees);
+  }
+}
+
+TEST_CASE("Syntax Tree Cache Unit Tail", "[syntax_tree_cache]") {
+  std::vector<std::string> targets;
+  std::vector<std::pair<fs::path, std::string>> buffers;
+  for (int i = 0; i < 8; i++) {
+    targets.push_back("/virtual/tail" + std::to_string(i) + ".sv");
+    const auto name = "tail" + std::to_string(i);
+    buffers.emplace_back(targets.back(),
+        i == 1 ? "typedef logic [7:0] byte_t;\nmodule " + name + "; endmodule\n"
+               : "module " + name + "; byte_t b; endmodule\n");
+  }
+  buffers[0].second = "module tail0; endmodule\n";
+
+  const auto undeclared = [](const ParsedSources &parsed) {
+    slang::Bag bag;
+    slang::ast::Compilation compilation(bag, parsed.source_library.get());
+    for (const auto &tree : parsed.trees)
+      compilation.addSyntaxTree(tree);
+    const auto &diagnostics = compilation.getAllDiagnostics();
+    return std::count_if(diagnostics.begin(), diagnostics.end(), [](const auto &diag) {
+      return slang::toString(diag.code) == "UndeclaredIdentifier";
+    });
+  };
+
+  SyntaxTreeCache cache;
+  const auto first = cache.parse(buffers, {}, targets, {}, {}, {});
+  REQUIRE(first.has_value());
+  REQUIRE(first.value().trees.size() == targets.size());
+  REQUIRE(undeclared(first.value()) == 0);
+
+  // An edit after the first declaration in $unit only reparses the edited file.
+  buffers[4].second = "module tail4; byte_t b, c; endmodule\n";
+  cache.invalidate(targets[4]);
+  const auto second = cache.parse(buffers, {}, targets, {}, {}, {});
+  REQUIRE(second.has_value());
+  for (size_t i = 0; i < targets.size(); i++) {
+    if (i == 4) {
+      REQUIRE(second.value().trees[i] != first.value().trees[i]);
+    } else {
+      REQUIRE(second.value().trees[i] == first.value().trees[i]);
+    }
+  }
+
+  // A file that starts declaring in $unit is found after the parse, and the files after it are
+  // parsed again.
+  buffers[5].second = "typedef logic [15:0] word_t;\nmodule tail5; endmodule\n";
+  buffers[6].second = "module tail6; word_t w; endmodule\n";
+  cache.invalidate(targets[5]);
+  cache.invalidate(targets[6]);
+  const auto third = cache.parse(buffers, {}, targets, {}, {}, {});
+  REQUIRE(third.has_value());
+  REQUIRE(third.value().trees[4] == second.value().trees[4]);
+  REQUIRE(third.value().trees[7] != second.value().trees[7]);
+  REQUIRE(undeclared(third.value()) == 0);
+}
+
+TEST_CASE("Scan Cache", "[scan_cache]") {
+  const fs::path source = fs::temp_directory_path() / "hdl_copilot_scan_cache.sv";
+  const fs::path file = fs::temp_directory_path() / "hdl_copilot_scan_cache.json";
+  const std::string text = "`include \"defs.svh\"\nmodule a; endmodule\n";
+  std::ofstream(source) << text;
+  fs::remove(file);
+
+  {
+    ScanCache cache(file);
+    REQUIRE(cache.find(source, text) == nullptr);
+    cache.store(source, text, {{"defs.svh"}, {"a"}});
+    REQUIRE(cache.save());
+  }
+
+  SECTION("Reloaded") {
+    ScanCache cache(file);
+    const auto *summary = cache.find(source, text);
+    REQUIRE(summary != nullptr);
+    REQUIRE(summary->include_names == std::vector<std::string>{"defs.svh"});
+    REQUIRE(summary->declared_names == std::vector<std::string>{"a"});
+  }
+
+  SECTION("File changed") {
+    std::ofstream(source) << "module a; endmodule\n";
+    ScanCache cache(file);
+    REQUIRE(cache.find(source, "module a; endmodule\n") == nullptr);
+  }
+
+  SECTION("Text changed") {
+    // Same size and modification time, as a save within the resolution of the clock may leave.
+    ScanCache cache(file);
+    REQUIRE(cache.find(source, "`include \"defs.svh\"\nmodule b; endmodule\n") == nullptr);
+  }
+
+  SECTION("Saved") {
+    ScanCache cache(file);
+    REQUIRE(cache.find(source, text) != nullptr);
+    cache.invalidate(source);
+    REQUIRE(cache.find(source, text) == nullptr);
+    REQUIRE(cache.save());
+    REQUIRE(ScanCache(file).size() == 0);
+  }
+
+  SECTION("Other version") {
+    std::ofstream(file) << R"({"version": 0, "files": {}})";
+    ScanCache cache(file);
+    REQUIRE(cache.size() == 0);
+  }
+
+  fs::remove(source);
+  fs::remove(file);
+}
+
+TEST_CASE("Dependency Closure", "[dependency_closure]") {
+  SECTION("Declared names") {
+    std::vector<std::string> names;
+    find_declared_names("module automatic foo #(parameter W = 8) (", names);
+    find_declared_names("  interface class bar;", names);
+    find_declared_names("`define WIDTH 8", names);
+    find_declared_names("endmodule : foo", names);
+    REQUIRE(names == std::vector<std::string>{"foo", "bar", "`WIDTH"});
+  }
+
+  SECTION("Referenced names") {
+    const auto names = find_referenced_names(
+        "sub #(`WIDTH) u_sub(); // other u_other();\n/* more */ $display(\"none\", 8'hff);");
+    REQUIRE(names.contains("sub"));
+    REQUIRE(names.contains("`WIDTH"));
+    REQUIRE(names.contains("u_sub"));
+    REQUIRE_FALSE(names.contains("other"));
+    REQUIRE_FALSE(names.contains("more"));
+    REQUIRE_FALSE(names.contains("none"));
+    REQUIRE_FALSE(names.contains("display"));
+  }
+
+  SECTION("Transitive") {
+    const std::map<std::string, std::set<fs::path>> declared_name_to_paths = {
+        {"top", {"top.sv"}},
+        {"mid", {"mid.sv"}},
+        {"leaf", {"leaf.sv"}},
+        {"unused", {"unused.sv"}},
+        {"`WIDTH", {"defs.sv"}}};
+    const std::map<fs::path, std::string> texts = {{"mid.sv", "module mid; leaf u(); endmodule"},
+        {"leaf.sv", "module leaf; logic [`WIDTH-1:0] x; endmodule"},
+        {"defs.sv", "`define WIDTH 8"}};
+    const auto read = [&texts](const fs::path &path) -> std::optional<std::string> {
+      const auto itr = texts.find(path);
+      return itr == texts.end() ? std::nullopt : std::optional<std::string>(itr->second);
+    };
+
+    DependencyClosure closure;
+    REQUIRE(closure.add(
+                "top.sv", "module top; mid u(); endmodule", declared_name_to_paths, {}, read) == 4);
+    REQUIRE(closure.contains("top.sv"));
+    REQUIRE(closure.contains("mid.sv"));
+    REQUIRE(closure.contains("leaf.sv"));
+    REQUIRE(closure.contains("defs.sv"));
+    REQUIRE_FALSE(closure.contains("unused.sv"));
+
+    // Already there, so nothing is read again.
+    REQUIRE(closure.add("mid.sv", texts.at("mid.sv"), declared_name_to_paths, {}, read) == 0);
+
+    closure.reset();
+    REQUIRE(closure.size() == 0);
+  }
+
+  SECTION("Includes") {
+    const auto names =
+        find_include_names("`include \"a.svh\"\n  `include <dir/b.svh> // b\n`define X \"c.svh\"");
+    REQUIRE(names == std::vector<std::string>{"a.svh", "dir/b.svh"});
+
+    // What the included files name counts, through nested includes too, but they are not compiled.
+    const std::map<std::string, std::set<fs::path>> declared_name_to_paths = {
+        {"leaf", {"leaf.sv"}}, {"`WIDTH", {"defs.sv"}}};
+    const std::map<std::string, std::set<fs::path>> include_name_to_paths = {
+        {"body.svh", {"inc/body.svh"}}, {"inc/ports.svh", {"inc/ports.svh"}}};
+    const std::map<fs::path, std::string> texts = {
+        {"inc/body.svh", "`include \"inc/ports.svh\"\nleaf u();"},
+        {"inc/ports.svh", "input logic [`WIDTH-1:0] a"},
+        {"leaf.sv", "module leaf; endmodule"},
+        {"defs.sv", "`define WIDTH 8"}};
+    const auto read = [&texts](const fs::path &path) -> std::optional<std::string> {
+      const auto itr = texts.find(path);
+      return itr == texts.end() ? std::nullopt : std::optional<std::string>(itr->second);
+    };
+
+    DependencyClosure closure;
+    REQUIRE(closure.add("top.sv",
+                "module top;\n`include \"body.svh\"\nendmodule",
+                declared_name_to_paths,
+                include_name_to_paths,
+                read) == 3);
+    REQUIRE(closure.contains("leaf.sv"));
+    REQUIRE(closure.contains("defs.sv"));
+    REQUIRE_FALSE(closure.contains("inc/body.svh"));
+  }
+
+  SECTION("Update") {
+    const fs::path directory = fs::temp_directory_path() / "hdl_copilot_closure";
+    fs::remove_all(directory);
+    fs::create_directories(directory);
+    const fs::path top = directory / "top.sv";
+    const fs::path mid = directory / "mid.sv";
+    const fs::path leaf = directory / "leaf.sv";
+    std::ofstream(mid) << "module mid; endmodule";
+    std::ofstream(leaf) << "module leaf; endmodule";
+    const auto declared_name_to_paths = std::make_shared<const DependencyClosure::NameToPaths>(
+        DependencyClosure::NameToPaths{{"mid", {mid}}, {"leaf", {leaf}}});
+    const auto include_name_to_paths = std::make_shared<const DependencyClosure::NameToPaths>();
+
+    DependencyClosure closure;
+    const std::vector<std::pair<fs::path, std::string>> buffers = {
+        {top, "module top; mid u(); endmodule"}};
+    REQUIRE(closure.update(buffers, declared_name_to_paths, include_name_to_paths) == 2);
+    // Unchanged buffers are not followed again.
+    REQUIRE(closure.update(buffers, declared_name_to_paths, include_name_to_paths) == 0);
+
+    // A file on disk is scanned again once it changes, here by its size.
+    std::ofstream(mid) << "module mid; leaf u(); endmodule";
+    closure.reset();
+    REQUIRE(closure.update(buffers, declared_name_to_paths, include_name_to_paths) == 3);
+    REQUIRE(closure.contains(leaf));
+
+    // New maps follow every buffer again.
+    const fs::path other = directory / "other.sv";
+    const auto moved = std::make_shared<const DependencyClosure::NameToPaths>(
+        DependencyClosure::NameToPaths{{"mid", {mid, other}}, {"leaf", {leaf}}});
+    REQUIRE(closure.update(buffers, declared_name_to_paths, include_name_to_paths) == 0);
+    REQUIRE(closure.update(buffers, moved, include_name_to_paths) == 1);
+    REQUIRE(closure.contains(other));
+    fs::remove_all(directory);
+  }
+
+  SECTION("References") {
+    ReferenceIndex references;
+    references.add("mid.sv", "module mid; leaf u(); endmodule");
+    references.add("leaf.sv", "`define WIDTH 8\nmodule leaf; endmodule");
+    references.add("other.sv", "module other; logic [`WIDTH-1:0] x; endmodule");
+
+    REQUIRE(references.declared_names("leaf.sv") == std::vector<std::string>{"`WIDTH", "leaf"});
+    REQUIRE(references.declared_names("top.sv").empty());
+    REQUIRE(references.referrers({"leaf"}) == std::set<fs::path>{"mid.sv", "leaf.sv"});
+    REQUIRE(references.referrers({"`WIDTH"}) == std::set<fs::path>{"other.sv"});
+    REQUIRE(references.referrers({"top"}).empty());
+
+    // Bind targets, hierarchical references and included text count too.
+    REQUIRE(find_bind_targets("bind leaf chk u_chk();\n  bind mid: u_mid chk u_chk();") ==
+            std::vector<std::string>{"leaf", "mid"});
+    references.add("bind.sv", "bind leaf chk u_chk();");
+    references.add("probe.sv", "module probe; initial $display(top.u.x); endmodule");
+    references.add("body.sv", "module body;\n`include \"body.svh\"\nendmodule", {"mid u();"});
+    REQUIRE(references.bind_targets("bind.sv") == std::vector<std::string>{"leaf"});
+    REQUIRE(references.bind_targets("mid.sv").empty());
+    REQUIRE(references.referrers({"top"}) == std::set<fs::path>{"probe.sv"});
+    REQUIRE(references.referrers({"mid"}) == std::set<fs::path>{"mid.sv", "body.sv"});
+  }
+}
+
+TEST_CASE("Diagnostics Recheck", "[diagnostics]") {
+  const fs::path root_directory = fs::temp_directory_path() / "hdl_copilot_recheck";
+  fs::remove_all(root_directory);
+  fs::create_directories(root_directory);
+  const std::map<std::string, std::string> sources = {
+      {"top_a.sv", "module top_a; mid_a m(); endmodule\n"},
+      {"mid_a.sv", "module mid_a; leaf_a l(); endmodule\n"},
+      {"leaf_a.sv", "module leaf_a; endmodule\n"},
+      {"top_b.sv", "module top_b; mid_b m(); endmodule\n"},
+      {"mid_b.sv", "module mid_b; leaf_b l(); endmodule\n"},
+      {"leaf_b.sv", "module leaf_b; logic x; endmodule\n"},
+      {"probe.sv", "module probe; initial $display(top_b.m.l.x); endmodule\n"},
+      {"bind_b.sv", "bind leaf_b chk u_chk();\n"},
+      {"chk.sv", "module chk; endmodule\n"},
+      {"dup1.sv", "module dup; endmodule\n"},
+      {"dup2.sv", "module dup; endmodule\n"},
+      {"pad1.sv", "module pad1; endmodule\n"},
+      {"pad2.sv", "module pad2; endmodule\n"},
+      {"pad3.sv", "module pad3; endmodule\n"},
+      {"pad4.sv", "module pad4; endmodule\n"},
+      {"defs.sv", "`define UNUSED 1\n"}};
+  for (const auto &[name, text] : sources)
+    std::ofstream(root_directory / name) << text;
+  const fs::path leaf = root_directory / "leaf_b.sv";
+
+  const auto count = [](const std::vector<Diagnostic> &diagnostics, std::string_view file) {
+    return std::count_if(diagnostics.begin(), diagnostics.end(), [file](const auto &diag) {
+      return diag.filepath.filename() == file;
+    });
+  };
+  const auto has_duplicate = [](const std::vector<Diagnostic> &diagnostics) {
+    return std::any_of(diagnostics.begin(), diagnostics.end(), [](const auto &diag) {
+      return diag.name == "DuplicateDefinition";
+    });
+  };
+
+  // Off unless the dotfile asks for it.
+  write_dotfile({}, root_directory);
+  auto maybe_project = Project::create(root_directory);
+  REQUIRE(maybe_project.has_value());
+  maybe_project.value()->find_diagnostics();
+  maybe_project.value()->update_file_buffer(leaf, "module leaf_b; logic x, y; endmodule\n");
+  maybe_project.value()->find_diagnostics();
+  REQUIRE(maybe_project.value()->current_snapshot()->base == nullptr);
+
+  write_dotfile({{"incrementalDiagnostics", true}}, root_directory);
+  maybe_project = Project::create(root_directory);
+  REQUIRE(maybe_project.has_value());
+  const auto project = maybe_project.value();
+
+  REQUIRE(has_duplicate(project->find_diagnostics()));
+  REQUIRE(project->current_snapshot()->base == nullptr);
+  REQUIRE(project->current_snapshot()->references != nullptr);
+
+  // The leaf is checked again with its instantiators up to the top, what binds into it and refers
+  // to those tops hierarchically; the other chain is reused.
+  project->update_file_buffer(leaf, "module leaf_b; missing u(); endmodule\n");
+  auto diagnostics = project->find_diagnostics();
+  auto recheck = project->current_snapshot();
+  REQUIRE(recheck->base != nullptr);
+  const auto &compiled = recheck->compile.target_files;
+  REQUIRE(compiled.size() == 6);
+  for (const auto *name : {"top_b.sv", "probe.sv", "bind_b.sv", "chk.sv"}) {
+    REQUIRE(std::find(compiled.begin(), compiled.end(), (root_directory / name).string()) !=
+            compiled.end());
+  }
+  REQUIRE(count(diagnostics, "leaf_b.sv") > 0);
+  REQUIRE(count(diagnostics, "probe.sv") > 0);
+  REQUIRE(has_duplicate(diagnostics));
+  REQUIRE(project->get_modules().size() == recheck->base->modules.size());
+
+  // Rechecks build on the last full compilation, so undoing the edit clears its diagnostics.
+  project->update_file_buffer(leaf, sources.at("leaf_b.sv"));
+  diagnostics = project->find_diagnostics();
+  REQUIRE(project->current_snapshot()->base == recheck->base);
+  REQUIRE(count(diagnostics, "leaf_b.sv") == 0);
+  REQUIRE(count(diagnostics, "probe.sv") == 0);
+  REQUIRE(has_duplicate(diagnostics));
+
+  // The index has nothing to follow for a file of macros.
+  project->update_file_buffer(root_directory / "defs.sv", "`define UNUSED 2\n");
+  project->find_diagnostics();
+  REQUIRE(project->current_snapshot()->base == nullptr);
+  project->update_file_buffer(root_directory / "defs.sv", sources.at("defs.sv"));
+
+  // An edit reaching most of the project compiles all of it.
+  project->update_file_buffer(root_directory / "pad1.sv",
+      "module pad1; top_a a(); top_b b(); probe p(); pad2 c(); pad3 d(); pad4 e(); endmodule\n");
+  project->find_diagnostics();
+  REQUIRE(project->current_snapshot()->base == nullptr);
+
+  // A base counts against the snapshot cap, and goes with the last snapshot built on it.
+  project->update_file_buffer(root_directory / "pad1.sv", sources.at("pad1.sv"));
+  recheck.reset();
+  REQUIRE(project->set_macros({{"OTHER", ""}}));
+  project->find_diagnostics();
+  project->update_file_buffer(leaf, "module leaf_b; missing u(); endmodule\n");
+  project->find_diagnostics();
+  REQUIRE(project->current_snapshot()->base != nullptr);
+  REQUIRE(project->set_macros({}));
+  project->find_diagnostics();
+  REQUIRE(project->set_macros({{"THIRD", ""}}));
+  project->find_diagnostics();
+  REQUIRE(project->live_snapshots() == MAX_LIVE_SNAPSHOTS);
+  REQUIRE(project->reserve_snapshot());
+  REQUIRE(project->live_snapshots() == MAX_LIVE_SNAPSHOTS - 2);
+  REQUIRE(project->set_macros({{"OTHER", ""}}));
+  REQUIRE(project->find_snapshot(project->capture_compile_inputs()) == nullptr);
+  REQUIRE(project->set_macros({}));
+  REQUIRE(project->find_snapshot(project->capture_compile_inputs()) != nullptr);
+
+  fs::remove_all(root_directory);
+}
+
+TEST_CASE("Suppression Index", "[suppressions]") {
+  SECTION("Globs") {
+    REQUIRE(glob_match("*.sv", "foo.sv"));
+    REQUIRE_FALSE(glob_match("*.sv", "rtl/foo.sv"));
+    REQUIRE(glob_match("**/*.sv", "foo.sv"));
+    REQUIRE(glob_match("**/*.sv", "rtl/core/foo.sv"));
+    REQUIRE(glob_match("rtl/**", "rtl/core/foo.sv"));
+    REQUIRE(glob_match("tb/foo_?.sv", "tb/foo_a.sv"));
+    REQUIRE_FALSE(glob_match("tb/foo_?.sv", "tb/foo_ab.sv"));
+    REQUIRE_FALSE(glob_match("*_tb.sv", "foo.sv"));
+  }
+
+  SECTION("Dotfile entries") {
+    for (const auto& json : {nlohmann::json("UnusedDef"),
+             nlohmann::json{{"name", "UnusedDef"}, {"path", "rtl"}},
+             nlohmann::json{{"name", "UnusedDef"}, {"glob", "**/*_tb.sv"}}}) {
+      const auto suppression = Suppression::from_json(json);
+      REQUIRE(suppression.has_value());
+      REQUIRE(suppression->to_json() == json);
+    }
+    REQUIRE_FALSE(Suppression::from_json(nlohmann::json{{"path", "rtl"}}).has_value());
+  }
+
+  SECTION("Scopes") {
+    const fs::path root = "/project";
+    const SuppressionIndex index({{"Everywhere", Suppression::Scope::Project, ""},
+                                     {"InRtl", Suppression::Scope::Path, "rtl/"},
+                                     {"InTestbenches", Suppression::Scope::Glob, "**/*_tb.sv"}},
+        root);
+
+    REQUIRE(index.suppresses("Everywhere", "/elsewhere/foo.sv"));
+    REQUIRE(index.suppresses("InRtl", "/project/rtl/core/foo.sv"));
+    REQUIRE_FALSE(index.suppresses("InRtl", "/project/tb/foo.sv"));
+    REQUIRE(index.suppresses("InTestbenches", "/project/tb/foo_tb.sv"));
+    REQUIRE_FALSE(index.suppresses("InTestbenches", "/project/rtl/foo.sv"));
+    REQUIRE_FALSE(index.suppresses("Other", "/project/rtl/foo.sv"));
+
+    const SuppressionIndex same({{"Everywhere", Suppression::Scope::Project, ""}}, root);
+    REQUIRE(same.fingerprint() != index.fingerprint());
+  }
+
+  SECTION("Line suppressions") {
+    slang::SourceManager sm;
+    const auto buffer =
+        sm.assignText("/project/foo.sv", "module foo;\n  missing u();\nendmodule\n");
+    const slang::SourceLocation second_line(buffer.id, 14);
+    const auto diagnostic = [&second_line](slang::DiagSubsystem subsystem, uint16_t code) {
+      return slang::Diagnostic(slang::DiagCode(subsystem, code), second_line);
+    };
+
+    SuppressionMatcher matcher(nullptr, sm);
+    const auto file = matcher.file_id(buffer.id);
+    matcher.suppress_line(diagnostic(slang::DiagSubsystem::Declarations, 7));
+    matcher.suppress_line(diagnostic(slang::DiagSubsystem::Parser, UINT16_MAX));
+    REQUIRE(matcher.suppressed(diagnostic(slang::DiagSubsystem::Declarations, 7), file, 2));
+    REQUIRE(matcher.suppressed(diagnostic(slang::DiagSubsystem::Parser, UINT16_MAX), file, 2));
+    REQUIRE_FALSE(matcher.suppressed(diagnostic(slang::DiagSubsystem::Declarations, 7), file, 3));
+
+    // The same number in another subsystem is another code, up to the widest one.
+    REQUIRE_FALSE(matcher.suppressed(diagnostic(slang::DiagSubsystem::Parser, 7), file, 2));
+    REQUIRE_FALSE(matcher.suppressed(diagnostic(slang::DiagSubsystem::Lexer, UINT16_MAX), file, 2));
+    REQUIRE_FALSE(matcher.suppressed(diagnostic(slang::DiagSubsystem::Lexer, 7), file, 2));
+  }
+}